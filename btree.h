@@ -0,0 +1,517 @@
+/*
+ * Copyright (c) 2023 Nick Miller
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+/*
+ * This file defines a B+tree, a companion to the rank-balanced tree in
+ * tree.h for large indexes with integer keys.
+ *
+ * Each node holds up to 'order' keys in an array, so a lookup takes one or
+ * two cache misses per level, and there are about log_order(n) levels
+ * rather than about lg(n).  Interior nodes hold only keys and child
+ * pointers.  Leaves hold keys and pointers to the elements, which need no
+ * entry field of their own, and are chained in order for range scans.  An
+ * element's key is read from keyfield when it is inserted, and must not
+ * change while the element is in the tree.
+ *
+ * Within a node, the position of a key is found by counting the keys less
+ * than it, with no early exit.  The count has no data-dependent branches,
+ * so for integer keys compilers turn it into SIMD compares at -O3, or with
+ * -ftree-vectorize.
+ *
+ * Nodes are never allocated.  The caller gives the tree a pool of nodes
+ * with BT_POOL_ADD, and removals return nodes to it.  An insert that might
+ * need more nodes than the pool holds fails and leaves the tree unchanged.
+ * A node takes about order * (sizeof(key) + sizeof(void *)) bytes; choose
+ * order so that BT_NODE(name) fills a whole number of cache lines.
+ * order must be at least 4.
+ */
+
+#pragma once
+
+#include <stddef.h>
+
+#ifndef __unused
+#define __unused __attribute__((unused))
+#endif
+
+/* Deep enough for 2^32 keys with the smallest order */
+#ifndef BT_MAX_HEIGHT
+#define BT_MAX_HEIGHT	32
+#endif
+
+#define BT_NODE(name)	struct name##_BT_NODE
+
+#define BT_HEAD(name, type)						\
+struct name {								\
+	struct name##_BT_NODE *bth_root;	/* root of the tree */	\
+	struct name##_BT_NODE *bth_free;	/* unused nodes */	\
+	size_t bth_nfree;			/* count of unused nodes */ \
+	int bth_height;				/* levels; 0 if empty */ \
+}
+
+#define BT_INITIALIZER(root)						\
+	{ NULL, NULL, 0, 0 }
+
+#define BT_INIT(head) do {						\
+	(head)->bth_root = NULL;					\
+	(head)->bth_free = NULL;					\
+	(head)->bth_nfree = 0;						\
+	(head)->bth_height = 0;						\
+} while (/*CONSTCOND*/ 0)
+
+#define BT_EMPTY(head)		((head)->bth_root == NULL)
+
+#define _BT_KEY(type, keyfield)	__typeof(((struct type *)0)->keyfield)
+#define _BT_CHILD(node)		((node)->btn_u.btn_child)
+#define _BT_ELM(node)		((node)->btn_u.btn_leaf.btn_elm)
+#define _BT_NEXT(node)		((node)->btn_u.btn_leaf.btn_next)
+
+/* Generates prototypes and inline functions */
+#define BT_PROTOTYPE(name, type, keyfield, order)			\
+	BT_PROTOTYPE_INTERNAL(name, type, keyfield, order,)
+#define BT_PROTOTYPE_STATIC(name, type, keyfield, order)		\
+	BT_PROTOTYPE_INTERNAL(name, type, keyfield, order, __unused static)
+#define BT_PROTOTYPE_INTERNAL(name, type, keyfield, order, attr)	\
+struct name##_BT_NODE {							\
+	unsigned int btn_n;			/* keys in use */	\
+	_BT_KEY(type, keyfield) btn_key[order];				\
+	union {								\
+		struct name##_BT_NODE *btn_child[(order) + 1];		\
+		struct {						\
+			struct type *btn_elm[order];			\
+			struct name##_BT_NODE *btn_next;		\
+		} btn_leaf;						\
+	} btn_u;							\
+};									\
+struct name##_BT_ITER {							\
+	struct name##_BT_NODE *bti_leaf;				\
+	unsigned int bti_i;						\
+};									\
+attr void name##_BT_POOL_ADD(struct name *, struct name##_BT_NODE *,	\
+    size_t);								\
+attr struct type *name##_BT_FIND(struct name *, _BT_KEY(type, keyfield)); \
+attr struct type *name##_BT_NFIND(struct name *, _BT_KEY(type, keyfield)); \
+attr struct type *name##_BT_INSERT(struct name *, struct type *);	\
+attr struct type *name##_BT_REMOVE(struct name *, _BT_KEY(type, keyfield)); \
+attr struct name##_BT_ITER name##_BT_ITER_MIN(struct name *);		\
+attr struct name##_BT_ITER name##_BT_ITER_NFIND(struct name *,		\
+    _BT_KEY(type, keyfield));						\
+									\
+/* Returns the element at the iterator, or NULL past the end */		\
+static inline struct type *						\
+name##_BT_ITER_GET(struct name##_BT_ITER *it)				\
+{									\
+	return (it->bti_leaf == NULL ? NULL :				\
+	    _BT_ELM(it->bti_leaf)[it->bti_i]);				\
+}									\
+									\
+static inline void							\
+name##_BT_ITER_NEXT(struct name##_BT_ITER *it)				\
+{									\
+	if (++it->bti_i == it->bti_leaf->btn_n) {			\
+		it->bti_leaf = _BT_NEXT(it->bti_leaf);			\
+		it->bti_i = 0;						\
+	}								\
+}
+
+/* Main bt operation.
+ * Moves node contents around and keeps the tree balanced.
+ */
+#define BT_GENERATE(name, type, keyfield, order)			\
+	BT_GENERATE_INTERNAL(name, type, keyfield, order,)
+#define BT_GENERATE_STATIC(name, type, keyfield, order)			\
+	BT_GENERATE_INTERNAL(name, type, keyfield, order, __unused static)
+#define BT_GENERATE_INTERNAL(name, type, keyfield, order, attr)		\
+/* Counts the keys of node less than key, or if upper, not greater */	\
+static inline unsigned int						\
+name##_BT_SEARCH(struct name##_BT_NODE *node,				\
+    _BT_KEY(type, keyfield) key, int upper)				\
+{									\
+	unsigned int i, n = node->btn_n, pos = 0;			\
+									\
+	if (upper) {							\
+		for (i = 0; i < n; i++)					\
+			pos += node->btn_key[i] <= key;			\
+	} else {							\
+		for (i = 0; i < n; i++)					\
+			pos += node->btn_key[i] < key;			\
+	}								\
+	return (pos);							\
+}									\
+									\
+/* Descends to the leaf that holds key, recording the path */		\
+static inline struct name##_BT_NODE *					\
+name##_BT_DESCEND(struct name *head, _BT_KEY(type, keyfield) key,	\
+    struct name##_BT_NODE **path, unsigned int *idx)			\
+{									\
+	struct name##_BT_NODE *node = head->bth_root;			\
+	unsigned int i;							\
+	int level;							\
+									\
+	for (level = head->bth_height - 1; level > 0; level--) {	\
+		i = name##_BT_SEARCH(node, key, 1);			\
+		if (path != NULL) {					\
+			path[level] = node;				\
+			idx[level] = i;					\
+		}							\
+		node = _BT_CHILD(node)[i];				\
+	}								\
+	return (node);							\
+}									\
+									\
+static inline struct name##_BT_NODE *					\
+name##_BT_ALLOC(struct name *head)					\
+{									\
+	struct name##_BT_NODE *node = head->bth_free;			\
+									\
+	head->bth_free = _BT_CHILD(node)[0];				\
+	head->bth_nfree--;						\
+	return (node);							\
+}									\
+									\
+static inline void							\
+name##_BT_FREE(struct name *head, struct name##_BT_NODE *node)		\
+{									\
+	_BT_CHILD(node)[0] = head->bth_free;				\
+	head->bth_free = node;						\
+	head->bth_nfree++;						\
+}									\
+									\
+/* Inserts key and elm at pos in a leaf with room for them */		\
+static inline void							\
+name##_BT_LEAF_INSERT(struct name##_BT_NODE *node, unsigned int pos,	\
+    _BT_KEY(type, keyfield) key, struct type *elm)			\
+{									\
+	unsigned int i;							\
+									\
+	for (i = node->btn_n; i > pos; i--) {				\
+		node->btn_key[i] = node->btn_key[i - 1];		\
+		_BT_ELM(node)[i] = _BT_ELM(node)[i - 1];		\
+	}								\
+	node->btn_key[pos] = key;					\
+	_BT_ELM(node)[pos] = elm;					\
+	node->btn_n++;							\
+}									\
+									\
+/* Inserts key at pos, and child after it, in an interior node */	\
+static inline void							\
+name##_BT_NODE_INSERT(struct name##_BT_NODE *node, unsigned int pos,	\
+    _BT_KEY(type, keyfield) key, struct name##_BT_NODE *child)		\
+{									\
+	unsigned int i;							\
+									\
+	for (i = node->btn_n; i > pos; i--) {				\
+		node->btn_key[i] = node->btn_key[i - 1];		\
+		_BT_CHILD(node)[i + 1] = _BT_CHILD(node)[i];		\
+	}								\
+	node->btn_key[pos] = key;					\
+	_BT_CHILD(node)[pos + 1] = child;				\
+	node->btn_n++;							\
+}									\
+									\
+/* Removes the key at pos, and the child after it, from a node */	\
+static inline void							\
+name##_BT_NODE_DELETE(struct name##_BT_NODE *node, unsigned int pos)	\
+{									\
+	unsigned int i;							\
+									\
+	for (i = pos; i + 1 < node->btn_n; i++) {			\
+		node->btn_key[i] = node->btn_key[i + 1];		\
+		_BT_CHILD(node)[i + 1] = _BT_CHILD(node)[i + 2];	\
+	}								\
+	node->btn_n--;							\
+}									\
+									\
+/* Adds n nodes to the pool the tree draws from */			\
+attr void								\
+name##_BT_POOL_ADD(struct name *head, struct name##_BT_NODE *nodes,	\
+    size_t n)								\
+{									\
+	while (n-- > 0)							\
+		name##_BT_FREE(head, &nodes[n]);			\
+}									\
+									\
+/* Finds the element with the given key */				\
+attr struct type *							\
+name##_BT_FIND(struct name *head, _BT_KEY(type, keyfield) key)		\
+{									\
+	struct name##_BT_NODE *node;					\
+	unsigned int pos;						\
+									\
+	if (head->bth_root == NULL)					\
+		return (NULL);						\
+	node = name##_BT_DESCEND(head, key, NULL, NULL);		\
+	pos = name##_BT_SEARCH(node, key, 0);				\
+	if (pos < node->btn_n && node->btn_key[pos] == key)		\
+		return (_BT_ELM(node)[pos]);				\
+	return (NULL);							\
+}									\
+									\
+/* Finds the first element with a key greater than or equal to key */	\
+attr struct type *							\
+name##_BT_NFIND(struct name *head, _BT_KEY(type, keyfield) key)		\
+{									\
+	struct name##_BT_ITER it = name##_BT_ITER_NFIND(head, key);	\
+									\
+	return (name##_BT_ITER_GET(&it));				\
+}									\
+									\
+attr struct name##_BT_ITER						\
+name##_BT_ITER_NFIND(struct name *head, _BT_KEY(type, keyfield) key)	\
+{									\
+	struct name##_BT_ITER it = { NULL, 0 };				\
+									\
+	if (head->bth_root != NULL) {					\
+		it.bti_leaf = name##_BT_DESCEND(head, key, NULL, NULL);	\
+		it.bti_i = name##_BT_SEARCH(it.bti_leaf, key, 0);	\
+		if (it.bti_i == it.bti_leaf->btn_n) {			\
+			it.bti_leaf = _BT_NEXT(it.bti_leaf);		\
+			it.bti_i = 0;					\
+		}							\
+	}								\
+	return (it);							\
+}									\
+									\
+attr struct name##_BT_ITER						\
+name##_BT_ITER_MIN(struct name *head)					\
+{									\
+	struct name##_BT_ITER it = { head->bth_root, 0 };		\
+	int level;							\
+									\
+	for (level = head->bth_height - 1; level > 0; level--)		\
+		it.bti_leaf = _BT_CHILD(it.bti_leaf)[0];		\
+	return (it);							\
+}									\
+									\
+/*									\
+ * Inserts elm.  Returns NULL on success, the element already in the	\
+ * tree with the same key, or elm itself if the pool might run out.	\
+ */									\
+attr struct type *							\
+name##_BT_INSERT(struct name *head, struct type *elm)			\
+{									\
+	struct name##_BT_NODE *path[BT_MAX_HEIGHT], *node, *right;	\
+	unsigned int idx[BT_MAX_HEIGHT], pos, mid, i;			\
+	_BT_KEY(type, keyfield) key = elm->keyfield, sep;		\
+	int level;							\
+									\
+	if (head->bth_root == NULL) {					\
+		if (head->bth_nfree == 0)				\
+			return (elm);					\
+		node = name##_BT_ALLOC(head);				\
+		node->btn_n = 0;					\
+		_BT_NEXT(node) = NULL;					\
+		name##_BT_LEAF_INSERT(node, 0, key, elm);		\
+		head->bth_root = node;					\
+		head->bth_height = 1;					\
+		return (NULL);						\
+	}								\
+	node = name##_BT_DESCEND(head, key, path, idx);			\
+	pos = name##_BT_SEARCH(node, key, 0);				\
+	if (pos < node->btn_n && node->btn_key[pos] == key)		\
+		return (_BT_ELM(node)[pos]);				\
+	if (node->btn_n < (order)) {					\
+		name##_BT_LEAF_INSERT(node, pos, key, elm);		\
+		return (NULL);						\
+	}								\
+	/* Every level may split, and the root may grow */		\
+	if (head->bth_nfree < (size_t)head->bth_height + 1 ||		\
+	    head->bth_height == BT_MAX_HEIGHT)				\
+		return (elm);						\
+	mid = (order) / 2;						\
+	right = name##_BT_ALLOC(head);					\
+	right->btn_n = (order) - mid;					\
+	for (i = 0; i < right->btn_n; i++) {				\
+		right->btn_key[i] = node->btn_key[mid + i];		\
+		_BT_ELM(right)[i] = _BT_ELM(node)[mid + i];		\
+	}								\
+	node->btn_n = mid;						\
+	_BT_NEXT(right) = _BT_NEXT(node);				\
+	_BT_NEXT(node) = right;						\
+	if (pos <= mid)							\
+		name##_BT_LEAF_INSERT(node, pos, key, elm);		\
+	else								\
+		name##_BT_LEAF_INSERT(right, pos - mid, key, elm);	\
+	sep = right->btn_key[0];					\
+	for (level = 1; level < head->bth_height; level++) {		\
+		struct name##_BT_NODE *split;				\
+		_BT_KEY(type, keyfield) up;				\
+									\
+		node = path[level];					\
+		pos = idx[level];					\
+		if (node->btn_n < (order)) {				\
+			name##_BT_NODE_INSERT(node, pos, sep, right);	\
+			return (NULL);					\
+		}							\
+		/* keys[mid] moves up; the halves keep the rest */	\
+		split = name##_BT_ALLOC(head);				\
+		up = node->btn_key[mid];				\
+		split->btn_n = (order) - mid - 1;			\
+		for (i = 0; i < split->btn_n; i++)			\
+			split->btn_key[i] = node->btn_key[mid + 1 + i]; \
+		for (i = 0; i <= split->btn_n; i++)			\
+			_BT_CHILD(split)[i] = _BT_CHILD(node)[mid + 1 + i]; \
+		node->btn_n = mid;					\
+		if (pos <= mid)						\
+			name##_BT_NODE_INSERT(node, pos, sep, right);	\
+		else							\
+			name##_BT_NODE_INSERT(split, pos - mid - 1, sep, \
+			    right);					\
+		sep = up;						\
+		right = split;						\
+	}								\
+	node = name##_BT_ALLOC(head);					\
+	node->btn_n = 1;						\
+	node->btn_key[0] = sep;						\
+	_BT_CHILD(node)[0] = head->bth_root;				\
+	_BT_CHILD(node)[1] = right;					\
+	head->bth_root = node;						\
+	head->bth_height++;						\
+	return (NULL);							\
+}									\
+									\
+/*									\
+ * Removes and returns the element with the given key, or returns NULL.	\
+ * A node left with fewer than half its keys borrows one from a sibling \
+ * or, if neither can spare one, is merged into a sibling.		\
+ */									\
+attr struct type *							\
+name##_BT_REMOVE(struct name *head, _BT_KEY(type, keyfield) key)	\
+{									\
+	struct name##_BT_NODE *path[BT_MAX_HEIGHT], *node, *parent;	\
+	struct name##_BT_NODE *left, *right;				\
+	struct type *elm;						\
+	unsigned int idx[BT_MAX_HEIGHT], pos, i, min;			\
+	int level;							\
+									\
+	if (head->bth_root == NULL)					\
+		return (NULL);						\
+	node = name##_BT_DESCEND(head, key, path, idx);			\
+	pos = name##_BT_SEARCH(node, key, 0);				\
+	if (pos == node->btn_n || node->btn_key[pos] != key)		\
+		return (NULL);						\
+	elm = _BT_ELM(node)[pos];					\
+	for (i = pos; i + 1 < node->btn_n; i++) {			\
+		node->btn_key[i] = node->btn_key[i + 1];		\
+		_BT_ELM(node)[i] = _BT_ELM(node)[i + 1];		\
+	}								\
+	node->btn_n--;							\
+	for (level = 1; level < head->bth_height; level++) {		\
+		min = level == 1 ? (order) / 2 : ((order) - 1) / 2;	\
+		if (node->btn_n >= min)					\
+			return (elm);					\
+		parent = path[level];					\
+		pos = idx[level];					\
+		left = pos > 0 ? _BT_CHILD(parent)[pos - 1] : NULL;	\
+		right = pos < parent->btn_n ?				\
+		    _BT_CHILD(parent)[pos + 1] : NULL;			\
+		if (left != NULL && left->btn_n > min) {		\
+			/* rotate the last entry of left into node */	\
+			if (level == 1) {				\
+				name##_BT_LEAF_INSERT(node, 0,		\
+				    left->btn_key[left->btn_n - 1],	\
+				    _BT_ELM(left)[left->btn_n - 1]);	\
+				parent->btn_key[pos - 1] = node->btn_key[0]; \
+			} else {					\
+				for (i = node->btn_n; i > 0; i--)	\
+					node->btn_key[i] =		\
+					    node->btn_key[i - 1];	\
+				for (i = node->btn_n + 1; i > 0; i--)	\
+					_BT_CHILD(node)[i] =		\
+					    _BT_CHILD(node)[i - 1];	\
+				node->btn_key[0] = parent->btn_key[pos - 1]; \
+				_BT_CHILD(node)[0] =			\
+				    _BT_CHILD(left)[left->btn_n];	\
+				parent->btn_key[pos - 1] =		\
+				    left->btn_key[left->btn_n - 1];	\
+				node->btn_n++;				\
+			}						\
+			left->btn_n--;					\
+			return (elm);					\
+		}							\
+		if (right != NULL && right->btn_n > min) {		\
+			/* rotate the first entry of right into node */	\
+			if (level == 1) {				\
+				name##_BT_LEAF_INSERT(node, node->btn_n, \
+				    right->btn_key[0], _BT_ELM(right)[0]); \
+				for (i = 0; i + 1 < right->btn_n; i++) { \
+					right->btn_key[i] =		\
+					    right->btn_key[i + 1];	\
+					_BT_ELM(right)[i] =		\
+					    _BT_ELM(right)[i + 1];	\
+				}					\
+				parent->btn_key[pos] = right->btn_key[0]; \
+			} else {					\
+				node->btn_key[node->btn_n] =		\
+				    parent->btn_key[pos];		\
+				_BT_CHILD(node)[node->btn_n + 1] =	\
+				    _BT_CHILD(right)[0];		\
+				node->btn_n++;				\
+				parent->btn_key[pos] = right->btn_key[0]; \
+				for (i = 0; i + 1 < right->btn_n; i++)	\
+					right->btn_key[i] =		\
+					    right->btn_key[i + 1];	\
+				for (i = 0; i < right->btn_n; i++)	\
+					_BT_CHILD(right)[i] =		\
+					    _BT_CHILD(right)[i + 1];	\
+			}						\
+			right->btn_n--;					\
+			return (elm);					\
+		}							\
+		/* merge node with a sibling, into the left one */	\
+		if (left != NULL) {					\
+			right = node;					\
+			pos--;						\
+		} else							\
+			left = node;					\
+		if (level == 1) {					\
+			for (i = 0; i < right->btn_n; i++) {		\
+				left->btn_key[left->btn_n + i] =	\
+				    right->btn_key[i];			\
+				_BT_ELM(left)[left->btn_n + i] =	\
+				    _BT_ELM(right)[i];			\
+			}						\
+			left->btn_n += right->btn_n;			\
+			_BT_NEXT(left) = _BT_NEXT(right);		\
+		} else {						\
+			left->btn_key[left->btn_n] = parent->btn_key[pos]; \
+			for (i = 0; i < right->btn_n; i++)		\
+				left->btn_key[left->btn_n + 1 + i] =	\
+				    right->btn_key[i];			\
+			for (i = 0; i <= right->btn_n; i++)		\
+				_BT_CHILD(left)[left->btn_n + 1 + i] =	\
+				    _BT_CHILD(right)[i];		\
+			left->btn_n += right->btn_n + 1;		\
+		}							\
+		name##_BT_NODE_DELETE(parent, pos);			\
+		name##_BT_FREE(head, right);				\
+		node = parent;						\
+	}								\
+	/* node is now the root */					\
+	if (node->btn_n == 0) {						\
+		head->bth_root = head->bth_height > 1 ?			\
+		    _BT_CHILD(node)[0] : NULL;				\
+		head->bth_height--;					\
+		name##_BT_FREE(head, node);				\
+	}								\
+	return (elm);							\
+}
+
+#define BT_POOL_ADD(name, x, y, n)	name##_BT_POOL_ADD(x, y, n)
+#define BT_INSERT(name, x, y)	name##_BT_INSERT(x, y)
+#define BT_REMOVE(name, x, k)	name##_BT_REMOVE(x, k)
+#define BT_FIND(name, x, k)	name##_BT_FIND(x, k)
+#define BT_NFIND(name, x, k)	name##_BT_NFIND(x, k)
+
+#define BT_FOREACH(x, name, head)					\
+	for (struct name##_BT_ITER _bt_it = name##_BT_ITER_MIN(head);	\
+	     ((x) = name##_BT_ITER_GET(&_bt_it)) != NULL;		\
+	     name##_BT_ITER_NEXT(&_bt_it))
+
+#define BT_FOREACH_FROM(x, name, head, k)				\
+	for (struct name##_BT_ITER _bt_it = name##_BT_ITER_NFIND(head, k); \
+	     ((x) = name##_BT_ITER_GET(&_bt_it)) != NULL;		\
+	     name##_BT_ITER_NEXT(&_bt_it))
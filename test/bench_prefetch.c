@@ -0,0 +1,124 @@
+/*
+ * Copyright (c) 2023 Nick Miller
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+/*
+ * Benchmark for the RB_PREFETCH option of tree.h.  This file is built
+ * twice, as bench_prefetch and as bench_prefetch_on with RB_PREFETCH
+ * defined; compare the output of the two.  Nodes are placed in memory in
+ * an order unrelated to their keys, as they are when allocated over time,
+ * so neighbours in the tree are not neighbours in memory.
+ *
+ * usage: bench_prefetch [max nodes, default 10000000]
+ */
+#include "tree.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+struct node {
+        RB_ENTRY(node) node;
+        long key;
+};
+
+static int
+compare(struct node *a, struct node *b)
+{
+        return (a->key > b->key) - (a->key < b->key);
+}
+
+RB_HEAD(tree, node);
+RB_PROTOTYPE(tree, node, node, compare);
+RB_GENERATE(tree, node, node, compare);
+RB_PROTOTYPE_BUILD(tree, node, node);
+RB_GENERATE_BUILD(tree, node, node);
+
+#define LOOKUPS         (1 << 20)
+#define VISITS          (1 << 22)
+
+/* Key k is stored in store[(k * stride) % n], for a stride prime to n */
+struct placement {
+        struct node *store;
+        size_t n, stride, k;
+};
+
+static size_t
+gcd(size_t a, size_t b)
+{
+        while (b != 0) {
+                size_t t = a % b;
+                a = b;
+                b = t;
+        }
+        return a;
+}
+
+static struct node *
+next_node(void *arg)
+{
+        struct placement *p = arg;
+        struct node *elm = &p->store[(p->k * p->stride) % p->n];
+
+        elm->key = (long)p->k++;
+        return elm;
+}
+
+static double
+now_ns(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+int main(int argc, char **argv)
+{
+        struct tree head = RB_INITIALIZER(&head);
+        struct placement p;
+        struct node key, *tmp;
+        size_t max = argc > 1 ? strtoul(argv[1], NULL, 10) : 10000000;
+        size_t n, i, passes;
+        double start, find_ns, walk_ns;
+        long sum = 0;
+
+        p.store = malloc(max * sizeof(*p.store));
+        if (p.store == NULL)
+                return 1;
+#ifdef RB_PREFETCH
+        printf("RB_PREFETCH on\n");
+#else
+        printf("RB_PREFETCH off\n");
+#endif
+        printf("%12s %14s %14s\n", "nodes", "RB_FIND ns", "FOREACH ns");
+        for (n = 1000; n <= max; n *= 10) {
+                p.n = n;
+                p.k = 0;
+                for (p.stride = 2654435761u % n; gcd(p.stride, n) != 1;
+                    p.stride++)
+                        ;
+                RB_BUILD_SORTED_ITER(tree, &head, n, next_node, &p);
+
+                srand(1);
+                start = now_ns();
+                for (i = 0; i < LOOKUPS; i++) {
+                        key.key = (long)(((size_t)rand() * RAND_MAX + rand()) %
+                            n);
+                        tmp = RB_FIND(tree, &head, &key);
+                        sum += tmp->key;
+                }
+                find_ns = (now_ns() - start) / LOOKUPS;
+
+                passes = (VISITS + n - 1) / n;
+                start = now_ns();
+                for (i = 0; i < passes; i++)
+                        RB_FOREACH(tmp, tree, &head)
+                                sum += tmp->key;
+                walk_ns = (now_ns() - start) / ((double)passes * n);
+                printf("%12zu %14.1f %14.2f\n", n, find_ns, walk_ns);
+        }
+        free(p.store);
+        return sum == 0;
+}
@@ -0,0 +1,141 @@
+/*
+ * Copyright (c) 2023 Nick Miller
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+/*
+ * Benchmark for shared trees.  This file is built twice, as bench_shared,
+ * which generates each of TYPES tree types with RB_GENERATE, and as
+ * bench_shared_on with RB_SHARED defined, which generates them with
+ * RB_GENERATE_SHARED over one RB_GENERATE_SHARED_CORE.  Compare the output
+ * of the two, and their sizes.  The types differ in layout, as real ones
+ * do, so the compiler cannot fold their code together.  Each step works
+ * on the next type in turn, so the code of every type competes for the
+ * instruction cache.
+ */
+#include "tree.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define TYPES           40
+#define TYPE_SIZE       1024
+#define OPS             (1 << 23)
+
+#define FOR_TYPES(X)                                                    \
+        X(0) X(1) X(2) X(3) X(4) X(5) X(6) X(7) X(8) X(9)               \
+        X(10) X(11) X(12) X(13) X(14) X(15) X(16) X(17) X(18) X(19)     \
+        X(20) X(21) X(22) X(23) X(24) X(25) X(26) X(27) X(28) X(29)     \
+        X(30) X(31) X(32) X(33) X(34) X(35) X(36) X(37) X(38) X(39)
+
+#ifdef RB_SHARED
+RB_GENERATE_SHARED_CORE();
+#define DECLARE(n)                                                      \
+        struct node##n {                                                \
+                char pad[8 * n + 8];                                    \
+                RB_ENTRY_SHARED(node##n) node;                          \
+                int key;                                                \
+        };                                                              \
+        RB_HEAD_SHARED(tree##n, node##n);                               \
+        static int                                                      \
+        compare##n(struct node##n *a, struct node##n *b)                \
+        {                                                               \
+                return (a->key > b->key) - (a->key < b->key);           \
+        }                                                               \
+        RB_PROTOTYPE_SHARED(tree##n, node##n, node, compare##n);        \
+        RB_GENERATE_SHARED(tree##n, node##n, node, compare##n);
+#else
+#define DECLARE(n)                                                      \
+        struct node##n {                                                \
+                char pad[8 * n + 8];                                    \
+                RB_ENTRY(node##n) node;                                 \
+                int key;                                                \
+        };                                                              \
+        RB_HEAD(tree##n, node##n);                                      \
+        static int                                                      \
+        compare##n(struct node##n *a, struct node##n *b)                \
+        {                                                               \
+                return (a->key > b->key) - (a->key < b->key);           \
+        }                                                               \
+        RB_PROTOTYPE(tree##n, node##n, node, compare##n);               \
+        RB_GENERATE(tree##n, node##n, node, compare##n);
+#endif
+
+FOR_TYPES(DECLARE)
+
+#define STORE(n)                                                        \
+        static struct node##n store##n[2 * TYPE_SIZE];                  \
+        static struct tree##n head##n = RB_INITIALIZER(&head##n);
+FOR_TYPES(STORE)
+
+/* Inserts node i of type t, or removes it if it is there */
+#define TOGGLE(n)                                                       \
+        case n:                                                         \
+                store##n[i].key = i;                                    \
+                if (RB_INSERT(tree##n, &head##n, &store##n[i]) != NULL) \
+                        RB_REMOVE(tree##n, &head##n, &store##n[i]);     \
+                else                                                    \
+                        sum += i;                                       \
+                break;
+
+/* Finds key i in type t */
+#define FIND(n)                                                         \
+        case n:                                                         \
+                key##n.key = i;                                         \
+                sum += RB_FIND(tree##n, &head##n, &key##n) != NULL;     \
+                break;
+
+#define KEY(n)  struct node##n key##n;
+
+static double
+now_ns(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+int main(void)
+{
+        FOR_TYPES(KEY)
+        double start, update_ns, find_ns;
+        long sum = 0;
+        int i, k, t;
+
+        srand(1);
+        for (k = 0; k < TYPES * TYPE_SIZE; k++) {
+                t = k % TYPES;
+                i = rand() % (2 * TYPE_SIZE);
+                switch (t) {
+                FOR_TYPES(TOGGLE)
+                }
+        }
+        start = now_ns();
+        for (k = 0; k < OPS; k++) {
+                t = k % TYPES;
+                i = rand() % (2 * TYPE_SIZE);
+                switch (t) {
+                FOR_TYPES(TOGGLE)
+                }
+        }
+        update_ns = (now_ns() - start) / OPS;
+        start = now_ns();
+        for (k = 0; k < OPS; k++) {
+                t = k % TYPES;
+                i = rand() % (2 * TYPE_SIZE);
+                switch (t) {
+                FOR_TYPES(FIND)
+                }
+        }
+        find_ns = (now_ns() - start) / OPS;
+#ifdef RB_SHARED
+        printf("RB_GENERATE_SHARED, %d types\n", TYPES);
+#else
+        printf("RB_GENERATE, %d types\n", TYPES);
+#endif
+        printf("%-16s %8.1f ns/op\n", "insert/remove", update_ns);
+        printf("%-16s %8.1f ns/op\n", "find", find_ns);
+        return sum == 0;
+}
@@ -0,0 +1,773 @@
+/*
+ * Copyright (c) 2023 Nick Miller
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+/*
+ * Benchmarks for tree.h.  These are built alongside the tests but are not
+ * run by ctest; run ./bench_tree_rb by hand on an idle machine.
+ */
+#include "tree.h"
+#include "btree.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+struct node {
+        RB_ENTRY(node) node;
+        int key;
+};
+
+static int
+compare(struct node *a, struct node *b)
+{
+        if (a->key < b->key) return (-1);
+        else if (a->key > b->key) return (1);
+        return (0);
+}
+
+RB_HEAD(tree, node);
+RB_PROTOTYPE(tree, node, node, compare);
+RB_GENERATE(tree, node, node, compare);
+RB_PROTOTYPE_BUILD(tree, node, node);
+RB_GENERATE_BUILD(tree, node, node);
+RB_PROTOTYPE_JOIN(tree, node, node, compare);
+RB_GENERATE_JOIN(tree, node, node, compare);
+RB_PROTOTYPE_SETOPS(tree, node, node, compare);
+RB_GENERATE_SETOPS(tree, node, node, compare);
+RB_PROTOTYPE_FREEZE(tree, node, node, key);
+RB_GENERATE_FREEZE(tree, node, node, key);
+RB_PROTOTYPE_KEY_FIELD(tree, node, node, key);
+RB_GENERATE_KEY_FIELD(tree, node, node, key);
+RB_PROTOTYPE_BATCH(tree, node, node, compare);
+RB_GENERATE_BATCH(tree, node, node, compare);
+RB_PROTOTYPE_HINT(tree, node, node, compare);
+RB_GENERATE_HINT(tree, node, node, compare);
+RB_PROTOTYPE_PARTITION(tree, node, node);
+RB_GENERATE_PARTITION(tree, node, node);
+
+RB_HEAD_CACHED(qtree, node);
+RB_PROTOTYPE(qtree, node, node, compare);
+RB_GENERATE_CACHED(qtree, node, node, compare);
+
+struct item {
+        int key;
+};
+
+struct cnode {
+        RB_ENTRY_COMPACT(cnode) node;
+        int key;
+};
+
+static struct cnode *cpool;
+
+static int
+ccompare(struct cnode *a, struct cnode *b)
+{
+        return (a->key > b->key) - (a->key < b->key);
+}
+
+RB_HEAD(ctree, cnode);
+RB_PROTOTYPE_COMPACT(ctree, cnode, node, ccompare);
+RB_GENERATE_COMPACT(ctree, cnode, node, ccompare, cpool);
+
+struct tnode {
+        RB_ENTRY_PATH(tnode) node;
+        int key;
+};
+
+static int
+tcompare(struct tnode *a, struct tnode *b)
+{
+        return (a->key > b->key) - (a->key < b->key);
+}
+
+RB_HEAD(ttree, tnode);
+RB_PROTOTYPE_PATH(ttree, tnode, node, tcompare);
+RB_GENERATE_PATH(ttree, tnode, node, tcompare);
+
+/* Persistent tree nodes, from a free list that retired nodes go back on */
+struct vnode {
+        RB_ENTRY_PATH(vnode) node;
+        int key;
+        struct vnode *next;
+};
+
+RB_PERSIST_HEAD(vtree, vnode);
+
+static struct vnode *vfree;
+
+static int
+vcompare(struct vnode *a, struct vnode *b)
+{
+        return (a->key > b->key) - (a->key < b->key);
+}
+
+static struct vnode *
+vnode_alloc(struct vtree *head)
+{
+        struct vnode *elm = vfree;
+
+        (void)head;
+        if (elm != NULL)
+                vfree = elm->next;
+        return elm;
+}
+
+/* No snapshots are kept, so nothing older needs a retired node */
+static void
+vnode_retire(struct vtree *head, struct vnode *elm)
+{
+        (void)head;
+        elm->next = vfree;
+        vfree = elm;
+}
+
+RB_PROTOTYPE_PERSIST(vtree, vnode, node, vcompare);
+RB_GENERATE_PERSIST(vtree, vnode, node, vcompare, vnode_alloc, vnode_retire);
+
+struct lnode {
+        RB_ENTRY_LATCH(lnode) node;
+        int key;
+};
+
+static int
+lcompare(struct lnode *a, struct lnode *b)
+{
+        return (a->key > b->key) - (a->key < b->key);
+}
+
+RB_LATCH_HEAD(ltree, lnode);
+RB_PROTOTYPE_LATCH(ltree, lnode, node, lcompare);
+RB_GENERATE_LATCH(ltree, lnode, node, lcompare);
+
+BT_HEAD(btree, item);
+BT_PROTOTYPE(btree, item, key, 15);
+BT_GENERATE(btree, item, key, 15);
+
+static double
+now_ms(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+/*
+ * A fixed budget of worker threads.  A fork runs the left half on a new
+ * worker while one is free, and otherwise runs both halves itself.
+ */
+struct workers {
+        pthread_mutex_t lock;
+        int idle;
+};
+
+struct job {
+        void (*run)(void *);
+        void *task;
+};
+
+static void *
+job_main(void *arg)
+{
+        struct job *job = arg;
+
+        job->run(job->task);
+        return NULL;
+}
+
+static void
+fork_workers(void (*run)(void *), void *left, void *right, void *arg)
+{
+        struct workers *w = arg;
+        struct job job = { run, left };
+        pthread_t thread;
+        int spawn;
+
+        pthread_mutex_lock(&w->lock);
+        if ((spawn = w->idle > 0))
+                w->idle--;
+        pthread_mutex_unlock(&w->lock);
+        if (!spawn || pthread_create(&thread, NULL, job_main, &job) != 0) {
+                if (spawn) {
+                        pthread_mutex_lock(&w->lock);
+                        w->idle++;
+                        pthread_mutex_unlock(&w->lock);
+                }
+                run(left);
+                run(right);
+                return;
+        }
+        run(right);
+        pthread_join(thread, NULL);
+        pthread_mutex_lock(&w->lock);
+        w->idle++;
+        pthread_mutex_unlock(&w->lock);
+}
+
+#define SET_SIZE        (1 << 20)
+#define SET_CUTOFF      16
+
+static void
+build_sets(struct node *astore, struct node *bstore, struct node **elems,
+    struct tree *a, struct tree *b, struct tree *rest)
+{
+        int i;
+
+        for (i = 0; i < SET_SIZE; i++) {
+                astore[i].key = 2 * i;
+                elems[i] = &astore[i];
+        }
+        RB_BUILD_SORTED(tree, a, elems, SET_SIZE);
+        for (i = 0; i < SET_SIZE; i++) {
+                bstore[i].key = 3 * i;
+                elems[i] = &bstore[i];
+        }
+        RB_BUILD_SORTED(tree, b, elems, SET_SIZE);
+        RB_INIT(rest);
+}
+
+/* Scaling of the join-based set operations with the number of threads */
+static int
+bench_setops(void)
+{
+        static const char *names[] = { "union", "intersect", "difference" };
+        struct node *astore, *bstore, **elems;
+        struct tree a, b, rest;
+        struct workers w;
+        long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+        double start;
+        int op, threads;
+
+        astore = malloc(SET_SIZE * sizeof(*astore));
+        bstore = malloc(SET_SIZE * sizeof(*bstore));
+        elems = malloc(SET_SIZE * sizeof(*elems));
+        if (astore == NULL || bstore == NULL || elems == NULL)
+                return -1;
+        pthread_mutex_init(&w.lock, NULL);
+        printf("set operations, 2 x %d elements\n", SET_SIZE);
+        printf("%-12s %8s %10s\n", "op", "threads", "ms");
+        for (op = RB_SET_UNION; op <= RB_SET_DIFFERENCE; op++) {
+                for (threads = 1; threads == 1 || threads <= ncpu;
+                    threads++) {
+                        build_sets(astore, bstore, elems, &a, &b, &rest);
+                        w.idle = threads - 1;
+                        start = now_ms();
+                        RB_SETOP(tree, &a, &b, &rest, op,
+                            threads > 1 ? fork_workers : NULL, &w,
+                            SET_CUTOFF);
+                        printf("%-12s %8d %10.1f\n", names[op], threads,
+                            now_ms() - start);
+                }
+        }
+        pthread_mutex_destroy(&w.lock);
+        free(elems);
+        free(bstore);
+        free(astore);
+        return 0;
+}
+
+#define LOOKUP_SIZE     (1 << 22)
+#define LOOKUPS         (1 << 22)
+#define BATCH           32
+
+/*
+ * Random lookups in an RB tree, in the same tree frozen into an Eytzinger
+ * array, and in a B+tree over the same keys.
+ */
+static int
+bench_lookup(void)
+{
+        struct node *store, **elems, *tmp;
+        struct item *items;
+        int *keys;
+        BT_NODE(btree) *pool;
+        struct tree rb = RB_INITIALIZER(&rb);
+        struct ctree crb = RB_INITIALIZER(&crb);
+        struct cnode ckey;
+        struct ttree trb = RB_INITIALIZER(&trb);
+        struct tnode *tstore, tkey;
+        struct btree bt = BT_INITIALIZER(&bt);
+        struct node key, bkeys[BATCH], *bkp[BATCH], *bres[BATCH];
+        size_t npool = LOOKUP_SIZE / 4;
+        double start;
+        long found[7] = { 0, 0, 0, 0, 0, 0, 0 };
+        int i, j;
+
+        store = malloc(LOOKUP_SIZE * sizeof(*store));
+        elems = malloc(LOOKUP_SIZE * sizeof(*elems));
+        items = malloc(LOOKUP_SIZE * sizeof(*items));
+        pool = malloc(npool * sizeof(*pool));
+        keys = malloc(LOOKUP_SIZE * sizeof(*keys));
+        cpool = malloc(LOOKUP_SIZE * sizeof(*cpool));
+        tstore = malloc(LOOKUP_SIZE * sizeof(*tstore));
+        if (store == NULL || elems == NULL || items == NULL || pool == NULL ||
+            keys == NULL || cpool == NULL || tstore == NULL)
+                return -1;
+        for (i = 0; i < LOOKUP_SIZE; i++) {
+                store[i].key = items[i].key = 2 * i;
+                elems[i] = &store[i];
+        }
+        RB_BUILD_SORTED(tree, &rb, elems, LOOKUP_SIZE);
+        for (i = 0; i < LOOKUP_SIZE; i++) {
+                cpool[i].key = tstore[i].key = 2 * i;
+                RB_INSERT(ctree, &crb, &cpool[i]);
+                RB_INSERT(ttree, &trb, &tstore[i]);
+        }
+        BT_POOL_ADD(btree, &bt, pool, npool);
+        for (i = 0; i < LOOKUP_SIZE; i++)
+                if (BT_INSERT(btree, &bt, &items[i]) != NULL)
+                        return -1;
+
+        printf("lookups, %d keys\n", LOOKUP_SIZE);
+        srand(1);
+        start = now_ms();
+        for (i = 0; i < LOOKUPS; i++) {
+                key.key = rand() % (2 * LOOKUP_SIZE);
+                tmp = RB_FIND(tree, &rb, &key);
+                found[0] += tmp != NULL;
+        }
+        printf("%-12s %10.1f ns/lookup\n", "RB_FIND",
+            (now_ms() - start) * 1e6 / LOOKUPS);
+        srand(1);
+        start = now_ms();
+        for (i = 0; i < LOOKUPS; i++)
+                found[3] += RB_FIND_KEY(tree, &rb,
+                    rand() % (2 * LOOKUP_SIZE)) != NULL;
+        printf("%-12s %10.1f ns/lookup\n", "RB_FIND_KEY",
+            (now_ms() - start) * 1e6 / LOOKUPS);
+        srand(1);
+        start = now_ms();
+        for (i = 0; i < LOOKUPS; i++) {
+                ckey.key = rand() % (2 * LOOKUP_SIZE);
+                found[5] += RB_FIND(ctree, &crb, &ckey) != NULL;
+        }
+        printf("%-12s %10.1f ns/lookup (%zu- vs %zu-byte nodes)\n",
+            "compact", (now_ms() - start) * 1e6 / LOOKUPS, sizeof(*cpool),
+            sizeof(*store));
+        srand(1);
+        start = now_ms();
+        for (i = 0; i < LOOKUPS; i++) {
+                tkey.key = rand() % (2 * LOOKUP_SIZE);
+                found[6] += RB_FIND(ttree, &trb, &tkey) != NULL;
+        }
+        printf("%-12s %10.1f ns/lookup (%zu-byte nodes)\n", "two-link",
+            (now_ms() - start) * 1e6 / LOOKUPS, sizeof(*tstore));
+        for (j = 0; j < BATCH; j++)
+                bkp[j] = &bkeys[j];
+        srand(1);
+        start = now_ms();
+        for (i = 0; i < LOOKUPS; i += BATCH) {
+                for (j = 0; j < BATCH; j++)
+                        bkeys[j].key = rand() % (2 * LOOKUP_SIZE);
+                RB_FIND_BATCH(tree, &rb, bkp, bres, BATCH);
+                for (j = 0; j < BATCH; j++)
+                        found[4] += bres[j] != NULL;
+        }
+        printf("%-12s %10.1f ns/lookup\n", "RB_FIND_BATCH",
+            (now_ms() - start) * 1e6 / LOOKUPS);
+        RB_FREEZE(tree, &rb, keys, elems, LOOKUP_SIZE);
+        srand(1);
+        start = now_ms();
+        for (i = 0; i < LOOKUPS; i++)
+                found[1] += RB_FROZEN_FIND(tree, keys, elems, LOOKUP_SIZE,
+                    rand() % (2 * LOOKUP_SIZE)) != NULL;
+        printf("%-12s %10.1f ns/lookup\n", "frozen",
+            (now_ms() - start) * 1e6 / LOOKUPS);
+        srand(1);
+        start = now_ms();
+        for (i = 0; i < LOOKUPS; i++)
+                found[2] += BT_FIND(btree, &bt, rand() % (2 * LOOKUP_SIZE)) !=
+                    NULL;
+        printf("%-12s %10.1f ns/lookup\n", "BT_FIND",
+            (now_ms() - start) * 1e6 / LOOKUPS);
+        free(tstore);
+        free(cpool);
+        free(keys);
+        free(pool);
+        free(items);
+        free(elems);
+        free(store);
+        return found[0] == found[1] && found[0] == found[2] &&
+            found[0] == found[3] && found[0] == found[4] &&
+            found[0] == found[5] && found[0] == found[6] ? 0 : -1;
+}
+
+#define QUEUE_SIZE      (1 << 20)
+#define QUEUE_OPS       (1 << 23)
+
+/*
+ * A deadline queue: pop the earliest deadline and requeue it later, with
+ * RB_MIN walking the tree or read from an RB_HEAD_CACHED.
+ */
+static int
+bench_queue(void)
+{
+        struct node *store, *tmp;
+        struct tree rb = RB_INITIALIZER(&rb);
+        struct qtree q = RB_INITIALIZER(&q);
+        long sums[2] = { 0, 0 };
+        double start;
+        int i, k;
+
+        store = malloc(QUEUE_SIZE * sizeof(*store));
+        if (store == NULL)
+                return -1;
+        printf("deadline queue, %d nodes\n", QUEUE_SIZE);
+        for (k = 0; k < 2; k++) {
+                srand(1);
+                for (i = 0; i < QUEUE_SIZE; i++) {
+                        store[i].key = i;
+                        if (k == 0)
+                                RB_INSERT(tree, &rb, &store[i]);
+                        else
+                                RB_INSERT(qtree, &q, &store[i]);
+                }
+                start = now_ms();
+                for (i = 0; i < QUEUE_OPS; i++) {
+                        if (k == 0) {
+                                tmp = RB_MIN(tree, &rb);
+                                RB_REMOVE(tree, &rb, tmp);
+                        } else {
+                                tmp = RB_MIN(qtree, &q);
+                                RB_REMOVE(qtree, &q, tmp);
+                        }
+                        sums[k] += tmp->key;
+                        /* the next deadline, past all but a few */
+                        tmp->key = QUEUE_SIZE + i - rand() % 64;
+                        if (k == 0)
+                                while (RB_INSERT(tree, &rb, tmp) != NULL)
+                                        tmp->key++;
+                        else
+                                while (RB_INSERT(qtree, &q, tmp) != NULL)
+                                        tmp->key++;
+                }
+                printf("%-12s %10.1f ns/op\n", k == 0 ? "walk" :
+                    "cached", (now_ms() - start) * 1e6 / QUEUE_OPS);
+        }
+        free(store);
+        return sums[0] == sums[1] ? 0 : -1;
+}
+
+#define INGEST_SIZE     (1 << 22)
+
+/*
+ * Near-sorted ingest, as from timestamps that arrive slightly out of
+ * order: RB_INSERT from the root against RB_INSERT_HINT from the last
+ * element inserted.
+ */
+static int
+bench_ingest(void)
+{
+        struct node *store, *hint;
+        struct tree rb[2] = { RB_INITIALIZER(&rb[0]), RB_INITIALIZER(&rb[1]) };
+        int counts[2] = { 0, 0 };
+        double start;
+        int i, k;
+
+        store = malloc(INGEST_SIZE * sizeof(*store));
+        if (store == NULL)
+                return -1;
+        printf("near-sorted ingest, %d nodes\n", INGEST_SIZE);
+        for (k = 0; k < 2; k++) {
+                srand(1);
+                for (i = 0; i < INGEST_SIZE; i++)
+                        store[i].key = i * 4 + rand() % 64;
+                hint = NULL;
+                start = now_ms();
+                for (i = 0; i < INGEST_SIZE; i++) {
+                        if (k == 0) {
+                                if (RB_INSERT(tree, &rb[k], &store[i]) == NULL)
+                                        counts[k]++;
+                        } else if (RB_INSERT_HINT(tree, &rb[k], hint,
+                            &store[i]) == NULL) {
+                                hint = &store[i];
+                                counts[k]++;
+                        }
+                }
+                printf("%-12s %10.1f ns/op\n", k == 0 ? "RB_INSERT" :
+                    "INSERT_HINT", (now_ms() - start) * 1e6 / INGEST_SIZE);
+        }
+        free(store);
+        return counts[0] == counts[1] ? 0 : -1;
+}
+
+#define CHURN_SIZE      (1 << 20)
+#define CHURN_OPS       (1 << 22)
+
+/* Random insert and remove: a two-link tree against a persistent one */
+static int
+bench_persist(void)
+{
+        struct ttree trb = RB_INITIALIZER(&trb);
+        struct vtree vrb = RB_INITIALIZER(&vrb);
+        struct tnode *tstore;
+        struct vnode *vstore, vkey, *elm;
+        long sums[2] = { 0, 0 };
+        double start;
+        int i, j, k;
+
+        tstore = malloc(2 * CHURN_SIZE * sizeof(*tstore));
+        vstore = malloc(4 * CHURN_SIZE * sizeof(*vstore));
+        if (tstore == NULL || vstore == NULL)
+                return -1;
+        for (i = 0; i < 4 * CHURN_SIZE; i++) {
+                vstore[i].next = vfree;
+                vfree = &vstore[i];
+        }
+        for (i = 0; i < CHURN_SIZE; i++) {
+                tstore[2 * i].key = 2 * i;
+                RB_INSERT(ttree, &trb, &tstore[2 * i]);
+                elm = vnode_alloc(&vrb);
+                elm->key = 2 * i;
+                RB_INSERT(vtree, &vrb, elm);
+        }
+        printf("insert and remove, %d nodes\n", CHURN_SIZE);
+        for (k = 0; k < 2; k++) {
+                srand(1);
+                start = now_ms();
+                for (i = 0; i < CHURN_OPS; i++) {
+                        j = rand() % (2 * CHURN_SIZE);
+                        if (k == 0) {
+                                tstore[j].key = j;
+                                if (RB_INSERT(ttree, &trb, &tstore[j]) != NULL)
+                                        RB_REMOVE(ttree, &trb, &tstore[j]);
+                                else
+                                        sums[k] += j;
+                                continue;
+                        }
+                        elm = vnode_alloc(&vrb);
+                        elm->key = vkey.key = j;
+                        if (RB_INSERT(vtree, &vrb, elm) != NULL) {
+                                vnode_retire(&vrb, elm);
+                                RB_REMOVE(vtree, &vrb, &vkey);
+                        } else
+                                sums[k] += j;
+                }
+                printf("%-12s %10.1f ns/op\n", k == 0 ? "two-link" :
+                    "persistent", (now_ms() - start) * 1e6 / CHURN_OPS);
+        }
+        free(tstore);
+        free(vstore);
+        return sums[0] == sums[1] ? 0 : -1;
+}
+
+#define READ_SIZE       (1 << 20)
+#define READ_LOOKUPS    (1 << 21)
+#define READ_THREADS    64
+
+/*
+ * Readers share a tree with one writer that keeps inserting and removing
+ * odd keys: a tree behind a rwlock against a latch tree.
+ */
+struct shared {
+        struct tree rb;
+        pthread_rwlock_t lock;
+        struct ltree latch;
+        struct node *nodes;
+        struct lnode *lnodes;
+        int use_latch;
+        volatile int stop;
+};
+
+struct reader {
+        struct shared *shared;
+        unsigned int seed;
+        long found;
+};
+
+static void *
+reader_main(void *arg)
+{
+        struct reader *reader = arg;
+        struct shared *sh = reader->shared;
+        struct node key;
+        struct lnode lkey;
+        int i;
+
+        reader->found = 0;
+        for (i = 0; i < READ_LOOKUPS; i++) {
+                key.key = lkey.key = (rand_r(&reader->seed) % READ_SIZE) * 2;
+                if (sh->use_latch)
+                        reader->found += RB_FIND(ltree, &sh->latch,
+                            &lkey) != NULL;
+                else {
+                        pthread_rwlock_rdlock(&sh->lock);
+                        reader->found += RB_FIND(tree, &sh->rb, &key) != NULL;
+                        pthread_rwlock_unlock(&sh->lock);
+                }
+        }
+        return NULL;
+}
+
+static void *
+writer_main(void *arg)
+{
+        struct shared *sh = arg;
+        unsigned int seed = 1;
+        int i;
+
+        while (!sh->stop) {
+                i = (rand_r(&seed) % READ_SIZE) * 2 + 1;
+                if (sh->use_latch) {
+                        if (RB_INSERT(ltree, &sh->latch, &sh->lnodes[i]))
+                                RB_REMOVE(ltree, &sh->latch, &sh->lnodes[i]);
+                } else {
+                        pthread_rwlock_wrlock(&sh->lock);
+                        if (RB_INSERT(tree, &sh->rb, &sh->nodes[i]))
+                                RB_REMOVE(tree, &sh->rb, &sh->nodes[i]);
+                        pthread_rwlock_unlock(&sh->lock);
+                }
+        }
+        return NULL;
+}
+
+static int
+bench_readers(void)
+{
+        static struct shared sh;
+        struct reader readers[READ_THREADS];
+        pthread_t threads[READ_THREADS], writer;
+        long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+        double start, ns[2];
+        int i, k;
+
+        sh.nodes = malloc(2 * READ_SIZE * sizeof(*sh.nodes));
+        sh.lnodes = malloc(2 * READ_SIZE * sizeof(*sh.lnodes));
+        if (sh.nodes == NULL || sh.lnodes == NULL)
+                return -1;
+        RB_INIT(&sh.rb);
+        RB_LATCH_INIT(&sh.latch);
+        pthread_rwlock_init(&sh.lock, NULL);
+        for (i = 0; i < 2 * READ_SIZE; i++) {
+                sh.nodes[i].key = sh.lnodes[i].key = i;
+                if (i % 2 == 0) {
+                        RB_INSERT(tree, &sh.rb, &sh.nodes[i]);
+                        RB_INSERT(ltree, &sh.latch, &sh.lnodes[i]);
+                }
+        }
+        printf("readers and a writer, %d nodes\n", READ_SIZE);
+        printf("%8s %14s %14s\n", "readers", "rwlock ns", "latch ns");
+        for (k = 1; k == 1 || (k < ncpu && k <= READ_THREADS); k++) {
+                for (sh.use_latch = 0; sh.use_latch < 2; sh.use_latch++) {
+                        sh.stop = 0;
+                        if (pthread_create(&writer, NULL, writer_main,
+                            &sh) != 0)
+                                return -1;
+                        start = now_ms();
+                        for (i = 0; i < k; i++) {
+                                readers[i].shared = &sh;
+                                readers[i].seed = i + 1;
+                                if (pthread_create(&threads[i], NULL,
+                                    reader_main, &readers[i]) != 0)
+                                        return -1;
+                        }
+                        for (i = 0; i < k; i++) {
+                                pthread_join(threads[i], NULL);
+                                if (readers[i].found != READ_LOOKUPS)
+                                        return -1;
+                        }
+                        /* per lookup, per reader */
+                        ns[sh.use_latch] = (now_ms() - start) * 1e6 /
+                            READ_LOOKUPS;
+                        sh.stop = 1;
+                        pthread_join(writer, NULL);
+                }
+                printf("%8d %14.1f %14.1f\n", k, ns[0], ns[1]);
+        }
+        pthread_rwlock_destroy(&sh.lock);
+        free(sh.nodes);
+        free(sh.lnodes);
+        return 0;
+}
+
+#define SCAN_SIZE       (1 << 23)
+#define SCAN_THREADS    64
+
+struct scan {
+        struct node **bounds;
+        int i;
+        long sum;
+};
+
+static void *
+scan_main(void *arg)
+{
+        struct scan *scan = arg;
+        struct node *tmp;
+
+        scan->sum = 0;
+        RB_FOREACH_PARTITION(tmp, tree, scan->bounds, scan->i)
+                scan->sum += tmp->key;
+        return NULL;
+}
+
+/* A full scan split among threads by RB_PARTITION */
+static int
+bench_scan(void)
+{
+        struct node *store, *bounds[SCAN_THREADS + 1];
+        struct tree rb = RB_INITIALIZER(&rb);
+        struct scan scans[SCAN_THREADS];
+        pthread_t threads[SCAN_THREADS];
+        long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+        long sum, expected = 0;
+        double start;
+        int i, k, m;
+
+        store = malloc(SCAN_SIZE * sizeof(*store));
+        if (store == NULL)
+                return -1;
+        srand(1);
+        for (i = 0; i < SCAN_SIZE; i++) {
+                store[i].key = rand();
+                if (RB_INSERT(tree, &rb, &store[i]) == NULL)
+                        expected += store[i].key;
+        }
+        printf("scan, %d nodes\n", SCAN_SIZE);
+        printf("%8s %10s\n", "threads", "ms");
+        for (k = 1; k == 1 || (k <= ncpu && k <= SCAN_THREADS); k++) {
+                start = now_ms();
+                m = (int)RB_PARTITION(tree, &rb, k, bounds);
+                for (i = 0; i < m; i++) {
+                        scans[i].bounds = bounds;
+                        scans[i].i = i;
+                        if (pthread_create(&threads[i], NULL, scan_main,
+                            &scans[i]) != 0)
+                                return -1;
+                }
+                sum = 0;
+                for (i = 0; i < m; i++) {
+                        pthread_join(threads[i], NULL);
+                        sum += scans[i].sum;
+                }
+                printf("%8d %10.1f\n", k, now_ms() - start);
+                if (sum != expected)
+                        return -1;
+        }
+        free(store);
+        return 0;
+}
+
+int main(void)
+{
+        if (bench_setops() != 0)
+                return 1;
+        if (bench_lookup() != 0)
+                return 1;
+        if (bench_queue() != 0)
+                return 1;
+        if (bench_ingest() != 0)
+                return 1;
+        if (bench_persist() != 0)
+                return 1;
+        if (bench_readers() != 0)
+                return 1;
+        if (bench_scan() != 0)
+                return 1;
+        return 0;
+}
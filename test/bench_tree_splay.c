@@ -0,0 +1,253 @@
+/*
+ * Copyright (c) 2023 Nick Miller
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+/*
+ * Benchmark for splay tree lookups and walks.  Keys are drawn with a
+ * skewed popularity, where key k is looked up about as often as
+ * 1 / (k + 1), and keys are placed in memory in an order unrelated to
+ * their popularity.  The last lookups are made in a tree rebuilt by
+ * weight, from counts taken over other lookups of the same popularity.
+ * The walks then visit the tree the last lookups
+ * left, SPLAY_FOREACH_ITER first, since SPLAY_FOREACH reshapes it.
+ * Last, timers named by strings are all cancelled in random order, from
+ * a splay tree and from a parent-linked splay tree.
+ *
+ * usage: bench_tree_splay [nodes, default 1000000]
+ */
+#include "tree.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+struct node {
+        SPLAY_ENTRY(node) node;
+        long key;
+        unsigned long hits;
+};
+
+static int
+compare(struct node *a, struct node *b)
+{
+        return (a->key > b->key) - (a->key < b->key);
+}
+
+SPLAY_HEAD(tree, node);
+SPLAY_PROTOTYPE(tree, node, node, compare);
+SPLAY_GENERATE(tree, node, node, compare);
+SPLAY_PROTOTYPE_ITER(tree, node, node, compare);
+SPLAY_GENERATE_ITER(tree, node, node, compare);
+SPLAY_PROTOTYPE_WEIGHT(tree, node, node, compare, hits);
+SPLAY_GENERATE_WEIGHT(tree, node, node, compare, hits);
+
+struct timer {
+        SPLAY_ENTRY(timer) node;
+        char name[24];
+};
+
+struct ptimer {
+        SPLAY_ENTRY_PARENT(ptimer) node;
+        char name[24];
+};
+
+static int
+timer_compare(struct timer *a, struct timer *b)
+{
+        return strcmp(a->name, b->name);
+}
+
+static int
+ptimer_compare(struct ptimer *a, struct ptimer *b)
+{
+        return strcmp(a->name, b->name);
+}
+
+SPLAY_HEAD(timers, timer);
+SPLAY_PROTOTYPE(timers, timer, node, timer_compare);
+SPLAY_GENERATE(timers, timer, node, timer_compare);
+
+SPLAY_HEAD(ptimers, ptimer);
+SPLAY_PROTOTYPE_PARENT(ptimers, ptimer, node, ptimer_compare);
+SPLAY_GENERATE_PARENT(ptimers, ptimer, node, ptimer_compare);
+
+#define LOOKUPS         (1 << 22)
+#define CANCELS         (1 << 20)
+#define VISITS          (1 << 22)
+
+static double
+now_ns(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* Returns a random key, where key k is drawn about as often as 1 / (k + 1) */
+static long
+skewed(long n)
+{
+        double u = (double)rand() / ((double)RAND_MAX + 1);
+
+        return (long)exp(u * log((double)n + 1)) - 1;
+}
+
+/* Rebuilds the tree from the same insertion order */
+static void
+build(struct tree *head, struct node *store, long n)
+{
+        long i;
+
+        SPLAY_INIT(head);
+        for (i = 0; i < n; i++)
+                SPLAY_INSERT(tree, head, &store[i]);
+}
+
+int main(int argc, char **argv)
+{
+        struct tree head = SPLAY_INITIALIZER(&head);
+        struct node *store, **elms, key, *tmp;
+        struct timers timer_head;
+        struct ptimers ptimer_head;
+        struct timer *timer_store;
+        struct ptimer *ptimer_store;
+        long *order;
+        double cancel_ns[2];
+        SPLAY_ITER(tree) it;
+        long n = argc > 1 ? strtol(argv[1], NULL, 10) : 1000000;
+        long *keys, i, j, k, t, passes, sum = 0;
+        double start;
+        int mode;
+        static const char *modes[] = {
+                "SPLAY_FIND", "SPLAY_FIND_NOSPLAY", "SPLAY_FIND_DEPTH 16",
+                "SPLAY_REBUILD",
+        };
+
+        store = malloc(n * sizeof(*store));
+        elms = malloc(n * sizeof(*elms));
+        keys = malloc(LOOKUPS * sizeof(*keys));
+        if (store == NULL || elms == NULL || keys == NULL)
+                return 1;
+        srand(1);
+        for (i = 0; i < n; i++) {
+                store[i].key = i;
+                store[i].hits = 0;
+        }
+        for (i = n - 1; i > 0; i--) {
+                j = ((long)rand() * RAND_MAX + rand()) % (i + 1);
+                t = store[i].key;
+                store[i].key = store[j].key;
+                store[j].key = t;
+        }
+        for (i = 0; i < LOOKUPS; i++)
+                keys[i] = skewed(n);
+
+        printf("%ld nodes, skewed lookups\n", n);
+        for (mode = 0; mode < 4; mode++) {
+                build(&head, store, n);
+                if (mode == 3) {
+                        for (i = 0; i < LOOKUPS; i++) {
+                                key.key = skewed(n);
+                                SPLAY_FIND_COUNT(tree, &head, &key);
+                        }
+                        start = now_ns();
+                        SPLAY_REBUILD(tree, &head, elms, n);
+                        printf("%-22s %8.1f ns/node\n", "rebuild",
+                            (now_ns() - start) / n);
+                }
+                start = now_ns();
+                for (i = 0; i < LOOKUPS; i++) {
+                        key.key = keys[i];
+                        switch (mode) {
+                        case 0:
+                                sum += SPLAY_FIND(tree, &head, &key)->key;
+                                break;
+                        case 1:
+                                sum += SPLAY_FIND_NOSPLAY(tree, &head,
+                                    &key)->key;
+                                break;
+                        case 2:
+                                sum += SPLAY_FIND_DEPTH(tree, &head, &key,
+                                    16)->key;
+                                break;
+                        case 3:
+                                sum += SPLAY_FIND_NOSPLAY(tree, &head,
+                                    &key)->key;
+                                break;
+                        }
+                }
+                printf("%-22s %8.1f ns/op\n", modes[mode],
+                    (now_ns() - start) / LOOKUPS);
+        }
+
+        passes = (VISITS + n - 1) / n;
+        start = now_ns();
+        for (i = 0; i < passes; i++)
+                SPLAY_FOREACH_ITER(tmp, tree, &head, &it)
+                        sum += tmp->key;
+        printf("%-22s %8.1f ns/node\n", "SPLAY_FOREACH_ITER",
+            (now_ns() - start) / ((double)passes * n));
+        start = now_ns();
+        for (i = 0; i < passes; i++)
+                SPLAY_FOREACH(tmp, tree, &head)
+                        sum += tmp->key;
+        printf("%-22s %8.1f ns/node\n", "SPLAY_FOREACH",
+            (now_ns() - start) / ((double)passes * n));
+        free(keys);
+        free(elms);
+        free(store);
+
+        timer_store = malloc(n * sizeof(*timer_store));
+        ptimer_store = malloc(n * sizeof(*ptimer_store));
+        order = malloc(n * sizeof(*order));
+        if (timer_store == NULL || ptimer_store == NULL || order == NULL)
+                return 1;
+        SPLAY_INIT(&timer_head);
+        SPLAY_INIT(&ptimer_head);
+        for (i = 0; i < n; i++) {
+                /* Distinct names, in an order unrelated to i */
+                snprintf(timer_store[i].name, sizeof(timer_store[i].name),
+                    "timer.%016lx", (unsigned long)i * 0x9e3779b97f4a7c15);
+                memcpy(ptimer_store[i].name, timer_store[i].name,
+                    sizeof(ptimer_store[i].name));
+                SPLAY_INSERT(timers, &timer_head, &timer_store[i]);
+                SPLAY_INSERT(ptimers, &ptimer_head, &ptimer_store[i]);
+                order[i] = i;
+        }
+        cancel_ns[0] = cancel_ns[1] = 0;
+        for (t = 0; t < (CANCELS + n - 1) / n; t++) {
+                for (i = n - 1; i > 0; i--) {
+                        j = ((long)rand() * RAND_MAX + rand()) % (i + 1);
+                        k = order[i];
+                        order[i] = order[j];
+                        order[j] = k;
+                }
+                start = now_ns();
+                for (i = 0; i < n; i++)
+                        SPLAY_REMOVE(timers, &timer_head,
+                            &timer_store[order[i]]);
+                cancel_ns[0] += now_ns() - start;
+                start = now_ns();
+                for (i = 0; i < n; i++)
+                        SPLAY_REMOVE(ptimers, &ptimer_head,
+                            &ptimer_store[order[i]]);
+                cancel_ns[1] += now_ns() - start;
+                for (i = 0; i < n; i++) {
+                        SPLAY_INSERT(timers, &timer_head, &timer_store[i]);
+                        SPLAY_INSERT(ptimers, &ptimer_head,
+                            &ptimer_store[i]);
+                }
+        }
+        printf("%-22s %8.1f ns/op\n", "cancel, SPLAY_ENTRY",
+            cancel_ns[0] / ((double)t * n));
+        printf("%-22s %8.1f ns/op\n", "cancel, ENTRY_PARENT",
+            cancel_ns[1] / ((double)t * n));
+        free(order);
+        free(timer_store);
+        free(ptimer_store);
+        return sum == 0;
+}
@@ -0,0 +1,198 @@
+/*
+ * Copyright (c) 2023 Nick Miller
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include "test.h"
+#include "btree.h"
+#include <stdlib.h>
+
+#define NUM_ITEMS 2000
+#define NUM_NODES 1000
+#define ORDER 4
+
+struct item {
+    int key;
+    int removed;
+};
+
+BT_HEAD(btree, item);
+BT_PROTOTYPE(btree, item, key, ORDER);
+BT_GENERATE(btree, item, key, ORDER);
+
+static struct btree tree = BT_INITIALIZER(&tree);
+static BT_NODE(btree) pool[NUM_NODES];
+static struct item items[NUM_ITEMS];
+
+// Walks the whole tree, checking node fill, key order and leaf chaining
+static int check_node(BT_NODE(btree) *node, int level, int *lo, int hi,
+        BT_NODE(btree) **leaf, int *count) {
+    unsigned int i;
+
+    if (node != tree.bth_root) {
+        CHECK_TRUE(node->btn_n >= (level == 0 ? ORDER / 2u : (ORDER - 1) / 2u), "underfull node");
+    }
+    CHECK_TRUE(node->btn_n <= ORDER, "overfull node");
+    for (i = 0; i < node->btn_n; i++) {
+        CHECK_TRUE(node->btn_key[i] >= *lo && node->btn_key[i] < hi, "key out of range");
+        if (i > 0) {
+            CHECK_TRUE(node->btn_key[i - 1] < node->btn_key[i], "keys out of order");
+        }
+    }
+    if (level == 0) {
+        CHECK_TRUE(*leaf == node, "leaf chain broken");
+        for (i = 0; i < node->btn_n; i++) {
+            CHECK_EQUAL_INT(node->btn_key[i], _BT_ELM(node)[i]->key, "element key");
+        }
+        *count += node->btn_n;
+        *leaf = _BT_NEXT(node);
+        return 0;
+    }
+    for (i = 0; i <= node->btn_n; i++) {
+        int child_lo = i == 0 ? *lo : node->btn_key[i - 1];
+        int child_hi = i == node->btn_n ? hi : node->btn_key[i];
+        RETURN_IF_NONZERO(check_node(_BT_CHILD(node)[i], level - 1, &child_lo, child_hi,
+                    leaf, count));
+    }
+    return 0;
+}
+
+static int check_tree(int num_items) {
+    BT_NODE(btree) *leaf;
+    struct item *item;
+    int lo = -1, count = 0, prev = -1;
+
+    if (tree.bth_root == NULL) {
+        CHECK_EQUAL_INT(0, num_items, "empty tree");
+        CHECK_EQUAL_INT(0, tree.bth_height, "empty tree height");
+        return 0;
+    }
+    leaf = tree.bth_root;
+    for (int level = tree.bth_height - 1; level > 0; level--) {
+        leaf = _BT_CHILD(leaf)[0];
+    }
+    RETURN_IF_NONZERO(check_node(tree.bth_root, tree.bth_height - 1, &lo, 4 * NUM_ITEMS,
+                &leaf, &count));
+    CHECK_TRUE(leaf == NULL, "leaf chain too long");
+    CHECK_EQUAL_INT(num_items, count, "element count");
+
+    count = 0;
+    BT_FOREACH(item, btree, &tree) {
+        CHECK_TRUE(item->key > prev, "BT_FOREACH order");
+        prev = item->key;
+        count++;
+    }
+    CHECK_EQUAL_INT(num_items, count, "BT_FOREACH count");
+    return 0;
+}
+
+static int test_btree(void) {
+    struct item *item;
+    int i, n = 0;
+
+    BT_POOL_ADD(btree, &tree, pool, NUM_NODES);
+
+    // Insert in a scrambled order, with keys 0, 2, 4, ...
+    srand(7);
+    for (i = 0; i < NUM_ITEMS; i++) {
+        items[i].key = 2 * i;
+    }
+    for (i = 0; i < NUM_ITEMS; i++) {
+        int j = rand() % NUM_ITEMS;
+        int key = items[i].key;
+        items[i].key = items[j].key;
+        items[j].key = key;
+    }
+    for (i = 0; i < NUM_ITEMS; i++) {
+        CHECK_TRUE(NULL == BT_INSERT(btree, &tree, &items[i]), "BT_INSERT");
+        n++;
+        if (i % 97 == 0) {
+            RETURN_IF_NONZERO(check_tree(n));
+        }
+    }
+    RETURN_IF_NONZERO(check_tree(n));
+    CHECK_TRUE(&items[5] == BT_INSERT(btree, &tree, &items[5]), "duplicate BT_INSERT");
+
+    for (i = -1; i < 4 * NUM_ITEMS; i++) {
+        item = BT_FIND(btree, &tree, i);
+        if (i >= 0 && i < 2 * NUM_ITEMS && i % 2 == 0) {
+            CHECK_TRUE(item != NULL && item->key == i, "BT_FIND");
+        } else {
+            CHECK_TRUE(item == NULL, "BT_FIND of missing key");
+        }
+        item = BT_NFIND(btree, &tree, i);
+        if (i < 2 * NUM_ITEMS - 2) {
+            CHECK_TRUE(item != NULL && item->key == (i < 0 ? 0 : (i + 1) / 2 * 2), "BT_NFIND");
+        } else if (i > 2 * NUM_ITEMS - 2) {
+            CHECK_TRUE(item == NULL, "BT_NFIND past end");
+        }
+    }
+    i = 1001;
+    n = 0;
+    BT_FOREACH_FROM(item, btree, &tree, 1001) {
+        CHECK_EQUAL_INT(1002 + 2 * n, item->key, "BT_FOREACH_FROM");
+        n++;
+    }
+    CHECK_EQUAL_INT(NUM_ITEMS - 501, n, "BT_FOREACH_FROM count");
+
+    // Remove two thirds, in another order, then the rest
+    n = NUM_ITEMS;
+    for (i = 0; i < NUM_ITEMS; i++) {
+        if (items[i].key % 3 != 0) {
+            CHECK_TRUE(&items[i] == BT_REMOVE(btree, &tree, items[i].key), "BT_REMOVE");
+            CHECK_TRUE(NULL == BT_REMOVE(btree, &tree, items[i].key), "BT_REMOVE twice");
+            items[i].removed = 1;
+            n--;
+            if (i % 89 == 0) {
+                RETURN_IF_NONZERO(check_tree(n));
+            }
+        }
+    }
+    RETURN_IF_NONZERO(check_tree(n));
+    for (i = 0; i < NUM_ITEMS; i++) {
+        item = BT_FIND(btree, &tree, items[i].key);
+        CHECK_TRUE(items[i].removed ? item == NULL : item == &items[i], "BT_FIND after remove");
+    }
+    for (i = NUM_ITEMS - 1; i >= 0; i--) {
+        if (!items[i].removed) {
+            CHECK_TRUE(&items[i] == BT_REMOVE(btree, &tree, items[i].key), "BT_REMOVE");
+            n--;
+            if (i % 13 == 0) {
+                RETURN_IF_NONZERO(check_tree(n));
+            }
+        }
+    }
+    RETURN_IF_NONZERO(check_tree(0));
+    CHECK_EQUAL_INT(NUM_NODES, (int)tree.bth_nfree, "nodes returned to pool");
+    return 0;
+}
+
+static int test_btree_pool_exhausted(void) {
+    static BT_NODE(btree) small_pool[3];
+    struct btree small = BT_INITIALIZER(&small);
+    int i, inserted = 0;
+
+    CHECK_TRUE(&items[0] == BT_INSERT(btree, &small, &items[0]), "BT_INSERT without pool");
+    BT_POOL_ADD(btree, &small, small_pool, 3);
+    for (i = 0; i < NUM_ITEMS; i++) {
+        items[i].key = i;
+        if (BT_INSERT(btree, &small, &items[i]) != NULL) {
+            break;
+        }
+        inserted++;
+    }
+    // The first leaf fills and splits under a new root, using all three
+    // nodes; the right leaf then fills, and splitting it would need more
+    CHECK_EQUAL_INT(6, inserted, "inserts before the pool ran out");
+    for (i = 0; i < inserted; i++) {
+        CHECK_TRUE(&items[i] == BT_FIND(btree, &small, i), "BT_FIND after failed insert");
+    }
+    return 0;
+}
+
+int main(void) {
+    RETURN_IF_NONZERO(test_btree());
+    RETURN_IF_NONZERO(test_btree_pool_exhausted());
+    return 0;
+}
@@ -29,10 +29,19 @@
  */
 #include "test.h"
 #define _RB_DIAGNOSTIC
+#define RB_SHARED
 #include "tree.h"
+#include "slist.h"
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 
+/* Nodes in each of the larger randomized tests */
+#define TEST_SIZE 4096
+
 
 struct node {
         RB_ENTRY(node) node;
@@ -52,6 +61,337 @@ compare(struct node *a, struct node *b)
 RB_PROTOTYPE(tree, node, node, compare);
 
 RB_GENERATE(tree, node, node, compare);
+RB_PROTOTYPE_RANGE(tree, node, node, compare);
+RB_GENERATE_RANGE(tree, node, node, compare);
+RB_PROTOTYPE_BUILD(tree, node, node);
+RB_GENERATE_BUILD(tree, node, node);
+RB_PROTOTYPE_JOIN(tree, node, node, compare);
+RB_GENERATE_JOIN(tree, node, node, compare);
+RB_PROTOTYPE_SETOPS(tree, node, node, compare);
+RB_GENERATE_SETOPS(tree, node, node, compare);
+RB_PROTOTYPE_FREEZE(tree, node, node, key);
+RB_GENERATE_FREEZE(tree, node, node, key);
+RB_PROTOTYPE_BATCH(tree, node, node, compare);
+RB_GENERATE_BATCH(tree, node, node, compare);
+RB_PROTOTYPE_HINT(tree, node, node, compare);
+RB_GENERATE_HINT(tree, node, node, compare);
+RB_PROTOTYPE_PARTITION(tree, node, node);
+RB_GENERATE_PARTITION(tree, node, node);
+
+static int
+key_compare(int key, struct node *b)
+{
+        if (key < b->key) return (-1);
+        else if (key > b->key) return (1);
+        return (0);
+}
+
+RB_PROTOTYPE_KEY(tree, node, node, int);
+RB_GENERATE_KEY(tree, node, node, int, key_compare);
+
+struct snode {
+        RB_ENTRY(snode) node;
+        int key;
+        size_t size;
+        snode_t lnode;
+        unsigned long hits;
+};
+
+static RB_HEAD(stree, snode) sroot;
+
+static int
+scompare(struct snode *a, struct snode *b)
+{
+        if (a->key < b->key) return (-1);
+        else if (a->key > b->key) return (1);
+        return (0);
+}
+
+RB_PROTOTYPE(stree, snode, node, scompare);
+RB_PROTOTYPE_SIZE(stree, snode, node, size, scompare);
+
+RB_GENERATE_AUGMENT(stree, snode, node, scompare, stree_RB_SIZE_UPDATE);
+RB_GENERATE_SIZE(stree, snode, node, size, scompare);
+RB_PROTOTYPE_BUILD(stree, snode, node);
+RB_GENERATE_BUILD(stree, snode, node);
+RB_PROTOTYPE_JOIN(stree, snode, node, scompare);
+RB_GENERATE_JOIN(stree, snode, node, scompare);
+RB_PROTOTYPE_RANGE(stree, snode, node, scompare);
+RB_GENERATE_RANGE(stree, snode, node, scompare);
+RB_PROTOTYPE_SETOPS(stree, snode, node, scompare);
+RB_GENERATE_SETOPS(stree, snode, node, scompare);
+RB_PROTOTYPE_KEY_FIELD(stree, snode, node, key);
+RB_GENERATE_KEY_FIELD(stree, snode, node, key);
+RB_PROTOTYPE_WEIGHT(stree, snode, node, scompare, hits);
+RB_GENERATE_WEIGHT(stree, snode, node, scompare, hits);
+RB_PROTOTYPE_PARTITION(stree, snode, node);
+RB_GENERATE_PARTITION_SIZE(stree, snode, node);
+
+struct inode {
+        RB_ENTRY(inode) node;
+        int lo, hi, max;
+        int id;
+};
+
+static RB_HEAD(itree, inode) iroot;
+
+static int
+icompare(struct inode *a, struct inode *b)
+{
+        if (a->lo < b->lo) return (-1);
+        else if (a->lo > b->lo) return (1);
+        return (a->id - b->id);
+}
+
+RB_PROTOTYPE(itree, inode, node, icompare);
+RB_PROTOTYPE_INTERVAL(itree, inode, node, lo, hi, max);
+
+RB_GENERATE_AUGMENT(itree, inode, node, icompare, itree_RB_OVERLAP_UPDATE);
+RB_GENERATE_INTERVAL(itree, inode, node, lo, hi, max);
+
+struct agg {
+        long sum;
+        int min, max;
+};
+
+#define AGG_IDENTITY ((struct agg){ 0, INT_MAX, INT_MIN })
+
+struct anode {
+        RB_ENTRY(anode) node;
+        int key;
+        int bytes;
+        struct agg agg;
+};
+
+static RB_HEAD(atree, anode) aroot;
+
+static int
+acompare(struct anode *a, struct anode *b)
+{
+        if (a->key < b->key) return (-1);
+        else if (a->key > b->key) return (1);
+        return (0);
+}
+
+static struct agg
+avalue(struct anode *a)
+{
+        return ((struct agg){ a->bytes, a->bytes, a->bytes });
+}
+
+static struct agg
+acombine(struct agg a, struct agg b)
+{
+        a.sum += b.sum;
+        a.min = b.min < a.min ? b.min : a.min;
+        a.max = b.max > a.max ? b.max : a.max;
+        return (a);
+}
+
+static int
+aequal(struct agg a, struct agg b)
+{
+        return (a.sum == b.sum && a.min == b.min && a.max == b.max);
+}
+
+RB_PROTOTYPE(atree, anode, node, acompare);
+RB_PROTOTYPE_AGGREGATE(atree, anode, node, agg, acompare);
+
+RB_GENERATE_AUGMENT(atree, anode, node, acompare, atree_RB_AGGREGATE_UPDATE);
+RB_GENERATE_AGGREGATE(atree, anode, node, agg, acompare, avalue, acombine,
+    AGG_IDENTITY, aequal);
+
+struct pnode {
+        RB_ENTRY_PREFIX(pnode) node;
+        char name[24];
+};
+
+static RB_HEAD(ptree, pnode) proot;
+
+static int
+pcompare(struct pnode *a, struct pnode *b)
+{
+        return strcmp(a->name, b->name);
+}
+
+static uint64_t
+pprefix(struct pnode *elm)
+{
+        return rb_string_prefix(elm->name);
+}
+
+RB_PROTOTYPE(ptree, pnode, node, pcompare);
+RB_GENERATE_PREFIX(ptree, pnode, node, pcompare, pprefix);
+RB_PROTOTYPE_BUILD(ptree, pnode, node);
+RB_GENERATE_BUILD(ptree, pnode, node);
+RB_PROTOTYPE_JOIN(ptree, pnode, node, pcompare);
+RB_GENERATE_JOIN(ptree, pnode, node, pcompare);
+
+struct cnode {
+        RB_ENTRY_COMPACT(cnode) node;
+        int key;
+};
+
+static struct cnode cpool[TEST_SIZE];
+
+static int
+ccompare(struct cnode *a, struct cnode *b)
+{
+        return (a->key > b->key) - (a->key < b->key);
+}
+
+RB_HEAD(ctree, cnode);
+RB_PROTOTYPE_COMPACT(ctree, cnode, node, ccompare);
+RB_GENERATE_COMPACT(ctree, cnode, node, ccompare, cpool);
+
+struct tnode {
+        RB_ENTRY_PATH(tnode) node;
+        int key;
+};
+
+static int
+tcompare(struct tnode *a, struct tnode *b)
+{
+        return (a->key > b->key) - (a->key < b->key);
+}
+
+RB_HEAD(ttree, tnode);
+RB_PROTOTYPE_PATH(ttree, tnode, node, tcompare);
+RB_GENERATE_PATH(ttree, tnode, node, tcompare);
+
+/* Persistent tree nodes come from a pool, and go back when reclaimed */
+struct vnode {
+        RB_ENTRY_PATH(vnode) node;
+        int key;
+        unsigned long gen; /* version retired in */
+        struct vnode *next;
+};
+
+RB_PERSIST_HEAD(vtree, vnode);
+
+#define VPOOL_SIZE (4 * TEST_SIZE)
+static struct vnode vpool[VPOOL_SIZE];
+static struct vnode *vfree, *vretired;
+static int vused, vbudget = -1;
+
+static int
+vcompare(struct vnode *a, struct vnode *b)
+{
+        return (a->key > b->key) - (a->key < b->key);
+}
+
+static struct vnode *
+vnode_alloc(struct vtree *head)
+{
+        struct vnode *elm;
+
+        (void)head;
+        if (vbudget == 0)
+                return NULL;
+        if (vbudget > 0)
+                vbudget--;
+        if ((elm = vfree) != NULL)
+                vfree = elm->next;
+        else if (vused < VPOOL_SIZE)
+                elm = &vpool[vused++];
+        return elm;
+}
+
+static void
+vnode_retire(struct vtree *head, struct vnode *elm)
+{
+        elm->gen = head->rbh_gen;
+        elm->next = vretired;
+        vretired = elm;
+}
+
+/* Frees the nodes no version from gen on can reach */
+static int
+vnode_reclaim(unsigned long gen)
+{
+        struct vnode **pp = &vretired, *elm;
+        int n = 0;
+
+        while ((elm = *pp) != NULL) {
+                if (elm->gen <= gen) {
+                        *pp = elm->next;
+                        elm->key = -1;
+                        elm->next = vfree;
+                        vfree = elm;
+                        n++;
+                } else
+                        pp = &elm->next;
+        }
+        return n;
+}
+
+RB_PROTOTYPE_PERSIST(vtree, vnode, node, vcompare);
+RB_GENERATE_PERSIST(vtree, vnode, node, vcompare, vnode_alloc, vnode_retire);
+
+struct qnode {
+        RB_ENTRY(qnode) node;
+        int key;
+};
+
+static int
+qcompare(struct qnode *a, struct qnode *b)
+{
+        return (a->key > b->key) - (a->key < b->key);
+}
+
+RB_HEAD_CACHED(qtree, qnode);
+RB_PROTOTYPE(qtree, qnode, node, qcompare);
+RB_GENERATE_CACHED(qtree, qnode, node, qcompare);
+RB_PROTOTYPE_BUILD(qtree, qnode, node);
+RB_GENERATE_BUILD(qtree, qnode, node);
+RB_PROTOTYPE_JOIN(qtree, qnode, node, qcompare);
+RB_GENERATE_JOIN(qtree, qnode, node, qcompare);
+
+/* Shared tree nodes, with the entry away from the start of the node */
+struct hnode {
+        int key;
+        RB_ENTRY_SHARED(hnode) node;
+};
+
+struct hname {
+        char name[12];
+        RB_ENTRY_SHARED(hname) node;
+};
+
+static int
+hcompare(struct hnode *a, struct hnode *b)
+{
+        return (a->key > b->key) - (a->key < b->key);
+}
+
+static int
+hname_compare(struct hname *a, struct hname *b)
+{
+        return strcmp(a->name, b->name);
+}
+
+RB_GENERATE_SHARED_CORE();
+RB_HEAD_SHARED(htree, hnode);
+RB_PROTOTYPE_SHARED(htree, hnode, node, hcompare);
+RB_GENERATE_SHARED(htree, hnode, node, hcompare);
+RB_HEAD_SHARED(hname_tree, hname);
+RB_PROTOTYPE_SHARED(hname_tree, hname, node, hname_compare);
+RB_GENERATE_SHARED(hname_tree, hname, node, hname_compare);
+
+struct lnode {
+        RB_ENTRY_LATCH(lnode) node;
+        int key;
+};
+
+static int
+lcompare(struct lnode *a, struct lnode *b)
+{
+        return (a->key > b->key) - (a->key < b->key);
+}
+
+RB_LATCH_HEAD(ltree, lnode);
+RB_PROTOTYPE_LATCH(ltree, lnode, node, lcompare);
+RB_GENERATE_LATCH(ltree, lnode, node, lcompare);
 
 #define ITER 150
 
@@ -106,10 +446,1479 @@ int rb_test(void)
         return 0;
 }
 
+static int
+check_size_tree(struct snode *store, int n)
+{
+        struct snode lo, hi, *tmp;
+        int i;
+
+        CHECK_TRUE(stree_RB_RANK(RB_ROOT(&sroot)) >= 0, "RB rank/size error");
+        CHECK_EQUAL_INT(n, (int)RB_COUNT(stree, &sroot), "RB_COUNT error");
+        i = 0;
+        RB_FOREACH(tmp, stree, &sroot) {
+                CHECK_TRUE(tmp == RB_SELECT(stree, &sroot, i), "RB_SELECT error");
+                CHECK_EQUAL_INT(i, (int)RB_ORDER_RANK(stree, &sroot, tmp),
+                    "RB_ORDER_RANK error");
+                i++;
+        }
+        CHECK_TRUE(NULL == RB_SELECT(stree, &sroot, n), "RB_SELECT past end");
+        for (i = 0; i < ITER; i += 7) {
+                int count = 0, j;
+
+                lo.key = i;
+                hi.key = i + 2 * (i % 5);
+                for (j = 0; j < n; j++)
+                        if (store[j].key >= lo.key && store[j].key <= hi.key)
+                                count++;
+                CHECK_EQUAL_INT(count,
+                    (int)RB_COUNT_RANGE(stree, &sroot, &lo, &hi),
+                    "RB_COUNT_RANGE error");
+        }
+        lo.key = 1;
+        hi.key = 0;
+        CHECK_EQUAL_INT(0, (int)RB_COUNT_RANGE(stree, &sroot, &lo, &hi),
+            "RB_COUNT_RANGE empty range");
+        return 0;
+}
+
+int rb_size_test(void)
+{
+        struct snode store[ITER], *tmp;
+        int i, j, k;
+
+        RB_INIT(&sroot);
+
+        /* Insert shuffled keys; stale sizes must not confuse updates */
+        for (i = 0; i < ITER; i++) {
+                store[i].key = 2 * i;
+                store[i].size = 1;
+        }
+        for (i = 0; i < ITER; i++) {
+                j = i + (rand() % (ITER - i));
+                k = store[j].key;
+                store[j].key = store[i].key;
+                store[i].key = k;
+        }
+        for (i = 0; i < ITER; i++)
+                CHECK_TRUE(NULL == RB_INSERT(stree, &sroot, &store[i]), "");
+        RETURN_IF_NONZERO(check_size_tree(store, ITER));
+
+        /* Remove every node in the back half, in shuffled order */
+        for (i = ITER / 2; i < ITER; i++) {
+                tmp = &store[i];
+                CHECK_TRUE(tmp == RB_REMOVE(stree, &sroot, tmp), "");
+        }
+        RETURN_IF_NONZERO(check_size_tree(store, ITER / 2));
+
+        /* Reinsert them, reusing their stale sizes */
+        for (i = ITER / 2; i < ITER; i++)
+                CHECK_TRUE(NULL == RB_INSERT(stree, &sroot, &store[i]), "");
+        RETURN_IF_NONZERO(check_size_tree(store, ITER));
+        return 0;
+}
+
+#define IMAX 1000
+
+static int
+check_interval_tree(struct inode *store, int n)
+{
+        struct inode *tmp, *prev;
+        int i, j, lo, hi, count;
+
+        CHECK_TRUE(itree_RB_RANK(RB_ROOT(&iroot)) >= 0, "RB rank/max error");
+        for (i = 0; i < 2 * ITER; i++) {
+                lo = rand() % IMAX;
+                hi = lo + (i % 4 == 0 ? 0 : rand() % (IMAX / 10));
+                count = 0;
+                for (j = 0; j < n; j++)
+                        if (store[j].lo <= hi && store[j].hi >= lo)
+                                count++;
+                prev = NULL;
+                RB_FOREACH_OVERLAP(tmp, itree, &iroot, lo, hi) {
+                        CHECK_TRUE(tmp->lo <= hi && tmp->hi >= lo,
+                            "RB_FOREACH_OVERLAP non-overlapping node");
+                        CHECK_TRUE(prev == NULL || icompare(prev, tmp) < 0,
+                            "RB_FOREACH_OVERLAP out of order");
+                        prev = tmp;
+                        count--;
+                }
+                CHECK_EQUAL_INT(0, count, "RB_FOREACH_OVERLAP missed nodes");
+                tmp = RB_STAB(itree, &iroot, lo);
+                CHECK_TRUE(tmp == NULL || (tmp->lo <= lo && tmp->hi >= lo),
+                    "RB_STAB error");
+                RB_FOREACH(prev, itree, &iroot)
+                        if (prev->lo <= lo && prev->hi >= lo)
+                                break;
+                CHECK_TRUE(tmp == prev, "RB_STAB did not find least node");
+        }
+        return 0;
+}
+
+int rb_interval_test(void)
+{
+        struct inode store[ITER];
+        int i;
+
+        RB_INIT(&iroot);
+        for (i = 0; i < ITER; i++) {
+                store[i].id = i;
+                store[i].lo = rand() % IMAX;
+                store[i].hi = store[i].lo + rand() % (IMAX / 20);
+                store[i].max = store[i].hi;
+                CHECK_TRUE(NULL == RB_INSERT(itree, &iroot, &store[i]), "");
+        }
+        RETURN_IF_NONZERO(check_interval_tree(store, ITER));
+
+        for (i = ITER / 2; i < ITER; i++)
+                CHECK_TRUE(&store[i] == RB_REMOVE(itree, &iroot, &store[i]), "");
+        RETURN_IF_NONZERO(check_interval_tree(store, ITER / 2));
+
+        /* Stretch some intervals in place */
+        for (i = 0; i < ITER / 2; i += 5) {
+                store[i].hi += IMAX / 4;
+                RB_UPDATE_AUGMENT_NAME(itree, &store[i], node);
+        }
+        RETURN_IF_NONZERO(check_interval_tree(store, ITER / 2));
+        return 0;
+}
+
+static int
+check_aggregate_tree(struct anode *store, int n)
+{
+        struct anode lo, hi;
+        struct agg got, want;
+        int i, j;
+
+        CHECK_TRUE(atree_RB_RANK(RB_ROOT(&aroot)) >= 0, "RB rank/aggregate error");
+        for (i = 0; i < 2 * ITER; i++) {
+                lo.key = rand() % (2 * ITER);
+                hi.key = lo.key + rand() % (ITER / 2);
+                if (i == 0) {
+                        lo.key = INT_MIN;
+                        hi.key = INT_MAX;
+                }
+                want = AGG_IDENTITY;
+                for (j = 0; j < n; j++)
+                        if (store[j].key >= lo.key && store[j].key <= hi.key)
+                                want = acombine(want, avalue(&store[j]));
+                got = RB_REDUCE_RANGE(atree, &aroot, &lo, &hi);
+                CHECK_TRUE(want.sum == got.sum, "RB_REDUCE_RANGE sum error");
+                CHECK_EQUAL_INT(want.min, got.min, "RB_REDUCE_RANGE min error");
+                CHECK_EQUAL_INT(want.max, got.max, "RB_REDUCE_RANGE max error");
+                if (i == 0) {
+                        got = RB_REDUCE(atree, &aroot);
+                        CHECK_TRUE(want.sum == got.sum, "RB_REDUCE error");
+                }
+        }
+        return 0;
+}
+
+int rb_aggregate_test(void)
+{
+        struct anode store[ITER];
+        int i, j, k;
+
+        RB_INIT(&aroot);
+        for (i = 0; i < ITER; i++) {
+                store[i].key = 2 * i;
+                store[i].bytes = rand() % 1000 - 200;
+        }
+        for (i = 0; i < ITER; i++) {
+                j = i + (rand() % (ITER - i));
+                k = store[j].key;
+                store[j].key = store[i].key;
+                store[i].key = k;
+        }
+        for (i = 0; i < ITER; i++)
+                CHECK_TRUE(NULL == RB_INSERT(atree, &aroot, &store[i]), "");
+        RETURN_IF_NONZERO(check_aggregate_tree(store, ITER));
+
+        for (i = ITER / 2; i < ITER; i++)
+                CHECK_TRUE(&store[i] == RB_REMOVE(atree, &aroot, &store[i]), "");
+        RETURN_IF_NONZERO(check_aggregate_tree(store, ITER / 2));
+
+        for (i = 0; i < ITER / 2; i += 3) {
+                store[i].bytes = rand() % 1000;
+                RB_UPDATE_AUGMENT_NAME(atree, &store[i], node);
+        }
+        RETURN_IF_NONZERO(check_aggregate_tree(store, ITER / 2));
+        return 0;
+}
+
+static struct snode *
+slist_next_snode(void *arg)
+{
+        return (CONTAINER_OF(slist_get(arg), struct snode, lnode));
+}
+
+int rb_build_test(void)
+{
+        static const int sizes[] = { 0, 1, 2, 3, 4, 7, 8, 9, ITER };
+        struct snode store[ITER], *elems[ITER], *tmp;
+        struct snode extra = { .key = -1 };
+        slist_t list;
+        size_t s;
+        int i, n;
+
+        for (i = 0; i < ITER; i++) {
+                store[i].key = 2 * i;
+                store[i].size = 0;
+                elems[i] = &store[i];
+        }
+        for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+                n = sizes[s];
+                RB_INIT(&sroot);
+                if (s % 2) {
+                        RB_BUILD_SORTED(stree, &sroot, elems, n);
+                } else {
+                        slist_init(&list);
+                        for (i = 0; i < n; i++)
+                                slist_append(&list, &store[i].lnode);
+                        RB_BUILD_SORTED_ITER(stree, &sroot, n,
+                            slist_next_snode, &list);
+                        CHECK_TRUE(slist_is_empty(&list), "list not drained");
+                }
+                RETURN_IF_NONZERO(check_size_tree(store, n));
+                i = 0;
+                RB_FOREACH(tmp, stree, &sroot) {
+                        CHECK_TRUE(tmp == &store[i], "RB_BUILD_SORTED order");
+                        i++;
+                }
+                CHECK_EQUAL_INT(n, i, "RB_BUILD_SORTED count");
+
+                /* The built tree must stay valid under updates */
+                CHECK_TRUE(NULL == RB_INSERT(stree, &sroot, &extra), "");
+                CHECK_TRUE(stree_RB_RANK(RB_ROOT(&sroot)) >= 0,
+                    "RB rank error after insert");
+                CHECK_TRUE(&extra == RB_REMOVE(stree, &sroot, &extra), "");
+                for (i = 0; i < n; i += 3)
+                        CHECK_TRUE(&store[i] == RB_REMOVE(stree, &sroot,
+                            &store[i]), "");
+                CHECK_TRUE(stree_RB_RANK(RB_ROOT(&sroot)) >= 0,
+                    "RB rank error after remove");
+        }
+        return 0;
+}
+
+/* Returns the number of links from the root down to elm */
+static int
+sdepth(struct snode *elm)
+{
+        int depth = 0;
+
+        while ((elm = RB_PARENT(elm, node)) != NULL)
+                depth++;
+        return depth;
+}
+
+int rb_weight_test(void)
+{
+        struct snode store[ITER], *elems[ITER], key, *tmp;
+        unsigned long weight[ITER], total = 0;
+        int i, j;
+
+        RB_INIT(&sroot);
+        for (i = 0; i < ITER; i++) {
+                store[i].key = 2 * i;
+                store[i].hits = 0;
+                CHECK_TRUE(NULL == RB_INSERT(stree, &sroot, &store[i]), "");
+        }
+        /* Key 2 * i is looked up about ITER / (i + 1) times, and key 14 most */
+        for (i = 0; i < ITER; i++)
+                for (j = 0; j < ITER / (i + 1) + (i == 7) * 4 * ITER; j++) {
+                        key.key = 2 * i;
+                        CHECK_TRUE(&store[i] == RB_FIND_COUNT(stree, &sroot,
+                            &key), "");
+                }
+        key.key = 1;
+        CHECK_TRUE(NULL == RB_FIND_COUNT(stree, &sroot, &key), "");
+        for (i = 0; i < ITER; i++) {
+                weight[i] = store[i].hits + 1;
+                total += weight[i];
+        }
+
+        CHECK_EQUAL_INT(ITER, (int)RB_REBUILD(stree, &sroot, elems, ITER - 1),
+            "");
+        CHECK_TRUE(store[0].hits != 0, "rebuilt into too small an array");
+        CHECK_EQUAL_INT(ITER, (int)RB_REBUILD(stree, &sroot, elems, ITER), "");
+        CHECK_TRUE(&store[7] == RB_ROOT(&sroot), "hottest key not at root");
+        i = 0;
+        RB_FOREACH(tmp, stree, &sroot) {
+                CHECK_TRUE(tmp == elems[i] && tmp == &store[i], "order");
+                CHECK_TRUE(tmp == RB_SELECT(stree, &sroot, i), "RB_SELECT");
+                CHECK_TRUE(tmp->hits == 0, "hits not cleared");
+                /* depth <= lg (total / weight) */
+                CHECK_TRUE((weight[i] << sdepth(tmp)) <= total, "too deep");
+                key.key = tmp->key;
+                CHECK_TRUE(tmp == RB_FIND(stree, &sroot, &key), "");
+                i++;
+        }
+        CHECK_EQUAL_INT(ITER, i, "");
+
+        /* Rebalanced from the same array, the tree takes updates again */
+        RB_BUILD_SORTED(stree, &sroot, elems, ITER);
+        RETURN_IF_NONZERO(check_size_tree(store, ITER));
+        for (i = 0; i < ITER; i += 2)
+                CHECK_TRUE(&store[i] == RB_REMOVE(stree, &sroot, &store[i]),
+                    "");
+        CHECK_TRUE(stree_RB_RANK(RB_ROOT(&sroot)) >= 0, "RB rank error");
+        RB_INIT(&sroot);
+        return 0;
+}
+
+static int
+check_split_tree(struct stree *head, int lo, int hi, int n)
+{
+        struct snode *tmp;
+        int i = 0, prev = INT_MIN;
+
+        CHECK_TRUE(stree_RB_RANK(RB_ROOT(head)) >= 0, "RB rank/size error");
+        CHECK_EQUAL_INT(n, (int)RB_COUNT(stree, head), "RB_COUNT error");
+        RB_FOREACH(tmp, stree, head) {
+                CHECK_TRUE(tmp->key >= lo && tmp->key < hi, "key out of range");
+                CHECK_TRUE(tmp->key > prev, "RB order error");
+                prev = tmp->key;
+                i++;
+        }
+        CHECK_EQUAL_INT(n, i, "RB_FOREACH count");
+        return 0;
+}
+
+int rb_join_test(void)
+{
+        struct snode store[ITER], pivot, *tmp;
+        struct stree lt, ge;
+        unsigned int seed = 1;
+        int i, t, key, below;
+
+        for (t = 0; t < 2 * ITER; t++) {
+                RB_INIT(&sroot);
+                for (i = 0; i < ITER; i++) {
+                        store[i].key = 2 * i;
+                        store[i].size = 0;
+                }
+                for (i = 0; i < ITER; i++) {
+                        int j = rand_r(&seed) % ITER;
+                        int k = store[i].key;
+                        store[i].key = store[j].key;
+                        store[j].key = k;
+                }
+                for (i = 0; i < ITER; i++)
+                        CHECK_TRUE(NULL == RB_INSERT(stree, &sroot, &store[i]), "");
+
+                /* Keys inside, between and beyond the stored ones */
+                key = t - 2;
+                below = key <= 0 ? 0 : key >= 2 * ITER ? ITER : (key + 1) / 2;
+                pivot.key = key;
+                if (t % 3 == 0) {
+                        RB_SPLIT(stree, &sroot, &pivot, &sroot, &ge);
+                        lt = sroot;
+                        RB_INIT(&sroot);
+                } else {
+                        RB_SPLIT(stree, &sroot, &pivot, &lt, &ge);
+                        CHECK_TRUE(RB_EMPTY(&sroot), "RB_SPLIT left head");
+                }
+                RETURN_IF_NONZERO(check_split_tree(&lt, INT_MIN, key, below));
+                RETURN_IF_NONZERO(check_split_tree(&ge, key, INT_MAX,
+                    ITER - below));
+
+                /* Rejoin around the least element of ge, or greatest of lt */
+                if ((tmp = RB_MIN(stree, &ge)) != NULL)
+                        RB_REMOVE(stree, &ge, tmp);
+                else
+                        RB_REMOVE(stree, &lt, tmp = RB_MAX(stree, &lt));
+                RB_JOIN(stree, &lt, tmp, &ge);
+                CHECK_TRUE(RB_EMPTY(&ge), "RB_JOIN right head");
+                RETURN_IF_NONZERO(check_split_tree(&lt, 0, 2 * ITER, ITER));
+
+                /* The joined tree must stay valid under updates */
+                for (i = 0; i < ITER; i += 3)
+                        CHECK_TRUE(&store[i] == RB_REMOVE(stree, &lt,
+                            &store[i]), "");
+                RETURN_IF_NONZERO(check_split_tree(&lt, 0, 2 * ITER,
+                    ITER - (ITER + 2) / 3));
+        }
+
+        /* Joining onto a single element, and two empty trees */
+        RB_INIT(&lt);
+        RB_INIT(&ge);
+        store[0].key = 0;
+        RB_JOIN(stree, &lt, &store[0], &ge);
+        RETURN_IF_NONZERO(check_split_tree(&lt, 0, 1, 1));
+        for (i = 1; i < ITER; i++) {
+                store[i].key = i;
+                RB_JOIN(stree, &lt, &store[i], &ge);
+        }
+        RETURN_IF_NONZERO(check_split_tree(&lt, 0, ITER, ITER));
+        return 0;
+}
+
+/* Runs the two halves in reverse order, to show they are independent */
+static void
+fork_reversed(void (*run)(void *), void *left, void *right, void *arg)
+{
+        (*(int *)arg)++;
+        run(right);
+        run(left);
+}
+
+/* Key classes: multiples of 6, other multiples of 2, other multiples of 3 */
+static int
+set_class(struct snode *elm)
+{
+        return elm->key % 6 == 0 ? 1 : elm->key % 2 == 0 ? 2 : 4;
+}
+
+static int
+check_set_tree(struct stree *head, struct snode *astore, int amask,
+    struct snode *bstore, int bmask)
+{
+        int i, count = 0;
+
+        for (i = 0; i < 3 * ITER; i++) {
+                if (set_class(&astore[i]) & amask) {
+                        CHECK_TRUE(&astore[i] == RB_FIND(stree, head,
+                            &astore[i]), "set element missing");
+                        count++;
+                }
+        }
+        for (i = 0; i < 2 * ITER; i++) {
+                if (set_class(&bstore[i]) & bmask) {
+                        CHECK_TRUE(&bstore[i] == RB_FIND(stree, head,
+                            &bstore[i]), "set element missing");
+                        count++;
+                }
+        }
+        return check_split_tree(head, 0, 6 * ITER, count);
+}
+
+int rb_setop_test(void)
+{
+        /* a holds the multiples of 2 below 6 * ITER, b those of 3 */
+        static struct snode astore[3 * ITER], bstore[2 * ITER];
+        struct stree a, b, rest;
+        int i, op, forks = 0;
+
+        for (op = 0; op < 6; op++) {
+                RB_INIT(&a);
+                RB_INIT(&b);
+                RB_INIT(&rest);
+                for (i = 0; i < 3 * ITER; i++) {
+                        astore[i].key = 2 * i;
+                        RB_INSERT(stree, &a, &astore[i]);
+                }
+                for (i = 0; i < 2 * ITER; i++) {
+                        bstore[i].key = 3 * i;
+                        RB_INSERT(stree, &b, &bstore[i]);
+                }
+                RB_SETOP(stree, &a, &b, &rest, op % 3,
+                    op < 3 ? NULL : fork_reversed, &forks, 4);
+
+                switch (op % 3) {
+                case RB_SET_UNION:
+                        RETURN_IF_NONZERO(check_set_tree(&a, astore, 3,
+                            bstore, 4));
+                        RETURN_IF_NONZERO(check_set_tree(&rest, astore, 0,
+                            bstore, 1));
+                        CHECK_TRUE(RB_EMPTY(&b), "RB_UNION left b");
+                        break;
+                case RB_SET_INTERSECT:
+                        RETURN_IF_NONZERO(check_set_tree(&a, astore, 1,
+                            bstore, 0));
+                        RETURN_IF_NONZERO(check_set_tree(&rest, astore, 2,
+                            bstore, 0));
+                        RETURN_IF_NONZERO(check_set_tree(&b, astore, 0,
+                            bstore, 5));
+                        break;
+                case RB_SET_DIFFERENCE:
+                        RETURN_IF_NONZERO(check_set_tree(&a, astore, 2,
+                            bstore, 0));
+                        RETURN_IF_NONZERO(check_set_tree(&rest, astore, 1,
+                            bstore, 0));
+                        RETURN_IF_NONZERO(check_set_tree(&b, astore, 0,
+                            bstore, 5));
+                        break;
+                }
+        }
+        CHECK_TRUE(forks > 0, "fork not called");
+
+        /* Operations with an empty operand */
+        RB_INIT(&rest);
+        RB_UNION(stree, &b, &rest, &rest);
+        RETURN_IF_NONZERO(check_set_tree(&b, astore, 0, bstore, 5));
+        RB_INTERSECT(stree, &rest, &b, &rest);
+        CHECK_TRUE(RB_EMPTY(&rest), "RB_INTERSECT of empty set");
+        RB_DIFFERENCE(stree, &b, &rest, &rest);
+        RETURN_IF_NONZERO(check_set_tree(&b, astore, 0, bstore, 5));
+        return 0;
+}
+
+/*
+ * Set operations on trees from RB_BUILD_SORTED, rebuilt between rounds as
+ * a caller reusing its nodes would.  Built at -O3, this caught the rank
+ * bits being accessed through a type the optimizer took to be distinct
+ * from the parent links they are stored in.
+ */
+#define SETOP_SIZE 30000
+
+static int
+count_tree(struct tree *head)
+{
+        struct node *tmp;
+        int n = 0;
+
+        CHECK_TRUE(tree_RB_RANK(RB_ROOT(head)) >= 0, "RB rank error");
+        RB_FOREACH(tmp, tree, head)
+                n++;
+        return n;
+}
+
+int rb_setop_sorted_test(void)
+{
+        static struct node astore[SETOP_SIZE], bstore[SETOP_SIZE];
+        static struct node *elms[SETOP_SIZE];
+        struct tree a, b, rest;
+        int i, op, n;
+
+        for (op = 0; op < 6; op++) {
+                for (i = 0; i < SETOP_SIZE; i++) {
+                        astore[i].key = 2 * i;
+                        elms[i] = &astore[i];
+                }
+                RB_BUILD_SORTED(tree, &a, elms, SETOP_SIZE);
+                for (i = 0; i < SETOP_SIZE; i++) {
+                        bstore[i].key = 3 * i;
+                        elms[i] = &bstore[i];
+                }
+                RB_BUILD_SORTED(tree, &b, elms, SETOP_SIZE);
+                RB_INIT(&rest);
+                RB_SETOP(tree, &a, &b, &rest, op % 3, NULL, NULL, 16);
+
+                /* Every node ends up in exactly one of the three trees */
+                n = count_tree(&a) + count_tree(&b) + count_tree(&rest);
+                CHECK_EQUAL_INT(2 * SETOP_SIZE, n, "RB_SETOP lost nodes");
+        }
+        return 0;
+}
+
+int rb_range_test(void)
+{
+        struct node store[ITER], lo, hi, *tmp, *out[ITER];
+        int i, n, expect, last;
+        size_t got;
+
+        RB_INIT(&root);
+        for (i = 0; i < ITER; i++) {
+                store[i].key = 2 * i;
+                CHECK_TRUE(NULL == RB_INSERT(tree, &root, &store[i]), "");
+        }
+        for (i = -3; i < 2 * ITER + 2; i++) {
+                lo.key = i;
+                tmp = RB_PFIND(tree, &root, &lo);
+                if (i < 0)
+                        CHECK_TRUE(NULL == tmp, "RB_PFIND below min");
+                else
+                        CHECK_TRUE(&store[i >= 2 * ITER ? ITER - 1 : i / 2]
+                            == tmp, "RB_PFIND error");
+        }
+        for (lo.key = -3; lo.key < 2 * ITER + 2; lo.key += 5) {
+                for (hi.key = lo.key - 4; hi.key < 2 * ITER + 2;
+                    hi.key += 7) {
+                        expect = 0;
+                        for (i = 0; i < ITER; i++)
+                                if (store[i].key >= lo.key &&
+                                    store[i].key <= hi.key)
+                                        expect++;
+                        n = 0;
+                        last = INT_MIN;
+                        RB_FOREACH_RANGE(tmp, tree, &root, &lo, &hi) {
+                                CHECK_TRUE(tmp->key >= lo.key &&
+                                    tmp->key <= hi.key, "range bound error");
+                                CHECK_TRUE(tmp->key > last, "range order");
+                                last = tmp->key;
+                                n++;
+                        }
+                        CHECK_EQUAL_INT(expect, n, "RB_FOREACH_RANGE count");
+                        n = 0;
+                        last = INT_MAX;
+                        RB_FOREACH_REVERSE_RANGE(tmp, tree, &root, &lo, &hi) {
+                                CHECK_TRUE(tmp->key >= lo.key &&
+                                    tmp->key <= hi.key, "range bound error");
+                                CHECK_TRUE(tmp->key < last, "range order");
+                                last = tmp->key;
+                                n++;
+                        }
+                        CHECK_EQUAL_INT(expect, n,
+                            "RB_FOREACH_REVERSE_RANGE count");
+                        got = RB_RANGE_COLLECT(tree, &root, &lo, &hi, out,
+                            ITER);
+                        CHECK_EQUAL_INT(expect, (int)got, "RB_RANGE_COLLECT");
+                        for (i = 1; i < (int)got; i++)
+                                CHECK_TRUE(out[i] == RB_NEXT(tree, &root,
+                                    out[i - 1]), "RB_RANGE_COLLECT order");
+                        got = RB_RANGE_COLLECT(tree, &root, &lo, &hi, out, 3);
+                        CHECK_EQUAL_INT(expect < 3 ? expect : 3, (int)got,
+                            "RB_RANGE_COLLECT max");
+                }
+        }
+        return 0;
+}
+
+int rb_freeze_test(void)
+{
+        struct node store[ITER], *elms[ITER], *tmp;
+        int keys[ITER], i, n;
+        size_t idx;
+
+        for (n = 0; n <= ITER; n += n < 20 ? 1 : 13) {
+                RB_INIT(&root);
+                for (i = 0; i < n; i++) {
+                        store[i].key = 3 * i;
+                        CHECK_TRUE(NULL == RB_INSERT(tree, &root, &store[i]),
+                            "");
+                }
+                if (n > 0)
+                        CHECK_EQUAL_INT(n, (int)RB_FREEZE(tree, &root, keys,
+                            elms, n - 1), "RB_FREEZE into a short array");
+                CHECK_EQUAL_INT(n, (int)RB_FREEZE(tree, &root, keys, elms,
+                    ITER), "RB_FREEZE count");
+                for (i = 0; i < n; i++) {
+                        CHECK_EQUAL_INT(keys[i], elms[i]->key, "frozen key");
+                        if (2 * i + 1 < n)
+                                CHECK_TRUE(keys[2 * i + 1] < keys[i],
+                                    "Eytzinger order left");
+                        if (2 * i + 2 < n)
+                                CHECK_TRUE(keys[2 * i + 2] > keys[i],
+                                    "Eytzinger order right");
+                }
+                for (i = -1; i <= 3 * n; i++) {
+                        struct node key = { .key = i };
+
+                        tmp = RB_NFIND(tree, &root, &key);
+                        idx = RB_FROZEN_LOWER_BOUND(tree, keys, n, i);
+                        CHECK_TRUE(tmp == (idx == (size_t)n ? NULL :
+                            elms[idx]), "RB_FROZEN_LOWER_BOUND");
+                        CHECK_TRUE(tmp == RB_FROZEN_NFIND(tree, keys, elms, n,
+                            i), "RB_FROZEN_NFIND");
+                        CHECK_TRUE(RB_FIND(tree, &root, &key) ==
+                            RB_FROZEN_FIND(tree, keys, elms, n, i),
+                            "RB_FROZEN_FIND");
+                }
+        }
+        return 0;
+}
+
+int rb_key_test(void)
+{
+        struct node store[ITER], key, *tmp;
+        struct snode sstore[ITER], skey;
+        int i;
+
+        RB_INIT(&root);
+        RB_INIT(&sroot);
+        for (i = 0; i < ITER; i++) {
+                store[i].key = sstore[i].key = 2 * ((i * 7) % ITER);
+                CHECK_TRUE(NULL == RB_INSERT(tree, &root, &store[i]), "");
+                CHECK_TRUE(NULL == RB_INSERT(stree, &sroot, &sstore[i]), "");
+        }
+        for (i = -2; i < 2 * ITER + 2; i++) {
+                key.key = skey.key = i;
+                tmp = RB_FIND(tree, &root, &key);
+                CHECK_TRUE(tmp == RB_FIND_KEY(tree, &root, i), "RB_FIND_KEY");
+                tmp = RB_NFIND(tree, &root, &key);
+                CHECK_TRUE(tmp == RB_NFIND_KEY(tree, &root, i),
+                    "RB_NFIND_KEY");
+                tmp = RB_PFIND(tree, &root, &key);
+                CHECK_TRUE(tmp == RB_PFIND_KEY(tree, &root, i),
+                    "RB_PFIND_KEY");
+                CHECK_TRUE(RB_FIND(stree, &sroot, &skey) ==
+                    RB_FIND_KEY(stree, &sroot, i), "RB_FIND_KEY field");
+                CHECK_TRUE(RB_NFIND(stree, &sroot, &skey) ==
+                    RB_NFIND_KEY(stree, &sroot, i), "RB_NFIND_KEY field");
+                CHECK_TRUE(RB_PFIND(stree, &sroot, &skey) ==
+                    RB_PFIND_KEY(stree, &sroot, i), "RB_PFIND_KEY field");
+        }
+        return 0;
+}
+
+int rb_batch_test(void)
+{
+        struct node store[ITER], keys[2 * ITER + 4], *kp[2 * ITER + 4];
+        struct node *results[2 * ITER + 4];
+        int i, n;
+
+        RB_INIT(&root);
+        for (i = 0; i < 2 * ITER + 4; i++) {
+                keys[i].key = (i * 37) % (2 * ITER + 4) - 2;
+                kp[i] = &keys[i];
+        }
+        RB_FIND_BATCH(tree, &root, kp, results, 2 * ITER + 4);
+        for (i = 0; i < 2 * ITER + 4; i++)
+                CHECK_TRUE(results[i] == NULL, "RB_FIND_BATCH empty tree");
+        for (i = 0; i < ITER; i++) {
+                store[i].key = 2 * ((i * 7) % ITER);
+                CHECK_TRUE(NULL == RB_INSERT(tree, &root, &store[i]), "");
+        }
+        /* Batch sizes that do and do not fill the last group */
+        for (n = 0; n <= 2 * ITER + 4; n += 1 + n / 2) {
+                RB_FIND_BATCH(tree, &root, kp, results, n);
+                for (i = 0; i < n; i++)
+                        CHECK_TRUE(results[i] == RB_FIND(tree, &root, kp[i]),
+                            "RB_FIND_BATCH");
+        }
+        return 0;
+}
+
+#define PARTITION_SIZE 4096
+
+int rb_partition_test(void)
+{
+        static struct node store[PARTITION_SIZE];
+        static struct snode sstore[PARTITION_SIZE];
+        struct node *bounds[17], *tmp;
+        struct snode *sbounds[17], *stmp;
+        int i, j, k, n, m, total, expected_key;
+
+        for (n = 0; n <= PARTITION_SIZE; n = n ? 4 * n : 1) {
+                RB_INIT(&root);
+                for (i = 0; i < n; i++) {
+                        store[i].key = (i * 7919) % PARTITION_SIZE;
+                        CHECK_TRUE(NULL == RB_INSERT(tree, &root, &store[i]),
+                            "");
+                }
+                for (k = 1; k <= 16; k++) {
+                        m = (int)RB_PARTITION(tree, &root, k, bounds);
+                        CHECK_TRUE(m <= k && m <= n && (n == 0 || m > 0),
+                            "RB_PARTITION count");
+                        CHECK_TRUE(bounds[m] == NULL, "RB_PARTITION end");
+                        /* The ranges cover the tree in order */
+                        total = 0;
+                        expected_key = -1;
+                        for (j = 0; j < m; j++) {
+                                int count = 0;
+
+                                RB_FOREACH_PARTITION(tmp, tree, bounds, j) {
+                                        CHECK_TRUE(tmp->key > expected_key,
+                                            "RB_PARTITION order");
+                                        expected_key = tmp->key;
+                                        count++;
+                                }
+                                CHECK_TRUE(count > 0, "empty partition");
+                                if (n == PARTITION_SIZE)
+                                        CHECK_TRUE(count <= 3 * n / k,
+                                            "unbalanced partition");
+                                total += count;
+                        }
+                        CHECK_EQUAL_INT(n, total, "RB_PARTITION coverage");
+                        if (n == PARTITION_SIZE)
+                                CHECK_EQUAL_INT(k, m, "RB_PARTITION count");
+                }
+        }
+
+        /* Cut by position, the ranges are as even as they can be */
+        for (n = 0; n <= PARTITION_SIZE; n = n ? 4 * n : 1) {
+                RB_INIT(&sroot);
+                for (i = 0; i < n; i++) {
+                        sstore[i].key = (i * 7919) % PARTITION_SIZE;
+                        CHECK_TRUE(NULL == RB_INSERT(stree, &sroot,
+                            &sstore[i]), "");
+                }
+                for (k = 1; k <= 16; k++) {
+                        m = (int)RB_PARTITION(stree, &sroot, k, sbounds);
+                        CHECK_EQUAL_INT(k < n ? k : n, m,
+                            "RB_PARTITION count");
+                        CHECK_TRUE(sbounds[m] == NULL, "RB_PARTITION end");
+                        total = 0;
+                        for (j = 0; j < m; j++) {
+                                int count = 0;
+
+                                RB_FOREACH_PARTITION(stmp, stree, sbounds, j)
+                                        count++;
+                                CHECK_TRUE(count == n / m ||
+                                    count == n / m + 1, "uneven partition");
+                                total += count;
+                        }
+                        CHECK_EQUAL_INT(n, total, "RB_PARTITION coverage");
+                }
+        }
+        return 0;
+}
+
+/* A compact tree, checked step by step against a pointer tree */
+int rb_compact_test(void)
+{
+        static struct node store[TEST_SIZE];
+        struct ctree croot = RB_INITIALIZER(&croot);
+        struct cnode ckey, *ctmp;
+        struct node key, *tmp;
+        int i, j;
+
+        CHECK_TRUE(sizeof(cpool[0].node) == 3 * sizeof(uint32_t), "");
+        RB_INIT(&root);
+        for (i = 0; i < TEST_SIZE; i++) {
+                j = rand() % TEST_SIZE;
+                store[i].key = cpool[i].key = j;
+                tmp = RB_INSERT(tree, &root, &store[i]);
+                ctmp = RB_INSERT(ctree, &croot, &cpool[i]);
+                CHECK_TRUE((tmp == NULL) == (ctmp == NULL), "RB_INSERT");
+                CHECK_TRUE(ctmp == NULL || ctmp->key == j, "RB_INSERT");
+                if (i % 64 == 0)
+                        CHECK_TRUE(ctree_RB_RANK(RB_ROOT(&croot)) >= 0,
+                            "compact rank balance error");
+        }
+        for (i = -1; i <= TEST_SIZE; i++) {
+                key.key = ckey.key = i;
+                tmp = RB_NFIND(tree, &root, &key);
+                ctmp = RB_NFIND(ctree, &croot, &ckey);
+                CHECK_TRUE(tmp == NULL ? ctmp == NULL :
+                    ctmp != NULL && ctmp->key == tmp->key, "RB_NFIND");
+                tmp = RB_PFIND(tree, &root, &key);
+                ctmp = RB_PFIND(ctree, &croot, &ckey);
+                CHECK_TRUE(tmp == NULL ? ctmp == NULL :
+                    ctmp != NULL && ctmp->key == tmp->key, "RB_PFIND");
+        }
+        tmp = RB_MIN(tree, &root);
+        RB_FOREACH(ctmp, ctree, &croot) {
+                CHECK_TRUE(tmp != NULL && tmp->key == ctmp->key,
+                    "RB_FOREACH");
+                tmp = RB_NEXT(tree, &root, tmp);
+        }
+        CHECK_TRUE(tmp == NULL, "RB_FOREACH");
+        tmp = RB_MAX(tree, &root);
+        RB_FOREACH_REVERSE(ctmp, ctree, &croot) {
+                CHECK_TRUE(tmp != NULL && tmp->key == ctmp->key,
+                    "RB_FOREACH_REVERSE");
+                tmp = RB_PREV(tree, &root, tmp);
+        }
+        for (i = 0; i < TEST_SIZE; i++) {
+                key.key = ckey.key = (i * 7919) % TEST_SIZE;
+                tmp = RB_FIND(tree, &root, &key);
+                ctmp = RB_FIND(ctree, &croot, &ckey);
+                CHECK_TRUE((tmp == NULL) == (ctmp == NULL), "RB_FIND");
+                if (ctmp == NULL)
+                        continue;
+                RB_REMOVE(tree, &root, tmp);
+                CHECK_TRUE(ctmp == RB_REMOVE(ctree, &croot, ctmp),
+                    "RB_REMOVE");
+                CHECK_TRUE(NULL == RB_FIND(ctree, &croot, &ckey), "");
+                if (i % 64 == 0)
+                        CHECK_TRUE(ctree_RB_RANK(RB_ROOT(&croot)) >= 0,
+                            "compact rank balance error");
+        }
+        CHECK_TRUE(RB_EMPTY(&croot), "");
+        CHECK_TRUE(RB_EMPTY(&root), "");
+        return 0;
+}
+
+/* A two-link tree, checked against a pointer tree under random updates */
+int rb_path_test(void)
+{
+        static struct node store[TEST_SIZE];
+        static struct tnode tstore[TEST_SIZE];
+        struct ttree troot = RB_INITIALIZER(&troot);
+        RB_ITER(ttree) iter;
+        struct tnode tkey, *ttmp;
+        struct node key, *tmp;
+        int i, j, n = 0;
+
+        CHECK_TRUE(sizeof(tstore[0].node) == 2 * sizeof(void *), "");
+        RB_INIT(&root);
+        for (i = 0; i < TEST_SIZE; i++) {
+                store[i].key = tstore[i].key = i;
+                RB_SET(&store[i], NULL, node);
+        }
+        for (i = 0; i < 8 * TEST_SIZE; i++) {
+                j = rand() % TEST_SIZE;
+                tmp = RB_FIND(tree, &root, &store[j]);
+                if (tmp == NULL && rand() % 3 != 0) {
+                        CHECK_TRUE(NULL == RB_INSERT(tree, &root, &store[j]),
+                            "");
+                        CHECK_TRUE(NULL == RB_INSERT(ttree, &troot,
+                            &tstore[j]), "RB_INSERT");
+                        CHECK_TRUE(&tstore[j] == RB_INSERT(ttree, &troot,
+                            &tstore[j]), "RB_INSERT duplicate");
+                        n++;
+                } else if (tmp != NULL) {
+                        RB_REMOVE(tree, &root, tmp);
+                        CHECK_TRUE(&tstore[j] == RB_REMOVE(ttree, &troot,
+                            &tstore[j]), "RB_REMOVE");
+                        CHECK_TRUE(NULL == RB_FIND(ttree, &troot, &tstore[j]),
+                            "RB_REMOVE");
+                        n--;
+                }
+                if (i % 256 == 0)
+                        CHECK_TRUE(ttree_RB_RANK(RB_ROOT(&troot)) >= 0,
+                            "two-link rank balance error");
+        }
+        CHECK_TRUE(ttree_RB_RANK(RB_ROOT(&troot)) >= 0,
+            "two-link rank balance error");
+        tmp = RB_MIN(tree, &root);
+        RB_FOREACH_PATH(ttmp, ttree, &troot, &iter) {
+                CHECK_TRUE(tmp != NULL && tmp->key == ttmp->key,
+                    "RB_FOREACH_PATH");
+                tmp = RB_NEXT(tree, &root, tmp);
+                n--;
+        }
+        CHECK_TRUE(tmp == NULL && n == 0, "RB_FOREACH_PATH");
+        ttmp = RB_MAX(ttree, &troot);
+        tmp = RB_MAX(tree, &root);
+        CHECK_TRUE(tmp == NULL ? ttmp == NULL : ttmp->key == tmp->key,
+            "RB_MAX");
+        for (i = -1; i <= TEST_SIZE; i++) {
+                key.key = tkey.key = i;
+                tmp = RB_NFIND(tree, &root, &key);
+                ttmp = RB_NFIND(ttree, &troot, &tkey);
+                CHECK_TRUE(tmp == NULL ? ttmp == NULL :
+                    ttmp != NULL && ttmp->key == tmp->key, "RB_NFIND");
+                tmp = RB_PFIND(tree, &root, &key);
+                ttmp = RB_PFIND(ttree, &troot, &tkey);
+                CHECK_TRUE(tmp == NULL ? ttmp == NULL :
+                    ttmp != NULL && ttmp->key == tmp->key, "RB_PFIND");
+        }
+        while ((ttmp = RB_MIN(ttree, &troot)) != NULL)
+                CHECK_TRUE(ttmp == RB_REMOVE(ttree, &troot, ttmp), "");
+        return 0;
+}
+
+int rb_hint_test(void)
+{
+        static struct node store[TEST_SIZE];
+        struct node key, *hint = NULL, *tmp;
+        int i, j, n = 0;
+
+        /* Near-sorted insertion, each hinted by the one before */
+        RB_INIT(&root);
+        for (i = 0; i < TEST_SIZE; i++) {
+                store[i].key = i + rand() % 16;
+                tmp = RB_INSERT_HINT(tree, &root, hint, &store[i]);
+                CHECK_TRUE(tmp == RB_FIND(tree, &root, &store[i]) ||
+                    tmp == NULL, "RB_INSERT_HINT");
+                if (tmp == NULL) {
+                        hint = &store[i];
+                        n++;
+                } else
+                        CHECK_TRUE(tmp->key == store[i].key,
+                            "RB_INSERT_HINT duplicate");
+                if (i % 64 == 0)
+                        CHECK_TRUE(tree_RB_RANK(RB_ROOT(&root)) >= 0,
+                            "RB rank balance error");
+        }
+        j = 0;
+        RB_FOREACH(tmp, tree, &root)
+                j++;
+        CHECK_EQUAL_INT(n, j, "RB_INSERT_HINT count");
+        /* Every key, searched from every kind of hint */
+        for (i = -1; i <= TEST_SIZE + 16; i++) {
+                key.key = i;
+                tmp = RB_FIND(tree, &root, &key);
+                CHECK_TRUE(tmp == RB_FIND_FROM(tree, &root, NULL, &key),
+                    "RB_FIND_FROM no hint");
+                CHECK_TRUE(tmp == RB_FIND_FROM(tree, &root, hint, &key),
+                    "RB_FIND_FROM last");
+                CHECK_TRUE(tmp == RB_FIND_FROM(tree, &root,
+                    RB_ROOT(&root), &key), "RB_FIND_FROM root");
+                j = rand() % TEST_SIZE;
+                if (RB_FIND(tree, &root, &store[j]) == &store[j])
+                        CHECK_TRUE(tmp == RB_FIND_FROM(tree, &root,
+                            &store[j], &key), "RB_FIND_FROM random");
+        }
+        return 0;
+}
+
+static int
+check_cached_tree(struct qtree *head)
+{
+        struct qnode *min = NULL, *max = NULL, *tmp;
+
+        for (tmp = RB_ROOT(head); tmp != NULL; tmp = RB_LEFT(tmp, node))
+                min = tmp;
+        for (tmp = RB_ROOT(head); tmp != NULL; tmp = RB_RIGHT(tmp, node))
+                max = tmp;
+        CHECK_TRUE(RB_MIN(qtree, head) == min, "cached RB_MIN");
+        CHECK_TRUE(RB_MAX(qtree, head) == max, "cached RB_MAX");
+        return 0;
+}
+
+int rb_cached_test(void)
+{
+        static struct qnode store[TEST_SIZE];
+        struct qnode *elems[TEST_SIZE], *tmp;
+        struct qtree head = RB_INITIALIZER(&head), other;
+        int i, j, prev;
+
+        for (i = 0; i < TEST_SIZE; i++)
+                store[i].key = i;
+        /* A deadline queue: insert at random, pop the least */
+        for (i = 0; i < 4 * TEST_SIZE; i++) {
+                j = rand() % TEST_SIZE;
+                if (rand() % 2 != 0)
+                        (void)RB_INSERT(qtree, &head, &store[j]);
+                else if ((tmp = RB_MIN(qtree, &head)) != NULL)
+                        RB_REMOVE(qtree, &head, tmp);
+                if (rand() % 8 == 0 && (tmp = RB_MAX(qtree, &head)) != NULL)
+                        RB_REMOVE(qtree, &head, tmp);
+                RETURN_IF_NONZERO(check_cached_tree(&head));
+        }
+        prev = -1;
+        while ((tmp = RB_MIN(qtree, &head)) != NULL) {
+                CHECK_TRUE(tmp->key > prev, "pop order");
+                prev = tmp->key;
+                RB_REMOVE(qtree, &head, tmp);
+                RETURN_IF_NONZERO(check_cached_tree(&head));
+        }
+
+        /* Functions that set the root outright reset the cache */
+        for (i = 0; i < TEST_SIZE; i++)
+                elems[i] = &store[i];
+        RB_BUILD_SORTED(qtree, &head, elems, TEST_SIZE);
+        RETURN_IF_NONZERO(check_cached_tree(&head));
+        RB_INIT(&other);
+        RB_SPLIT(qtree, &head, &store[TEST_SIZE / 3], &head, &other);
+        RETURN_IF_NONZERO(check_cached_tree(&head));
+        RETURN_IF_NONZERO(check_cached_tree(&other));
+        tmp = RB_MIN(qtree, &other);
+        RB_REMOVE(qtree, &other, tmp);
+        RB_JOIN(qtree, &head, tmp, &other);
+        RETURN_IF_NONZERO(check_cached_tree(&head));
+        CHECK_TRUE(RB_EMPTY(&other) && RB_MIN(qtree, &other) == NULL, "");
+        RB_INIT(&head);
+        CHECK_TRUE(RB_MIN(qtree, &head) == NULL, "RB_INIT cached");
+        return 0;
+}
+
+int rb_latch_test(void)
+{
+        static struct lnode store[TEST_SIZE];
+        struct ltree head = RB_LATCH_INITIALIZER(&head);
+        struct lnode key, *tmp, *prev;
+        static char in[TEST_SIZE];
+        int i, j, n = 0;
+
+        for (i = 0; i < TEST_SIZE; i++)
+                store[i].key = i * 2;
+        for (i = 0; i < 4 * TEST_SIZE; i++) {
+                j = rand() % TEST_SIZE;
+                if (!in[j]) {
+                        CHECK_TRUE(RB_INSERT(ltree, &head, &store[j]) == NULL,
+                            "latch RB_INSERT");
+                        in[j] = 1;
+                        n++;
+                } else if (rand() % 4 == 0) {
+                        CHECK_TRUE(RB_INSERT(ltree, &head, &store[j]) ==
+                            &store[j], "latch RB_INSERT duplicate");
+                } else {
+                        RB_REMOVE(ltree, &head, &store[j]);
+                        in[j] = 0;
+                        n--;
+                }
+                CHECK_TRUE(head.rbl_seq % 2 == 0, "latch sequence");
+                if (i % 256 == 0) {
+                        CHECK_TRUE(ltree_RB_LATCH0_RB_RANK(
+                            RB_ROOT(&head.rbl_tree0)) >= 0, "latch rank 0");
+                        CHECK_TRUE(ltree_RB_LATCH1_RB_RANK(
+                            RB_ROOT(&head.rbl_tree1)) >= 0, "latch rank 1");
+                }
+        }
+        /* Readers find the same nodes from either copy */
+        for (i = -1; i < 2 * TEST_SIZE; i++) {
+                key.key = i;
+                j = (i + 1) / 2;
+                tmp = RB_FIND(ltree, &head, &key);
+                CHECK_TRUE(tmp == (i >= 0 && i % 2 == 0 && in[i / 2] ?
+                    &store[i / 2] : NULL), "latch RB_FIND");
+                while (j < TEST_SIZE && !in[j])
+                        j++;
+                CHECK_TRUE(RB_NFIND(ltree, &head, &key) ==
+                    (j < TEST_SIZE ? &store[j] : NULL), "latch RB_NFIND");
+                head.rbl_seq++;
+                CHECK_TRUE(RB_FIND(ltree, &head, &key) == tmp,
+                    "latch RB_FIND copy 1");
+                head.rbl_seq++;
+        }
+        prev = NULL;
+        j = 0;
+        RB_FOREACH_LATCH(tmp, ltree, &head) {
+                CHECK_TRUE(prev == NULL || prev->key < tmp->key,
+                    "RB_FOREACH_LATCH order");
+                prev = tmp;
+                j++;
+        }
+        CHECK_EQUAL_INT(n, j, "latch count");
+        RB_LATCH_INIT(&head);
+        CHECK_TRUE(RB_FIND(ltree, &head, &store[0]) == NULL, "RB_LATCH_INIT");
+        return 0;
+}
+
+/*
+ * Readers look up keys while a writer keeps inserting and removing the odd
+ * ones.  The even keys stay in the tree, so a lookup that raced the writer
+ * must search again rather than miss one or return the wrong node.
+ */
+#define LATCH_READERS   4
+#define LATCH_WRITES    (64 * TEST_SIZE)
+
+struct latch_reader {
+        pthread_t thread;
+        struct ltree *head;
+        struct lnode *store;
+        int *stop;
+        unsigned int seed;
+        long lookups;
+        long errors;
+};
+
+static void *
+latch_reader_main(void *arg)
+{
+        struct latch_reader *r = arg;
+        struct lnode key, *tmp;
+
+        while (!__atomic_load_n(r->stop, __ATOMIC_RELAXED)) {
+                key.key = rand_r(&r->seed) % TEST_SIZE;
+                tmp = RB_FIND(ltree, r->head, &key);
+                if (key.key % 2 == 0 ? tmp != &r->store[key.key] :
+                    tmp != NULL && tmp != &r->store[key.key])
+                        r->errors++;
+                tmp = RB_NFIND(ltree, r->head, &key);
+                if (tmp != &r->store[key.key] &&
+                    (key.key % 2 == 0 || (key.key + 1 < TEST_SIZE ?
+                    tmp != &r->store[key.key + 1] : tmp != NULL)))
+                        r->errors++;
+                r->lookups++;
+        }
+        return NULL;
+}
+
+int rb_latch_thread_test(void)
+{
+        static struct lnode store[TEST_SIZE];
+        static struct ltree head = RB_LATCH_INITIALIZER(&head);
+        struct latch_reader readers[LATCH_READERS];
+        int i, j, stop = 0;
+
+        for (i = 0; i < TEST_SIZE; i++) {
+                store[i].key = i;
+                if (i % 2 == 0)
+                        RB_INSERT(ltree, &head, &store[i]);
+        }
+        for (i = 0; i < LATCH_READERS; i++) {
+                readers[i].head = &head;
+                readers[i].store = store;
+                readers[i].stop = &stop;
+                readers[i].seed = i + 1;
+                readers[i].lookups = readers[i].errors = 0;
+                CHECK_TRUE(pthread_create(&readers[i].thread, NULL,
+                    latch_reader_main, &readers[i]) == 0, "pthread_create");
+        }
+        for (i = 0; i < LATCH_WRITES; i++) {
+                j = (rand() % (TEST_SIZE / 2)) * 2 + 1;
+                if (RB_INSERT(ltree, &head, &store[j]) != NULL)
+                        RB_REMOVE(ltree, &head, &store[j]);
+        }
+        __atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+        for (i = 0; i < LATCH_READERS; i++) {
+                pthread_join(readers[i].thread, NULL);
+                CHECK_EQUAL_INT(0, (int)readers[i].errors,
+                    "latch lookup under a writer");
+        }
+        CHECK_TRUE(ltree_RB_LATCH0_RB_RANK(RB_ROOT(&head.rbl_tree0)) >= 0,
+            "latch rank 0");
+        CHECK_TRUE(ltree_RB_LATCH1_RB_RANK(RB_ROOT(&head.rbl_tree1)) >= 0,
+            "latch rank 1");
+        return 0;
+}
+
+int rb_shared_test(void)
+{
+        static struct hnode store[TEST_SIZE];
+        static char in[TEST_SIZE];
+        struct htree head = RB_INITIALIZER(&head);
+        struct hname names[ITER], nkey;
+        struct hname_tree nhead = RB_INITIALIZER(&nhead);
+        struct hnode key, *tmp, *prev;
+        struct hname *ntmp, *nprev;
+        int i, j, n = 0;
+
+        for (i = 0; i < TEST_SIZE; i++)
+                store[i].key = 2 * i;
+        for (i = 0; i < 4 * TEST_SIZE; i++) {
+                j = rand() % TEST_SIZE;
+                if (!in[j]) {
+                        CHECK_TRUE(RB_INSERT(htree, &head, &store[j]) == NULL,
+                            "shared RB_INSERT");
+                        in[j] = 1;
+                        n++;
+                } else if (rand() % 4 == 0) {
+                        CHECK_TRUE(RB_INSERT(htree, &head, &store[j]) ==
+                            &store[j], "shared RB_INSERT duplicate");
+                } else {
+                        CHECK_TRUE(RB_REMOVE(htree, &head, &store[j]) ==
+                            &store[j], "shared RB_REMOVE");
+                        in[j] = 0;
+                        n--;
+                }
+                if (i % 256 == 0)
+                        CHECK_TRUE(_rb_shared_RB_RANK(RB_ROOT(&head)) >= 0,
+                            "shared rank");
+        }
+        for (i = -1; i < 2 * TEST_SIZE; i++) {
+                key.key = i;
+                tmp = RB_FIND(htree, &head, &key);
+                CHECK_TRUE(tmp == (i >= 0 && i % 2 == 0 && in[i / 2] ?
+                    &store[i / 2] : NULL), "shared RB_FIND");
+                for (j = (i + 1) / 2; j < TEST_SIZE && !in[j]; j++)
+                        ;
+                CHECK_TRUE(RB_NFIND(htree, &head, &key) ==
+                    (j < TEST_SIZE ? &store[j] : NULL),
+                    "shared RB_NFIND");
+                for (j = i < 0 ? -1 : i / 2; j >= 0 && !in[j]; j--)
+                        ;
+                CHECK_TRUE(RB_PFIND(htree, &head, &key) ==
+                    (j >= 0 ? &store[j] : NULL), "shared RB_PFIND");
+        }
+        prev = NULL;
+        j = 0;
+        RB_FOREACH(tmp, htree, &head) {
+                CHECK_TRUE(prev == NULL || prev->key < tmp->key,
+                    "shared RB_FOREACH order");
+                prev = tmp;
+                j++;
+        }
+        CHECK_EQUAL_INT(n, j, "shared count");
+        CHECK_TRUE(RB_MAX(htree, &head) == prev, "shared RB_MAX");
+        CHECK_TRUE(n == 0 || &RB_ROOT_SHARED(htree, &head)->node ==
+            RB_ROOT(&head), "RB_ROOT_SHARED");
+        RB_FOREACH_REVERSE(tmp, htree, &head) {
+                CHECK_TRUE(tmp == prev, "shared RB_FOREACH_REVERSE");
+                prev = RB_PREV(htree, &head, tmp);
+        }
+        CHECK_TRUE(prev == NULL, "shared RB_PREV");
+
+        /* A second type, with a different key, shares the same code */
+        for (i = 0; i < ITER; i++) {
+                snprintf(names[i].name, sizeof(names[i].name), "%d", i);
+                CHECK_TRUE(RB_INSERT(hname_tree, &nhead, &names[i]) == NULL,
+                    "shared RB_INSERT names");
+        }
+        nprev = NULL;
+        RB_FOREACH(ntmp, hname_tree, &nhead) {
+                CHECK_TRUE(nprev == NULL ||
+                    strcmp(nprev->name, ntmp->name) < 0, "shared names");
+                nprev = ntmp;
+        }
+        strcpy(nkey.name, "42");
+        CHECK_TRUE(RB_FIND(hname_tree, &nhead, &nkey) == &names[42],
+            "shared RB_FIND names");
+        while ((ntmp = RB_MIN(hname_tree, &nhead)) != NULL)
+                RB_REMOVE(hname_tree, &nhead, ntmp);
+        CHECK_TRUE(RB_EMPTY(&nhead), "shared RB_REMOVE names");
+        return 0;
+}
+
+#define SNAPSHOTS 4
+
+/* Checks that a version holds exactly the keys marked in in */
+static int
+check_snapshot(struct vtree *snap, const char *in, int size)
+{
+        RB_ITER(vtree) iter;
+        struct vnode key, *tmp;
+        int i, n = 0;
+
+        CHECK_TRUE(vtree_RB_RANK(RB_ROOT(snap)) >= 0, "persist rank");
+        for (i = 0; i < size; i++) {
+                key.key = i;
+                tmp = RB_FIND(vtree, snap, &key);
+                CHECK_TRUE(in[i] ? tmp != NULL && tmp->key == i : tmp == NULL,
+                    "persist RB_FIND");
+                n += in[i];
+        }
+        RB_FOREACH_PATH(tmp, vtree, snap, &iter)
+                n--;
+        CHECK_EQUAL_INT(0, n, "persist count");
+        return 0;
+}
+
+int rb_persist_test(void)
+{
+        struct vtree head = RB_INITIALIZER(&head), snaps[SNAPSHOTS], prev;
+        static char in[SNAPSHOTS + 1][ITER];
+        struct vnode key, *elm, *tmp;
+        int i, j, k, live;
+
+        for (i = 0; i < 64 * ITER; i++) {
+                key.key = rand() % ITER;
+                if (!in[SNAPSHOTS][key.key]) {
+                        elm = vnode_alloc(&head);
+                        elm->key = key.key;
+                        CHECK_TRUE(RB_INSERT(vtree, &head, elm) == NULL,
+                            "persist RB_INSERT");
+                        in[SNAPSHOTS][key.key] = 1;
+                } else {
+                        tmp = RB_REMOVE(vtree, &head, &key);
+                        CHECK_TRUE(tmp != NULL && tmp->key == key.key,
+                            "persist RB_REMOVE");
+                        in[SNAPSHOTS][key.key] = 0;
+                }
+                /* Replace the oldest snapshot, and free what it held */
+                if (i % 16 == 0) {
+                        k = (i / 16) % SNAPSHOTS;
+                        snaps[k] = RB_SNAPSHOT(vtree, &head);
+                        memcpy(in[k], in[SNAPSHOTS], ITER);
+                        if (i / 16 >= SNAPSHOTS - 1)
+                                vnode_reclaim(snaps[(k + 1) % SNAPSHOTS].rbh_gen);
+                }
+                if (i % 64 == 0) {
+                        for (k = 0; k < SNAPSHOTS && k <= i / 16; k++)
+                                RETURN_IF_NONZERO(check_snapshot(&snaps[k],
+                                    in[k], ITER));
+                        RETURN_IF_NONZERO(check_snapshot(&head,
+                            in[SNAPSHOTS], ITER));
+                }
+        }
+
+        /* A write that cannot allocate leaves the tree as it was */
+        elm = vnode_alloc(&head);
+        for (j = 0; j < 4; j++) {
+                prev = head;
+                elm->key = ITER;
+                key.key = RB_MAX(vtree, &head)->key;
+                vbudget = j;
+                CHECK_TRUE(RB_INSERT(vtree, &head, elm) == elm,
+                    "persist RB_INSERT out of memory");
+                vbudget = j;
+                CHECK_TRUE(RB_REMOVE(vtree, &head, &key) == NULL,
+                    "persist RB_REMOVE out of memory");
+                vbudget = -1;
+                CHECK_TRUE(RB_ROOT(&head) == RB_ROOT(&prev) &&
+                    head.rbh_gen == prev.rbh_gen, "persist failed write");
+                RETURN_IF_NONZERO(check_snapshot(&head, in[SNAPSHOTS], ITER));
+        }
+        elm->next = vfree;
+        vfree = elm;
+
+        /* With no snapshots left, only the newest version holds nodes */
+        while ((elm = RB_MIN(vtree, &head)) != NULL)
+                CHECK_TRUE(RB_REMOVE(vtree, &head, elm) == elm, "");
+        vnode_reclaim(head.rbh_gen);
+        live = vused;
+        for (elm = vfree; elm != NULL; elm = elm->next)
+                live--;
+        CHECK_EQUAL_INT(0, live, "persist leak");
+        return 0;
+}
+
+static void
+prefix_name(char *name, size_t size, int i)
+{
+        /* Half the names share their first 8 bytes, so fall back to cmp */
+        if (i % 2)
+                snprintf(name, size, "shared_prefix_%04d", i);
+        else
+                snprintf(name, size, "%04d", i);
+}
+
+static int
+prefix_sort(const void *a, const void *b)
+{
+        return pcompare(*(struct pnode *const *)a, *(struct pnode *const *)b);
+}
+
+int rb_prefix_test(void)
+{
+        struct pnode store[ITER], key, *tmp, *prev, *elms[ITER];
+        struct ptree other;
+        int i, j, n;
+
+        RB_INIT(&proot);
+        for (i = 0; i < ITER; i++) {
+                prefix_name(store[i].name, sizeof(store[i].name),
+                    (i * 7) % ITER);
+                CHECK_TRUE(NULL == RB_INSERT(ptree, &proot, &store[i]), "");
+        }
+        for (i = 0; i < ITER; i++) {
+                prefix_name(key.name, sizeof(key.name), i);
+                tmp = RB_FIND(ptree, &proot, &key);
+                CHECK_TRUE(tmp != NULL && strcmp(tmp->name, key.name) == 0,
+                    "RB_FIND by prefix");
+                CHECK_TRUE(RB_INSERT(ptree, &proot, &key) == tmp,
+                    "RB_INSERT duplicate");
+        }
+        strcpy(key.name, "shared_prefix_");
+        tmp = RB_NFIND(ptree, &proot, &key);
+        CHECK_TRUE(tmp != NULL && strcmp(tmp->name, "shared_prefix_0001") == 0,
+            "RB_NFIND by prefix");
+
+        /* Rename nodes in place and move them with RB_REINSERT */
+        for (i = 0; i < ITER; i += 3) {
+                prefix_name(store[i].name, sizeof(store[i].name),
+                    ITER + (i * 11) % ITER);
+                CHECK_TRUE(NULL == RB_REINSERT(ptree, &proot, &store[i]),
+                    "RB_REINSERT");
+        }
+        n = 0;
+        prev = NULL;
+        RB_FOREACH(tmp, ptree, &proot) {
+                CHECK_TRUE(prev == NULL || strcmp(prev->name, tmp->name) < 0,
+                    "prefix tree order");
+                prev = tmp;
+                n++;
+        }
+        CHECK_EQUAL_INT(ITER, n, "");
+        for (i = 0; i < ITER; i++) {
+                j = (i * 13) % ITER;
+                CHECK_TRUE(&store[j] == RB_REMOVE(ptree, &proot, &store[j]),
+                    "");
+                CHECK_TRUE(NULL == RB_FIND(ptree, &proot, &store[j]), "");
+        }
+        CHECK_TRUE(RB_EMPTY(&proot), "");
+
+        /* Trees built or joined from nodes with stale prefixes */
+        for (i = 0; i < ITER; i++) {
+                prefix_name(store[i].name, sizeof(store[i].name), i);
+                store[i].node.rbe_prefix = ~(uint64_t)0;
+                elms[i] = &store[i];
+        }
+        qsort(elms, ITER, sizeof(elms[0]), prefix_sort);
+        RB_BUILD_SORTED(ptree, &proot, elms, ITER / 2);
+        RB_INIT(&other);
+        RB_BUILD_SORTED(ptree, &other, elms + ITER / 2 + 1,
+            ITER - ITER / 2 - 1);
+        RB_JOIN(ptree, &proot, elms[ITER / 2], &other);
+        for (i = 0; i < ITER; i++) {
+                prefix_name(key.name, sizeof(key.name), i);
+                CHECK_TRUE(RB_FIND(ptree, &proot, &key) == &store[i],
+                    "RB_FIND by prefix after RB_BUILD_SORTED and RB_JOIN");
+        }
+        return 0;
+}
+
 int main(void)
 {
         time_t t;
         srand((unsigned)time(&t));
         RETURN_IF_NONZERO(rb_test());
+        RETURN_IF_NONZERO(rb_size_test());
+        RETURN_IF_NONZERO(rb_interval_test());
+        RETURN_IF_NONZERO(rb_aggregate_test());
+        RETURN_IF_NONZERO(rb_build_test());
+        RETURN_IF_NONZERO(rb_join_test());
+        RETURN_IF_NONZERO(rb_setop_test());
+        RETURN_IF_NONZERO(rb_setop_sorted_test());
+        RETURN_IF_NONZERO(rb_range_test());
+        RETURN_IF_NONZERO(rb_freeze_test());
+        RETURN_IF_NONZERO(rb_key_test());
+        RETURN_IF_NONZERO(rb_prefix_test());
+        RETURN_IF_NONZERO(rb_batch_test());
+        RETURN_IF_NONZERO(rb_partition_test());
+        RETURN_IF_NONZERO(rb_compact_test());
+        RETURN_IF_NONZERO(rb_path_test());
+        RETURN_IF_NONZERO(rb_cached_test());
+        RETURN_IF_NONZERO(rb_hint_test());
+        RETURN_IF_NONZERO(rb_latch_test());
+        RETURN_IF_NONZERO(rb_latch_thread_test());
+        RETURN_IF_NONZERO(rb_persist_test());
+        RETURN_IF_NONZERO(rb_shared_test());
+        RETURN_IF_NONZERO(rb_weight_test());
         return 0;
 }
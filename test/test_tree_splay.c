@@ -35,6 +35,7 @@
 struct node {
         SPLAY_ENTRY(node) node;
         int key;
+        unsigned long hits;
 };
 
 static SPLAY_HEAD(tree, node) root;
@@ -50,6 +51,28 @@ compare(struct node *a, struct node *b)
 SPLAY_PROTOTYPE(tree, node, node, compare);
 
 SPLAY_GENERATE(tree, node, node, compare);
+SPLAY_PROTOTYPE_ITER(tree, node, node, compare);
+SPLAY_GENERATE_ITER(tree, node, node, compare);
+SPLAY_PROTOTYPE_WEIGHT(tree, node, node, compare, hits);
+SPLAY_GENERATE_WEIGHT(tree, node, node, compare, hits);
+
+struct pnode {
+        SPLAY_ENTRY_PARENT(pnode) node;
+        int key;
+};
+
+static SPLAY_HEAD(ptree, pnode) proot;
+static int pcompares;
+
+static int
+pcompare(struct pnode *a, struct pnode *b)
+{
+        pcompares++;
+        return (a->key > b->key) - (a->key < b->key);
+}
+
+SPLAY_PROTOTYPE_PARENT(ptree, pnode, node, pcompare);
+SPLAY_GENERATE_PARENT(ptree, pnode, node, pcompare);
 
 #define ITER 150
 #define MIN 5
@@ -102,11 +125,276 @@ int splay_test(void)
         return 0;
 }
 
+/* Returns the depth of the deepest node below elm */
+static int
+height(struct node *elm)
+{
+        int l, r;
+
+        if (elm == NULL)
+                return 0;
+        l = height(SPLAY_LEFT(elm, node));
+        r = height(SPLAY_RIGHT(elm, node));
+        return 1 + (l > r ? l : r);
+}
+
+int splay_nosplay_test(void)
+{
+        struct node store[ITER], key, *tmp, *top;
+        int i;
+
+        SPLAY_INIT(&root);
+        /* Inserting in order leaves a path, with the largest key on top */
+        for (i = 0; i < ITER; i++) {
+                store[i].key = 2 * i;
+                CHECK_TRUE(NULL == SPLAY_INSERT(tree, &root, &store[i]), "");
+        }
+        CHECK_EQUAL_INT(ITER, height(SPLAY_ROOT(&root)), "");
+        top = SPLAY_ROOT(&root);
+
+        for (i = 0; i < 2 * ITER; i++) {
+                key.key = i;
+                tmp = SPLAY_FIND_NOSPLAY(tree, &root, &key);
+                if (i % 2 == 0)
+                        CHECK_TRUE(tmp == &store[i / 2], "wrong node");
+                else
+                        CHECK_TRUE(tmp == NULL, "found a missing key");
+                CHECK_TRUE(top == SPLAY_ROOT(&root), "root moved");
+        }
+        CHECK_EQUAL_INT(ITER, height(SPLAY_ROOT(&root)), "");
+
+        /* Nodes no deeper than the limit stay where they are */
+        key.key = 2 * (ITER - 11);
+        tmp = SPLAY_FIND_DEPTH(tree, &root, &key, 10);
+        CHECK_TRUE(tmp == &store[ITER - 11], "wrong node");
+        CHECK_TRUE(top == SPLAY_ROOT(&root), "root moved");
+        key.key = 1;
+        CHECK_TRUE(NULL == SPLAY_FIND_DEPTH(tree, &root, &key, 0), "");
+        CHECK_TRUE(top == SPLAY_ROOT(&root), "root moved");
+
+        /* Deeper ones are splayed to the root */
+        key.key = 0;
+        tmp = SPLAY_FIND_DEPTH(tree, &root, &key, 10);
+        CHECK_TRUE(tmp == &store[0], "wrong node");
+        CHECK_TRUE(tmp == SPLAY_ROOT(&root), "node not splayed");
+        CHECK_TRUE(height(SPLAY_ROOT(&root)) < ITER, "tree not reshaped");
+
+        i = 0;
+        SPLAY_FOREACH(tmp, tree, &root)
+                CHECK_EQUAL_INT(2 * i++, tmp->key, "");
+        CHECK_EQUAL_INT(ITER, i, "");
+        SPLAY_INIT(&root);
+        return 0;
+}
+
+int splay_iter_test(void)
+{
+        struct node store[ITER], *tmp, *top;
+        SPLAY_ITER(tree) it;
+        int i, n;
+
+        SPLAY_INIT(&root);
+        CHECK_TRUE(NULL == SPLAY_ITER_FIRST(tree, &root, &it), "");
+        CHECK_TRUE(NULL == SPLAY_ITER_LAST(tree, &root, &it), "");
+
+        /* A path deeper than the iterator's stack */
+        for (i = 0; i < ITER; i++) {
+                store[i].key = i;
+                CHECK_TRUE(NULL == SPLAY_INSERT(tree, &root, &store[i]), "");
+        }
+        top = SPLAY_ROOT(&root);
+        i = 0;
+        SPLAY_FOREACH_ITER(tmp, tree, &root, &it)
+                CHECK_TRUE(tmp == &store[i++], "out of order");
+        CHECK_EQUAL_INT(ITER, i, "");
+        SPLAY_FOREACH_REVERSE_ITER(tmp, tree, &root, &it)
+                CHECK_TRUE(tmp == &store[--i], "out of order");
+        CHECK_EQUAL_INT(0, i, "");
+        CHECK_TRUE(top == SPLAY_ROOT(&root), "root moved");
+        CHECK_EQUAL_INT(ITER, height(SPLAY_ROOT(&root)), "");
+
+        /* Reshape it, then stop a walk early */
+        for (i = 0; i < ITER; i += 7)
+                CHECK_TRUE(&store[i] == SPLAY_FIND(tree, &root, &store[i]), "");
+        top = SPLAY_ROOT(&root);
+        n = 0;
+        SPLAY_FOREACH_ITER(tmp, tree, &root, &it) {
+                CHECK_TRUE(tmp == &store[n], "out of order");
+                if (++n == ITER / 2)
+                        break;
+        }
+        for (i = ITER - 1, tmp = SPLAY_ITER_LAST(tree, &root, &it);
+            tmp != NULL; tmp = SPLAY_ITER_NEXT(tree, &it))
+                CHECK_TRUE(tmp == &store[i--], "out of order");
+        CHECK_EQUAL_INT(-1, i, "");
+        CHECK_TRUE(top == SPLAY_ROOT(&root), "root moved");
+        SPLAY_INIT(&root);
+        return 0;
+}
+
+/* Checks the parent links and key order below elm, and counts its nodes */
+static int
+pcheck(struct pnode *elm, struct pnode *parent, int lo, int hi)
+{
+        int n;
+
+        if (elm == NULL)
+                return 0;
+        if (SPLAY_PARENT(elm, node) != parent || elm->key <= lo ||
+            elm->key >= hi)
+                return -1;
+        if ((n = pcheck(SPLAY_LEFT(elm, node), elm, lo, elm->key)) < 0)
+                return -1;
+        lo = pcheck(SPLAY_RIGHT(elm, node), elm, elm->key, hi);
+        return lo < 0 ? -1 : n + lo + 1;
+}
+
+int splay_parent_test(void)
+{
+        struct pnode store[ITER], key, *tmp;
+        char in[ITER] = { 0 };
+        int i, k, n = 0;
+
+        SPLAY_INIT(&proot);
+        for (i = 0; i < 20 * ITER; i++) {
+                k = rand() % ITER;
+                store[k].key = k;
+                if (!in[k]) {
+                        CHECK_TRUE(NULL == SPLAY_INSERT(ptree, &proot,
+                            &store[k]), "");
+                        CHECK_TRUE(&store[k] == SPLAY_ROOT(&proot), "");
+                        n++;
+                } else if (rand() % 2) {
+                        key.key = k;
+                        CHECK_TRUE(&store[k] == SPLAY_FIND(ptree, &proot,
+                            &key), "");
+                        CHECK_TRUE(&store[k] == SPLAY_ROOT(&proot), "");
+                        continue;
+                } else {
+                        pcompares = 0;
+                        CHECK_TRUE(&store[k] == SPLAY_REMOVE(ptree, &proot,
+                            &store[k]), "");
+                        CHECK_EQUAL_INT(0, pcompares, "remove compared");
+                        n--;
+                }
+                in[k] = !in[k];
+                CHECK_EQUAL_INT(n, pcheck(SPLAY_ROOT(&proot), NULL, -1,
+                    ITER), "bad tree");
+        }
+
+        /* Walks in both directions, then splays each node from below */
+        pcompares = 0;
+        k = -1;
+        SPLAY_FOREACH(tmp, ptree, &proot) {
+                for (k++; !in[k]; k++)
+                        ;
+                CHECK_TRUE(tmp == &store[k], "out of order");
+        }
+        SPLAY_FOREACH_REVERSE(tmp, ptree, &proot) {
+                CHECK_TRUE(tmp == &store[k], "out of order");
+                for (k--; k >= 0 && !in[k]; k--)
+                        ;
+        }
+        CHECK_EQUAL_INT(-1, k, "");
+        for (i = 0; i < ITER; i++) {
+                if (!in[i])
+                        continue;
+                SPLAY_UP(ptree, &proot, &store[i]);
+                CHECK_TRUE(&store[i] == SPLAY_ROOT(&proot), "");
+        }
+        CHECK_EQUAL_INT(0, pcompares, "walk or splay compared");
+        CHECK_EQUAL_INT(n, pcheck(SPLAY_ROOT(&proot), NULL, -1, ITER), "");
+
+        key.key = ITER;
+        CHECK_TRUE(NULL == SPLAY_FIND(ptree, &proot, &key), "");
+        CHECK_TRUE(SPLAY_MAX(ptree, &proot) == SPLAY_ROOT(&proot), "");
+        while ((tmp = SPLAY_MIN(ptree, &proot)) != NULL)
+                SPLAY_REMOVE(ptree, &proot, tmp);
+        return 0;
+}
+
+/* Returns the number of links from the root down to the node with key */
+static int
+depth(int key)
+{
+        struct node *tmp = SPLAY_ROOT(&root);
+        int d = 0;
+
+        while (tmp->key != key) {
+                tmp = key < tmp->key ? SPLAY_LEFT(tmp, node) :
+                    SPLAY_RIGHT(tmp, node);
+                d++;
+        }
+        return d;
+}
+
+int splay_weight_test(void)
+{
+        struct node store[ITER], *elems[ITER], key, *tmp, *top;
+        unsigned long weight[ITER], total = 0;
+        int i, j;
+
+        SPLAY_INIT(&root);
+        CHECK_EQUAL_INT(0, (int)SPLAY_REBUILD(tree, &root, elems, 0), "");
+        /* Inserting in order leaves a path deeper than any stack */
+        for (i = 0; i < ITER; i++) {
+                store[i].key = i;
+                store[i].hits = 0;
+                CHECK_TRUE(NULL == SPLAY_INSERT(tree, &root, &store[i]), "");
+        }
+        /* Key i is looked up about ITER / (ITER - i) times */
+        for (i = 0; i < ITER; i++)
+                for (j = 0; j < ITER / (ITER - i); j++) {
+                        key.key = i;
+                        CHECK_TRUE(&store[i] == SPLAY_FIND_COUNT(tree, &root,
+                            &key), "");
+                }
+        key.key = ITER;
+        CHECK_TRUE(NULL == SPLAY_FIND_COUNT(tree, &root, &key), "");
+        for (i = 0; i < ITER; i++) {
+                weight[i] = store[i].hits + 1;
+                total += weight[i];
+        }
+
+        /* An array too small leaves the tree as it was */
+        top = SPLAY_ROOT(&root);
+        CHECK_EQUAL_INT(ITER, (int)SPLAY_REBUILD(tree, &root, elems, 10), "");
+        CHECK_TRUE(top == SPLAY_ROOT(&root), "");
+        CHECK_EQUAL_INT(ITER, height(SPLAY_ROOT(&root)), "");
+
+        CHECK_EQUAL_INT(ITER, (int)SPLAY_REBUILD(tree, &root, elems, ITER),
+            "");
+        CHECK_TRUE(height(SPLAY_ROOT(&root)) < ITER / 4, "not rebuilt");
+        for (i = 0; i < ITER; i++) {
+                CHECK_TRUE(elems[i] == &store[i], "order");
+                CHECK_TRUE(store[i].hits == 0, "hits not cleared");
+                /* depth <= lg (total / weight) */
+                CHECK_TRUE((weight[i] << depth(i)) <= total, "too deep");
+                key.key = i;
+                CHECK_TRUE(&store[i] == SPLAY_FIND_NOSPLAY(tree, &root, &key),
+                    "");
+        }
+        CHECK_TRUE(depth(ITER - 1) < depth(0), "hot key deeper than cold");
+
+        /* The rebuilt tree is still a splay tree */
+        CHECK_TRUE(&store[0] == SPLAY_REMOVE(tree, &root, &store[0]), "");
+        i = 1;
+        SPLAY_FOREACH(tmp, tree, &root)
+                CHECK_EQUAL_INT(i++, tmp->key, "");
+        CHECK_EQUAL_INT(ITER, i, "");
+        SPLAY_INIT(&root);
+        return 0;
+}
+
 int main(void)
 {
         printf("%d\n", root);
         time_t t;
         srand((unsigned)time(&t));
         RETURN_IF_NONZERO(splay_test());
+        RETURN_IF_NONZERO(splay_nosplay_test());
+        RETURN_IF_NONZERO(splay_iter_test());
+        RETURN_IF_NONZERO(splay_parent_test());
+        RETURN_IF_NONZERO(splay_weight_test());
         return 0;
 }
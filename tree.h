@@ -32,6 +32,7 @@
 #ifndef	_SYS_TREE_H_
 #define	_SYS_TREE_H_
 
+#include <stddef.h>
 #include <stdint.h>
 
 
@@ -45,6 +46,23 @@
 
 typedef uintptr_t __uintptr_t;
 
+/*
+ * The rank bits of an RB tree are read and written through a pointer
+ * to the parent link, which is itself a pointer, so the access must be
+ * exempt from type-based alias analysis.
+ */
+#if defined(__GNUC__) || defined(__clang__)
+typedef uintptr_t __attribute__((__may_alias__)) __rb_bits_t;
+#else
+typedef uintptr_t __rb_bits_t;
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+#define _RB_PREFETCH(addr)	__builtin_prefetch(addr)
+#else
+#define _RB_PREFETCH(addr)	((void)(addr))
+#endif
+
 /*
  * This file defines data structures for different types of trees:
  * splay trees and rank-balanced trees.
@@ -158,6 +176,47 @@ name##_SPLAY_FIND(struct name *head, struct type *elm)			\
 	return (NULL);							\
 }									\
 									\
+/* Finds the node with the same key as elm, but does not splay */	\
+static __unused __inline struct type *					\
+name##_SPLAY_FIND_NOSPLAY(struct name *head, struct type *elm)		\
+{									\
+	struct type *tmp = SPLAY_ROOT(head);				\
+	__typeof(cmp(NULL, NULL)) comp;					\
+									\
+	while (tmp != NULL) {						\
+		comp = (cmp)(elm, tmp);					\
+		if (comp == 0)						\
+			return (tmp);					\
+		tmp = comp < 0 ? SPLAY_LEFT(tmp, field) :		\
+		    SPLAY_RIGHT(tmp, field);				\
+	}								\
+	return (NULL);							\
+}									\
+									\
+/*									\
+ * Finds the node with the same key as elm, and splays it to the root	\
+ * only if it was found more than depth links below the root.		\
+ */									\
+static __unused __inline struct type *					\
+name##_SPLAY_FIND_DEPTH(struct name *head, struct type *elm, int depth)	\
+{									\
+	struct type *tmp = SPLAY_ROOT(head);				\
+	__typeof(cmp(NULL, NULL)) comp;					\
+									\
+	while (tmp != NULL) {						\
+		comp = (cmp)(elm, tmp);					\
+		if (comp == 0) {					\
+			if (depth < 0)					\
+				name##_SPLAY(head, elm);		\
+			return (tmp);					\
+		}							\
+		tmp = comp < 0 ? SPLAY_LEFT(tmp, field) :		\
+		    SPLAY_RIGHT(tmp, field);				\
+		depth--;						\
+	}								\
+	return (NULL);							\
+}									\
+									\
 static __unused __inline struct type *					\
 name##_SPLAY_NEXT(struct name *head, struct type *elm)			\
 {									\
@@ -305,6 +364,8 @@ void name##_SPLAY_MINMAX(struct name *head, int __comp) \
 #define SPLAY_INSERT(name, x, y)	name##_SPLAY_INSERT(x, y)
 #define SPLAY_REMOVE(name, x, y)	name##_SPLAY_REMOVE(x, y)
 #define SPLAY_FIND(name, x, y)		name##_SPLAY_FIND(x, y)
+#define SPLAY_FIND_NOSPLAY(name, x, y)	name##_SPLAY_FIND_NOSPLAY(x, y)
+#define SPLAY_FIND_DEPTH(name, x, y, d)	name##_SPLAY_FIND_DEPTH(x, y, d)
 #define SPLAY_NEXT(name, x, y)		name##_SPLAY_NEXT(x, y)
 #define SPLAY_MIN(name, x)		(SPLAY_EMPTY(x) ? NULL	\
 					: name##_SPLAY_MIN_MAX(x, SPLAY_NEGINF))
@@ -316,6 +377,514 @@ void name##_SPLAY_MINMAX(struct name *head, int __comp) \
 	     (x) != NULL;						\
 	     (x) = SPLAY_NEXT(name, head, x))
 
+/*
+ * In-order walks of a splay tree that do not splay.  A struct
+ * name##_SPLAY_ITER holds the nodes still to be returned on the way back
+ * up, in a stack of SPLAY_ITER_MAX nodes.  A splay tree may be deeper than
+ * that.  When the stack is full a node is dropped from it, the way a
+ * binary counter carries, so that the gaps left grow in powers of two
+ * toward the root and the newest nodes are kept.  A node that was dropped
+ * is found again, once the walk needs it, by a search down from the node
+ * kept above it.  A walk costs O(1) a node on a tree no deeper than the
+ * stack, and O(lg n) a node on a tree of any shape.  The tree must not
+ * change during a walk.
+ */
+#ifndef SPLAY_ITER_MAX
+#define SPLAY_ITER_MAX	32
+#endif
+
+#define _SPLAY_LINK(elm, dir, field)					\
+	((dir) < 0 ? SPLAY_LEFT(elm, field) : SPLAY_RIGHT(elm, field))
+
+#define SPLAY_PROTOTYPE_ITER(name, type, field, cmp)			\
+struct name##_SPLAY_ITER {						\
+	struct name *spi_head;						\
+	struct type *spi_elm; /* node last returned */			\
+	struct type *spi_stack[SPLAY_ITER_MAX];				\
+	/* If not 0, about lg of the nodes dropped above spi_stack[i] */\
+	unsigned char spi_gap[SPLAY_ITER_MAX + 1];			\
+	int spi_depth; /* nodes on the stack */				\
+	int spi_dir; /* SPLAY_NEGINF walks up, SPLAY_INF down */	\
+};									\
+struct type *name##_SPLAY_ITER_START(struct name *,			\
+    struct name##_SPLAY_ITER *, int);					\
+struct type *name##_SPLAY_ITER_NEXT(struct name##_SPLAY_ITER *);
+
+#define SPLAY_GENERATE_ITER(name, type, field, cmp)			\
+/*									\
+ * Pushes elm.  If the stack is full, first drops the oldest node with	\
+ * a gap above it no larger than the gap below it, and merges the two.	\
+ */									\
+static __unused __inline void						\
+name##_SPLAY_ITER_PUSH(struct name##_SPLAY_ITER *it, struct type *elm)	\
+{									\
+	int i;								\
+									\
+	if (it->spi_depth == SPLAY_ITER_MAX) {				\
+		for (i = 0; i < SPLAY_ITER_MAX - 1 &&			\
+		    it->spi_gap[i] > it->spi_gap[i + 1]; i++)		\
+			;						\
+		it->spi_gap[i + 1] = (it->spi_gap[i] > it->spi_gap[i + 1] ? \
+		    it->spi_gap[i] : it->spi_gap[i + 1]) + 1;		\
+		for (; i < SPLAY_ITER_MAX - 1; i++) {			\
+			it->spi_stack[i] = it->spi_stack[i + 1];	\
+			it->spi_gap[i] = it->spi_gap[i + 1];		\
+		}							\
+		it->spi_gap[i] = it->spi_gap[i + 1];			\
+		it->spi_depth--;					\
+	}								\
+	it->spi_stack[it->spi_depth++] = elm;				\
+	it->spi_gap[it->spi_depth] = 0;					\
+}									\
+									\
+/* Pops the next node of the walk, searching for it if it was dropped */ \
+static __unused __inline struct type *					\
+name##_SPLAY_ITER_POP(struct name##_SPLAY_ITER *it)			\
+{									\
+	struct type *tmp;						\
+	__typeof(cmp(NULL, NULL)) comp;					\
+									\
+	while (it->spi_gap[it->spi_depth]) {				\
+		it->spi_gap[it->spi_depth] = 0;				\
+		tmp = it->spi_depth == 0 ? SPLAY_ROOT(it->spi_head) :	\
+		    _SPLAY_LINK(it->spi_stack[it->spi_depth - 1],	\
+		    it->spi_dir, field);				\
+		while (tmp != NULL) {					\
+			comp = (cmp)(it->spi_elm, tmp);			\
+			if (comp != 0 && (comp < 0) == (it->spi_dir < 0)) { \
+				name##_SPLAY_ITER_PUSH(it, tmp);	\
+				tmp = _SPLAY_LINK(tmp, it->spi_dir, field); \
+			} else						\
+				tmp = _SPLAY_LINK(tmp, -it->spi_dir, field); \
+		}							\
+	}								\
+	if (it->spi_depth == 0)						\
+		return (it->spi_elm = NULL);				\
+	return (it->spi_elm = it->spi_stack[--it->spi_depth]);		\
+}									\
+									\
+/*									\
+ * Starts a walk of the tree, and returns its first node: the smallest	\
+ * if dir is SPLAY_NEGINF, the largest if it is SPLAY_INF.		\
+ */									\
+struct type *								\
+name##_SPLAY_ITER_START(struct name *head, struct name##_SPLAY_ITER *it, \
+    int dir)								\
+{									\
+	struct type *tmp;						\
+									\
+	it->spi_head = head;						\
+	it->spi_elm = NULL;						\
+	it->spi_depth = 0;						\
+	it->spi_gap[0] = 0;						\
+	it->spi_dir = dir;						\
+	for (tmp = SPLAY_ROOT(head); tmp != NULL;			\
+	    tmp = _SPLAY_LINK(tmp, dir, field))				\
+		name##_SPLAY_ITER_PUSH(it, tmp);			\
+	return (name##_SPLAY_ITER_POP(it));				\
+}									\
+									\
+/* Returns the node after the one last returned */			\
+struct type *								\
+name##_SPLAY_ITER_NEXT(struct name##_SPLAY_ITER *it)			\
+{									\
+	struct type *tmp;						\
+									\
+	for (tmp = _SPLAY_LINK(it->spi_elm, -it->spi_dir, field);	\
+	    tmp != NULL; tmp = _SPLAY_LINK(tmp, it->spi_dir, field))	\
+		name##_SPLAY_ITER_PUSH(it, tmp);			\
+	return (name##_SPLAY_ITER_POP(it));				\
+}
+
+#define SPLAY_ITER(name)		struct name##_SPLAY_ITER
+#define SPLAY_ITER_FIRST(name, x, it)					\
+	name##_SPLAY_ITER_START(x, it, SPLAY_NEGINF)
+#define SPLAY_ITER_LAST(name, x, it)					\
+	name##_SPLAY_ITER_START(x, it, SPLAY_INF)
+#define SPLAY_ITER_NEXT(name, it)	name##_SPLAY_ITER_NEXT(it)
+
+#define SPLAY_FOREACH_ITER(x, name, head, it)				\
+	for ((x) = SPLAY_ITER_FIRST(name, head, it);			\
+	     (x) != NULL;						\
+	     (x) = name##_SPLAY_ITER_NEXT(it))
+
+#define SPLAY_FOREACH_REVERSE_ITER(x, name, head, it)			\
+	for ((x) = SPLAY_ITER_LAST(name, head, it);			\
+	     (x) != NULL;						\
+	     (x) = name##_SPLAY_ITER_NEXT(it))
+
+/*
+ * Parent-linked splay trees.  A node declared with SPLAY_ENTRY_PARENT
+ * also links to its parent, so a node already in hand is splayed to the
+ * root from below, with no calls to cmp.  SPLAY_REMOVE then removes the
+ * node it is given, which must be in the tree, without searching for its
+ * key, and SPLAY_NEXT and SPLAY_PREV step from a node in O(1) amortized
+ * time without splaying.  SPLAY_INSERT, SPLAY_FIND, SPLAY_MIN and
+ * SPLAY_MAX splay as they do on other splay trees.
+ */
+#define SPLAY_ENTRY_PARENT(type)					\
+struct {								\
+	struct type *spe_left; /* left element */			\
+	struct type *spe_right; /* right element */			\
+	struct type *spe_parent; /* parent element */			\
+}
+
+#define SPLAY_PARENT(elm, field)	(elm)->field.spe_parent
+
+#define SPLAY_PROTOTYPE_PARENT(name, type, field, cmp)			\
+void name##_SPLAY_UP(struct name *, struct type *);			\
+struct type *name##_SPLAY_INSERT(struct name *, struct type *);		\
+struct type *name##_SPLAY_REMOVE(struct name *, struct type *);		\
+struct type *name##_SPLAY_FIND(struct name *, struct type *);		\
+struct type *name##_SPLAY_NEXT(struct name *, struct type *);		\
+struct type *name##_SPLAY_PREV(struct name *, struct type *);		\
+struct type *name##_SPLAY_MIN_MAX(struct name *, int);
+
+#define SPLAY_GENERATE_PARENT(name, type, field, cmp)			\
+/* Rotates elm above its parent */					\
+static __unused __inline void						\
+name##_SPLAY_ROTATE_UP(struct name *head, struct type *elm)		\
+{									\
+	struct type *parent = SPLAY_PARENT(elm, field);			\
+	struct type *gpar = SPLAY_PARENT(parent, field);		\
+	struct type *child;						\
+									\
+	if (SPLAY_LEFT(parent, field) == elm) {				\
+		child = SPLAY_LEFT(parent, field) = SPLAY_RIGHT(elm, field); \
+		SPLAY_RIGHT(elm, field) = parent;			\
+	} else {							\
+		child = SPLAY_RIGHT(parent, field) = SPLAY_LEFT(elm, field); \
+		SPLAY_LEFT(elm, field) = parent;			\
+	}								\
+	if (child != NULL)						\
+		SPLAY_PARENT(child, field) = parent;			\
+	SPLAY_PARENT(parent, field) = elm;				\
+	SPLAY_PARENT(elm, field) = gpar;				\
+	if (gpar == NULL)						\
+		SPLAY_ROOT(head) = elm;					\
+	else if (SPLAY_LEFT(gpar, field) == parent)			\
+		SPLAY_LEFT(gpar, field) = elm;				\
+	else								\
+		SPLAY_RIGHT(gpar, field) = elm;				\
+}									\
+									\
+/* Splays elm, which is in the tree, to the root from below */		\
+void									\
+name##_SPLAY_UP(struct name *head, struct type *elm)			\
+{									\
+	struct type *parent, *gpar;					\
+									\
+	while ((parent = SPLAY_PARENT(elm, field)) != NULL) {		\
+		gpar = SPLAY_PARENT(parent, field);			\
+		if (gpar != NULL) {					\
+			if ((SPLAY_LEFT(parent, field) == elm) ==	\
+			    (SPLAY_LEFT(gpar, field) == parent))	\
+				name##_SPLAY_ROTATE_UP(head, parent);	\
+			else						\
+				name##_SPLAY_ROTATE_UP(head, elm);	\
+		}							\
+		name##_SPLAY_ROTATE_UP(head, elm);			\
+	}								\
+}									\
+									\
+/* Inserts elm and splays it, or splays the node with its key */	\
+struct type *								\
+name##_SPLAY_INSERT(struct name *head, struct type *elm)		\
+{									\
+	struct type *parent = NULL, *tmp = SPLAY_ROOT(head);		\
+	__typeof(cmp(NULL, NULL)) comp = 0;				\
+									\
+	while (tmp != NULL) {						\
+		parent = tmp;						\
+		comp = (cmp)(elm, tmp);					\
+		if (comp == 0) {					\
+			name##_SPLAY_UP(head, tmp);			\
+			return (tmp);					\
+		}							\
+		tmp = comp < 0 ? SPLAY_LEFT(tmp, field) :		\
+		    SPLAY_RIGHT(tmp, field);				\
+	}								\
+	SPLAY_LEFT(elm, field) = SPLAY_RIGHT(elm, field) = NULL;	\
+	SPLAY_PARENT(elm, field) = parent;				\
+	if (parent == NULL)						\
+		SPLAY_ROOT(head) = elm;					\
+	else if (comp < 0)						\
+		SPLAY_LEFT(parent, field) = elm;			\
+	else								\
+		SPLAY_RIGHT(parent, field) = elm;			\
+	name##_SPLAY_UP(head, elm);					\
+	return (NULL);							\
+}									\
+									\
+/* Removes elm, which is in the tree */					\
+struct type *								\
+name##_SPLAY_REMOVE(struct name *head, struct type *elm)		\
+{									\
+	struct type *left, *right, *tmp;				\
+									\
+	name##_SPLAY_UP(head, elm);					\
+	left = SPLAY_LEFT(elm, field);					\
+	right = SPLAY_RIGHT(elm, field);				\
+	if (left == NULL) {						\
+		SPLAY_ROOT(head) = right;				\
+		if (right != NULL)					\
+			SPLAY_PARENT(right, field) = NULL;		\
+		return (elm);						\
+	}								\
+	/* Splay the largest node on the left up to take its place */	\
+	SPLAY_ROOT(head) = left;					\
+	SPLAY_PARENT(left, field) = NULL;				\
+	for (tmp = left; SPLAY_RIGHT(tmp, field) != NULL;		\
+	    tmp = SPLAY_RIGHT(tmp, field))				\
+		;							\
+	name##_SPLAY_UP(head, tmp);					\
+	SPLAY_RIGHT(tmp, field) = right;				\
+	if (right != NULL)						\
+		SPLAY_PARENT(right, field) = tmp;			\
+	return (elm);							\
+}									\
+									\
+/* Finds the node with the same key as elm, splaying the last node seen */ \
+struct type *								\
+name##_SPLAY_FIND(struct name *head, struct type *elm)			\
+{									\
+	struct type *parent = NULL, *tmp = SPLAY_ROOT(head);		\
+	__typeof(cmp(NULL, NULL)) comp;					\
+									\
+	while (tmp != NULL) {						\
+		parent = tmp;						\
+		comp = (cmp)(elm, tmp);					\
+		if (comp == 0)						\
+			break;						\
+		tmp = comp < 0 ? SPLAY_LEFT(tmp, field) :		\
+		    SPLAY_RIGHT(tmp, field);				\
+	}								\
+	if (parent != NULL)						\
+		name##_SPLAY_UP(head, parent);				\
+	return (tmp);							\
+}									\
+									\
+/* Returns the node after elm, without splaying */			\
+struct type *								\
+name##_SPLAY_NEXT(struct name *head __unused, struct type *elm)		\
+{									\
+	struct type *tmp;						\
+									\
+	if ((tmp = SPLAY_RIGHT(elm, field)) != NULL) {			\
+		while (SPLAY_LEFT(tmp, field) != NULL)			\
+			tmp = SPLAY_LEFT(tmp, field);			\
+		return (tmp);						\
+	}								\
+	while ((tmp = SPLAY_PARENT(elm, field)) != NULL &&		\
+	    SPLAY_RIGHT(tmp, field) == elm)				\
+		elm = tmp;						\
+	return (tmp);							\
+}									\
+									\
+/* Returns the node before elm, without splaying */			\
+struct type *								\
+name##_SPLAY_PREV(struct name *head __unused, struct type *elm)		\
+{									\
+	struct type *tmp;						\
+									\
+	if ((tmp = SPLAY_LEFT(elm, field)) != NULL) {			\
+		while (SPLAY_RIGHT(tmp, field) != NULL)			\
+			tmp = SPLAY_RIGHT(tmp, field);			\
+		return (tmp);						\
+	}								\
+	while ((tmp = SPLAY_PARENT(elm, field)) != NULL &&		\
+	    SPLAY_LEFT(tmp, field) == elm)				\
+		elm = tmp;						\
+	return (tmp);							\
+}									\
+									\
+/* Splays the smallest node, if val is SPLAY_NEGINF, or the largest */	\
+struct type *								\
+name##_SPLAY_MIN_MAX(struct name *head, int val)			\
+{									\
+	struct type *tmp = SPLAY_ROOT(head);				\
+									\
+	while (_SPLAY_LINK(tmp, val, field) != NULL)			\
+		tmp = _SPLAY_LINK(tmp, val, field);			\
+	name##_SPLAY_UP(head, tmp);					\
+	return (tmp);							\
+}
+
+#define SPLAY_UP(name, x, y)		name##_SPLAY_UP(x, y)
+#define SPLAY_PREV(name, x, y)		name##_SPLAY_PREV(x, y)
+
+#define SPLAY_FOREACH_REVERSE(x, name, head)				\
+	for ((x) = SPLAY_MAX(name, head);				\
+	     (x) != NULL;						\
+	     (x) = SPLAY_PREV(name, head, x))
+
+/*
+ * Weighted rebuilds.  Lookups that count how often each node is found let
+ * a tree be rebuilt, in O(n) time and with no calls to cmp, into the shape
+ * that suits those counts: each subtree is rooted at the node where the
+ * weight of its nodes, one more than their counts, splits in half
+ * (Mehlhorn's approximation of the optimal search tree).  A node of
+ * weight w in a tree of total weight W then lies at most lg (W / w) links
+ * below the root.  Counts are kept in the unsigned integer field cfield
+ * of each node, which must hold the sum of all counts plus the number of
+ * nodes, and the rebuild sets them to zero.
+ */
+#define _WEIGHT_GENERATE(name, kind, type, field, cfield, link)		\
+/*									\
+ * Returns the index in [lo, hi) of the root for elms[lo..hi), whose	\
+ * cfield holds running sums of weight.  It searches from both ends at	\
+ * once, in steps that double, so that the whole build takes O(n) time.	\
+ */									\
+static __unused __inline size_t						\
+name##kind##_WEIGHT_SPLIT(struct type **elms, size_t lo, size_t hi)	\
+{									\
+	_RB_FIELD_TYPE(type, cfield) base, total, sum;			\
+	size_t k, a, b, mid;						\
+									\
+	base = lo > 0 ? elms[lo - 1]->cfield : 0;			\
+	total = elms[hi - 1]->cfield - base;				\
+	/* Find the first index whose running sum reaches half the total */ \
+	for (k = 1;; k *= 2) {						\
+		if (k >= hi - lo) {					\
+			a = lo + k / 2;					\
+			b = hi - 1;					\
+			break;						\
+		}							\
+		sum = elms[lo + k - 1]->cfield - base;			\
+		if (sum >= total - sum) {				\
+			a = lo + k / 2;					\
+			b = lo + k - 1;					\
+			break;						\
+		}							\
+		sum = elms[hi - 1 - k]->cfield - base;			\
+		if (sum < total - sum) {				\
+			a = hi - k;					\
+			b = hi - 1 - k / 2;				\
+			break;						\
+		}							\
+	}								\
+	while (a < b) {							\
+		mid = a + (b - a) / 2;					\
+		sum = elms[mid]->cfield - base;				\
+		if (sum >= total - sum)					\
+			b = mid;					\
+		else							\
+			a = mid + 1;					\
+	}								\
+	return (a);							\
+}									\
+									\
+/* Links elms[lo..hi) into a tree by weight, and returns its root */	\
+static __unused __inline struct type *					\
+name##kind##_WEIGHT_BUILD(struct type **elms, size_t lo, size_t hi)	\
+{									\
+	struct type *left, *right;					\
+	size_t root;							\
+									\
+	if (lo == hi)							\
+		return (NULL);						\
+	root = name##kind##_WEIGHT_SPLIT(elms, lo, hi);			\
+	left = name##kind##_WEIGHT_BUILD(elms, lo, root);		\
+	right = name##kind##_WEIGHT_BUILD(elms, root + 1, hi);		\
+	link(name, elms[root], left, right, field);			\
+	return (elms[root]);						\
+}									\
+									\
+/* Rebuilds the n nodes of elms, in increasing order, by their counts */ \
+static __unused __inline struct type *					\
+name##kind##_WEIGHT_REBUILD(struct type **elms, size_t n)		\
+{									\
+	_RB_FIELD_TYPE(type, cfield) sum = 0;				\
+	struct type *root;						\
+	size_t i;							\
+									\
+	for (i = 0; i < n; i++) {					\
+		sum += elms[i]->cfield + 1;				\
+		elms[i]->cfield = sum;					\
+	}								\
+	root = name##kind##_WEIGHT_BUILD(elms, 0, n);			\
+	for (i = 0; i < n; i++)						\
+		elms[i]->cfield = 0;					\
+	return (root);							\
+}
+
+#define _SPLAY_WEIGHT_LINK(name, elm, left, right, field) do {		\
+	SPLAY_LEFT(elm, field) = (left);				\
+	SPLAY_RIGHT(elm, field) = (right);				\
+} while (/*CONSTCOND*/ 0)
+
+/*
+ * A splay tree rebuilt by weight is a splay tree like any other, so it may
+ * still be changed, but lookups with SPLAY_FIND_NOSPLAY keep its shape.
+ * The nodes must be declared with SPLAY_ENTRY, not SPLAY_ENTRY_PARENT.
+ * SPLAY_REBUILD walks the tree without a stack, by threading it for the
+ * time of the walk, as the nodes of a splay tree have no parent links.
+ */
+#define SPLAY_PROTOTYPE_WEIGHT(name, type, field, cmp, cfield)		\
+struct type *name##_SPLAY_FIND_COUNT(struct name *, struct type *);	\
+size_t name##_SPLAY_REBUILD(struct name *, struct type **, size_t);
+
+#define SPLAY_GENERATE_WEIGHT(name, type, field, cmp, cfield)		\
+_WEIGHT_GENERATE(name, _SPLAY, type, field, cfield, _SPLAY_WEIGHT_LINK)	\
+									\
+/* Finds the node with the same key as elm, and counts it */		\
+struct type *								\
+name##_SPLAY_FIND_COUNT(struct name *head, struct type *elm)		\
+{									\
+	struct type *tmp = SPLAY_ROOT(head);				\
+	__typeof(cmp(NULL, NULL)) comp;					\
+									\
+	while (tmp != NULL) {						\
+		comp = (cmp)(elm, tmp);					\
+		if (comp == 0) {					\
+			tmp->cfield++;					\
+			break;						\
+		}							\
+		tmp = comp < 0 ? SPLAY_LEFT(tmp, field) :		\
+		    SPLAY_RIGHT(tmp, field);				\
+	}								\
+	return (tmp);							\
+}									\
+									\
+/*									\
+ * Stores the nodes of the tree in elms, in increasing order, and	\
+ * rebuilds it by weight, if it has no more than n nodes.  Returns the	\
+ * number of nodes.							\
+ */									\
+size_t									\
+name##_SPLAY_REBUILD(struct name *head, struct type **elms, size_t n)	\
+{									\
+	struct type *elm = SPLAY_ROOT(head), *tmp;			\
+	size_t count = 0;						\
+									\
+	while (elm != NULL) {						\
+		tmp = SPLAY_LEFT(elm, field);				\
+		if (tmp != NULL) {					\
+			while (SPLAY_RIGHT(tmp, field) != NULL &&	\
+			    SPLAY_RIGHT(tmp, field) != elm)		\
+				tmp = SPLAY_RIGHT(tmp, field);		\
+			if (SPLAY_RIGHT(tmp, field) == NULL) {		\
+				/* Thread back to elm, and go left */	\
+				SPLAY_RIGHT(tmp, field) = elm;		\
+				elm = SPLAY_LEFT(elm, field);		\
+				continue;				\
+			}						\
+			SPLAY_RIGHT(tmp, field) = NULL;			\
+		}							\
+		if (count < n)						\
+			elms[count] = elm;				\
+		count++;						\
+		elm = SPLAY_RIGHT(elm, field);				\
+	}								\
+	if (count <= n)							\
+		SPLAY_ROOT(head) = name##_SPLAY_WEIGHT_REBUILD(elms,	\
+		    count);						\
+	return (count);							\
+}
+
+#define SPLAY_FIND_COUNT(name, x, y)	name##_SPLAY_FIND_COUNT(x, y)
+#define SPLAY_REBUILD(name, x, elms, n)	name##_SPLAY_REBUILD(x, elms, n)
+
 /* Macros that define a rank-balanced tree */
 #define RB_HEAD(name, type)						\
 struct name {								\
@@ -325,6 +894,17 @@ struct name {								\
 #define RB_INITIALIZER(root)						\
 	{ NULL }
 
+/*
+ * A head that also keeps the least and greatest nodes, for trees generated
+ * with RB_GENERATE_CACHED.  RB_INITIALIZER and RB_INIT apply to it.
+ */
+#define RB_HEAD_CACHED(name, type)					\
+struct name {								\
+	struct type *rbh_root; /* root of the tree */			\
+	struct type *rbh_min; /* least node, if rbh_root is not NULL */	\
+	struct type *rbh_max; /* greatest node, likewise */		\
+}
+
 #define RB_INIT(root) do {						\
 	(root)->rbh_root = NULL;					\
 } while (/*CONSTCOND*/ 0)
@@ -334,6 +914,28 @@ struct {								\
 	struct type *rbe_link[3];					\
 }
 
+/* An RB_ENTRY with a cached key prefix, for RB_GENERATE_PREFIX */
+#define RB_ENTRY_PREFIX(type)						\
+struct {								\
+	struct type *rbe_link[3];					\
+	uint64_t rbe_prefix;						\
+}
+
+/*
+ * The first 8 bytes of a string, in an integer that orders strings as
+ * strcmp does wherever two prefixes differ.
+ */
+static __unused __inline uint64_t
+rb_string_prefix(const char *s)
+{
+	uint64_t prefix = 0;
+	int i;
+
+	for (i = 0; i < 8 && s[i] != '\0'; i++)
+		prefix |= (uint64_t)(unsigned char)s[i] << (56 - 8 * i);
+	return (prefix);
+}
+
 /*
  * With the expectation that any object of struct type has an
  * address that is a multiple of 4, and that therefore the
@@ -346,7 +948,7 @@ struct {								\
 #define _RB_L				((__uintptr_t)1)
 #define _RB_R				((__uintptr_t)2)
 #define _RB_LR				((__uintptr_t)3)
-#define _RB_BITS(elm)			(*(__uintptr_t *)&elm)
+#define _RB_BITS(elm)			(*(__rb_bits_t *)&elm)
 #define _RB_BITSUP(elm, field)		_RB_BITS(_RB_UP(elm, field))
 #define _RB_PTR(elm)			(__typeof(elm))			\
 					((__uintptr_t)elm & ~_RB_LR)
@@ -357,6 +959,26 @@ struct {								\
 #define RB_ROOT(head)			(head)->rbh_root
 #define RB_EMPTY(head)			(RB_ROOT(head) == NULL)
 
+/*
+ * With RB_PREFETCH defined, a search fetches both children of a node
+ * while it compares against the node, and RB_NEXT and RB_PREV fetch the
+ * subtree the following step will descend into, so that RB_FOREACH
+ * overlaps its misses with the loop body.
+ */
+#ifdef RB_PREFETCH
+#define _RB_PREFETCH_CHILDREN(elm, field) do {				\
+	_RB_PREFETCH(RB_LEFT(elm, field));				\
+	_RB_PREFETCH(RB_RIGHT(elm, field));				\
+} while (/*CONSTCOND*/ 0)
+#define _RB_PREFETCH_STEP(elm, dir, field) do {				\
+	if ((elm) != NULL)						\
+		_RB_PREFETCH(_RB_LINK(elm, dir, field));		\
+} while (/*CONSTCOND*/ 0)
+#else
+#define _RB_PREFETCH_CHILDREN(elm, field) do {} while (0)
+#define _RB_PREFETCH_STEP(elm, dir, field) do {} while (0)
+#endif
+
 #define RB_SET_PARENT(dst, src, field) do {				\
 	_RB_BITSUP(dst, field) = (__uintptr_t)src |			\
 	    (_RB_BITSUP(dst, field) & _RB_LR);				\
@@ -389,6 +1011,23 @@ struct {								\
 		;							\
 } while (0)
 
+/*
+ * The generated functions do not invoke RB_AUGMENT_CHECK directly, but through
+ * name##_RB_AUGMENT_CHECK, which each RB_GENERATE variant defines.  For
+ * RB_GENERATE, that forwards to RB_AUGMENT_CHECK.  For RB_GENERATE_AUGMENT, it
+ * forwards to a function supplied for that one tree, so that differently
+ * augmented trees can be generated in the same file.  RB_UPDATE_AUGMENT_NAME
+ * is RB_UPDATE_AUGMENT for such trees.
+ */
+#define _RB_AUGMENT_CHECK(name, x)	name##_RB_AUGMENT_CHECK(x)
+
+#define RB_UPDATE_AUGMENT_NAME(name, elm, field) do {			\
+	__typeof(elm) rb_update_tmp = (elm);				\
+	while (_RB_AUGMENT_CHECK(name, rb_update_tmp) &&		\
+	    (rb_update_tmp = RB_PARENT(rb_update_tmp, field)) != NULL)	\
+		;							\
+} while (0)
+
 #define RB_SWAP_CHILD(head, par, out, in, field) do {			\
 	if (par == NULL)						\
 		RB_ROOT(head) = (in);					\
@@ -452,13 +1091,15 @@ struct {								\
 	attr struct type *name##_RB_REMOVE(struct name *, struct type *)
 #define RB_PROTOTYPE_INSERT_FINISH(name, type, attr)			\
 	attr struct type *name##_RB_INSERT_FINISH(struct name *,	\
-	    struct type *, struct type **, struct type *)
+	    struct type *, struct type *volatile *, struct type *)
 #define RB_PROTOTYPE_INSERT(name, type, attr)				\
 	attr struct type *name##_RB_INSERT(struct name *, struct type *)
 #define RB_PROTOTYPE_FIND(name, type, attr)				\
 	attr struct type *name##_RB_FIND(struct name *, struct type *)
 #define RB_PROTOTYPE_NFIND(name, type, attr)				\
 	attr struct type *name##_RB_NFIND(struct name *, struct type *)
+#define RB_PROTOTYPE_PFIND(name, type, attr)				\
+	attr struct type *name##_RB_PFIND(struct name *, struct type *)
 #define RB_PROTOTYPE_NEXT(name, type, attr)				\
 	attr struct type *name##_RB_NEXT(struct type *)
 #define RB_PROTOTYPE_INSERT_NEXT(name, type, attr)			\
@@ -482,27 +1123,248 @@ struct {								\
 #define	RB_GENERATE_STATIC(name, type, field, cmp)			\
 	RB_GENERATE_INTERNAL(name, type, field, cmp, __unused static)
 #define RB_GENERATE_INTERNAL(name, type, field, cmp, attr)		\
-	RB_GENERATE_RANK(name, type, field, attr)			\
-	RB_GENERATE_INSERT_COLOR(name, type, field, attr)		\
-	RB_GENERATE_REMOVE_COLOR(name, type, field, attr)		\
-	RB_GENERATE_INSERT_FINISH(name, type, field, attr)		\
-	RB_GENERATE_INSERT(name, type, field, cmp, attr)		\
-	RB_GENERATE_REMOVE(name, type, field, attr)			\
-	RB_GENERATE_FIND(name, type, field, cmp, attr)			\
-	RB_GENERATE_NFIND(name, type, field, cmp, attr)			\
-	RB_GENERATE_NEXT(name, type, field, attr)			\
-	RB_GENERATE_INSERT_NEXT(name, type, field, cmp, attr)		\
-	RB_GENERATE_PREV(name, type, field, attr)			\
-	RB_GENERATE_INSERT_PREV(name, type, field, cmp, attr)		\
-	RB_GENERATE_MINMAX(name, type, field, attr)			\
-	RB_GENERATE_REINSERT(name, type, field, cmp, attr)
+	_RB_GENERATE_AUGMENT_CHECK(name, type,				\
+	    _RB_AUGMENT_DEFAULT, 0, _RB_AUGMENT_VERIFY)			\
+	_RB_GENERATE_PREPARE(name, type, _RB_PREPARE_NONE)		\
+	_RB_GENERATE_CACHE_NONE(name, type)				\
+	_RB_GENERATE_FUNCTIONS(name, type, field, cmp, attr)
 
-#ifdef _RB_DIAGNOSTIC
-#ifndef RB_AUGMENT
-#define _RB_AUGMENT_VERIFY(x) RB_AUGMENT_CHECK(x)
-#else
-#define _RB_AUGMENT_VERIFY(x) 0
-#endif
+/*
+ * Like RB_GENERATE, but with augment, a function taking a struct type * and
+ * returning an int, in place of RB_AUGMENT for this one tree.  As with
+ * RB_AUGMENT, updates always continue up to the root.  With _RB_DIAGNOSTIC,
+ * name##_RB_RANK reports a node for which augment returns true as having
+ * inconsistent augmentation data, so augment should return true only when it
+ * changes the node data, as RB_AUGMENT_CHECK does.
+ */
+#define	RB_GENERATE_AUGMENT(name, type, field, cmp, augment)		\
+	RB_GENERATE_AUGMENT_INTERNAL(name, type, field, cmp, augment,)
+#define	RB_GENERATE_AUGMENT_STATIC(name, type, field, cmp, augment)	\
+	RB_GENERATE_AUGMENT_INTERNAL(name, type, field, cmp, augment,	\
+	    __unused static)
+#define RB_GENERATE_AUGMENT_INTERNAL(name, type, field, cmp, augment, attr) \
+	_RB_GENERATE_AUGMENT_CHECK(name, type, augment, 1, augment)	\
+	_RB_GENERATE_PREPARE(name, type, _RB_PREPARE_NONE)		\
+	_RB_GENERATE_CACHE_NONE(name, type)				\
+	_RB_GENERATE_FUNCTIONS(name, type, field, cmp, attr)
+
+/*
+ * Like RB_GENERATE, for a tree whose entries are declared with
+ * RB_ENTRY_PREFIX.  Each node caches prefix(elm), a 64-bit summary of its
+ * key that orders nodes the same way cmp does wherever two summaries
+ * differ, such as the first 8 bytes of a string from rb_string_prefix.  The
+ * tree compares the cached summaries, which share a cache line with the
+ * links, and calls cmp only when they are equal, sparing a load of the key
+ * at most levels of a descent.  The search key passed to RB_FIND or
+ * RB_NFIND needs no prefix set; those two store it in the key on entry.
+ * Other searches, such as RB_PFIND, compare with cmp alone.  A node gets
+ * its prefix whenever it enters the tree: by an insert, RB_REINSERT,
+ * RB_BUILD_SORTED or as the pivot of RB_JOIN.  RB_SPLIT and the set
+ * operations only move nodes that already have theirs.
+ */
+#define	RB_GENERATE_PREFIX(name, type, field, cmp, prefix)		\
+	RB_GENERATE_PREFIX_INTERNAL(name, type, field, cmp, prefix,)
+#define	RB_GENERATE_PREFIX_STATIC(name, type, field, cmp, prefix)	\
+	RB_GENERATE_PREFIX_INTERNAL(name, type, field, cmp, prefix,	\
+	    __unused static)
+#define RB_GENERATE_PREFIX_INTERNAL(name, type, field, cmp, prefix, attr) \
+static __unused __inline void						\
+name##_RB_SET_PREFIX(struct type *elm)					\
+{									\
+	(elm)->field.rbe_prefix = prefix(elm);				\
+}									\
+									\
+static __unused __inline int						\
+name##_RB_PREFIX_CMP(struct type *a, struct type *b)			\
+{									\
+	if (a->field.rbe_prefix != b->field.rbe_prefix)			\
+		return (a->field.rbe_prefix < b->field.rbe_prefix ? -1 : 1); \
+	return (cmp(a, b));						\
+}									\
+	_RB_GENERATE_AUGMENT_CHECK(name, type,				\
+	    _RB_AUGMENT_DEFAULT, 0, _RB_AUGMENT_VERIFY)			\
+	_RB_GENERATE_PREPARE(name, type, name##_RB_SET_PREFIX)		\
+	_RB_GENERATE_CACHE_NONE(name, type)				\
+	_RB_GENERATE_UPDATES(name, type, field, name##_RB_PREFIX_CMP, attr) \
+	_RB_GENERATE_FIND(name, name##_RB_PREFIX_FIND, type, field,	\
+	    name##_RB_PREFIX_CMP, static __unused __inline)		\
+	_RB_GENERATE_NFIND(name, name##_RB_PREFIX_NFIND, type, field,	\
+	    name##_RB_PREFIX_CMP, static __unused __inline)		\
+									\
+/* Finds the node with the same key as elm, after setting its prefix */	\
+attr struct type *							\
+name##_RB_FIND(struct name *head, struct type *elm)			\
+{									\
+	name##_RB_PREPARE(elm);						\
+	return (name##_RB_PREFIX_FIND(head, elm));			\
+}									\
+									\
+/* Finds the first node not less than elm, after setting its prefix */	\
+attr struct type *							\
+name##_RB_NFIND(struct name *head, struct type *elm)			\
+{									\
+	name##_RB_PREPARE(elm);						\
+	return (name##_RB_PREFIX_NFIND(head, elm));			\
+}
+
+/*
+ * Like RB_GENERATE, for a tree whose head is declared with RB_HEAD_CACHED.
+ * Inserts and removes keep the least and greatest nodes in the head, so
+ * RB_MIN and RB_MAX take constant time, and removing the least node, as a
+ * priority queue does, costs a walk to its successor and the rebalancing,
+ * which is amortized constant.
+ */
+#define	RB_GENERATE_CACHED(name, type, field, cmp)			\
+	RB_GENERATE_CACHED_INTERNAL(name, type, field, cmp,)
+#define	RB_GENERATE_CACHED_STATIC(name, type, field, cmp)		\
+	RB_GENERATE_CACHED_INTERNAL(name, type, field, cmp, __unused static)
+#define RB_GENERATE_CACHED_INTERNAL(name, type, field, cmp, attr)	\
+	_RB_GENERATE_AUGMENT_CHECK(name, type,				\
+	    _RB_AUGMENT_DEFAULT, 0, _RB_AUGMENT_VERIFY)			\
+	_RB_GENERATE_PREPARE(name, type, _RB_PREPARE_NONE)		\
+	_RB_GENERATE_CACHE(name, type, field)				\
+	_RB_GENERATE_FUNCTIONS(name, type, field, cmp, attr)
+
+#define _RB_GENERATE_FUNCTIONS(name, type, field, cmp, attr)		\
+	_RB_GENERATE_UPDATES(name, type, field, cmp, attr)		\
+	RB_GENERATE_FIND(name, type, field, cmp, attr)			\
+	RB_GENERATE_NFIND(name, type, field, cmp, attr)
+
+/* All but the searches, which RB_GENERATE_PREFIX wraps */
+#define _RB_GENERATE_UPDATES(name, type, field, cmp, attr)		\
+	RB_GENERATE_RANK(name, type, field, attr)			\
+	RB_GENERATE_INSERT_COLOR(name, type, field, attr)		\
+	RB_GENERATE_REMOVE_COLOR(name, type, field, attr)		\
+	RB_GENERATE_INSERT_FINISH(name, type, field, attr)		\
+	RB_GENERATE_INSERT(name, type, field, cmp, attr)		\
+	RB_GENERATE_REMOVE(name, type, field, attr)			\
+	RB_GENERATE_NEXT(name, type, field, attr)			\
+	RB_GENERATE_INSERT_NEXT(name, type, field, cmp, attr)		\
+	RB_GENERATE_PREV(name, type, field, attr)			\
+	RB_GENERATE_INSERT_PREV(name, type, field, cmp, attr)		\
+	RB_GENERATE_MINMAX(name, type, field, attr)			\
+	RB_GENERATE_REINSERT(name, type, field, cmp, attr)
+
+#define _RB_AUGMENT_DEFAULT(x) RB_AUGMENT_CHECK(x)
+
+/*
+ * Every tree has a hook, name##_RB_PREPARE, run on a node about to be
+ * inserted before it is compared with any other, and on each node that
+ * RB_BUILD_SORTED links in and the pivot of RB_JOIN.  Searches do not run
+ * it, with one exception: the RB_FIND and RB_NFIND of a prefix tree write
+ * the search key, by setting its prefix.  All other trees, and all other
+ * searches, leave the key alone.
+ */
+#define _RB_PREPARE_NONE(elm)	((void)(elm))
+
+#define _RB_GENERATE_PREPARE(name, type, prepare)			\
+static __unused __inline void						\
+name##_RB_PREPARE(struct type *elm)					\
+{									\
+	prepare(elm);							\
+}
+
+/*
+ * The hooks by which a cached head is kept: name##_RB_CACHE_INSERT runs on
+ * a new leaf before rebalancing, name##_RB_CACHE_REMOVE on a node about to
+ * be removed, and name##_RB_CACHE_RESET after a generated function sets the
+ * root outright.  name##_RB_CACHE_GET returns the cached least (val < 0) or
+ * greatest node of a tree that is not empty, or NULL if none is cached.
+ */
+#define _RB_GENERATE_CACHE_NONE(name, type)				\
+static __unused __inline void						\
+name##_RB_CACHE_INSERT(struct name *head, struct type *elm)		\
+{									\
+	(void)head;							\
+	(void)elm;							\
+}									\
+									\
+static __unused __inline void						\
+name##_RB_CACHE_REMOVE(struct name *head, struct type *elm)		\
+{									\
+	(void)head;							\
+	(void)elm;							\
+}									\
+									\
+static __unused __inline void						\
+name##_RB_CACHE_RESET(struct name *head)				\
+{									\
+	(void)head;							\
+}									\
+									\
+static __unused __inline struct type *					\
+name##_RB_CACHE_GET(struct name *head, int val)				\
+{									\
+	(void)head;							\
+	(void)val;							\
+	return (NULL);							\
+}
+
+#define _RB_GENERATE_CACHE(name, type, field)				\
+static __unused __inline void						\
+name##_RB_CACHE_INSERT(struct name *head, struct type *elm)		\
+{									\
+	struct type *parent = RB_PARENT(elm, field);			\
+									\
+	if (parent == NULL)						\
+		head->rbh_min = head->rbh_max = elm;			\
+	else if (parent == head->rbh_min && RB_LEFT(parent, field) == elm) \
+		head->rbh_min = elm;					\
+	else if (parent == head->rbh_max && RB_RIGHT(parent, field) == elm) \
+		head->rbh_max = elm;					\
+}									\
+									\
+static __unused __inline void						\
+name##_RB_CACHE_REMOVE(struct name *head, struct type *elm)		\
+{									\
+	if (elm == head->rbh_min)					\
+		head->rbh_min = name##_RB_NEXT(elm);			\
+	if (elm == head->rbh_max)					\
+		head->rbh_max = name##_RB_PREV(elm);			\
+}									\
+									\
+static __unused __inline void						\
+name##_RB_CACHE_RESET(struct name *head)				\
+{									\
+	struct type *tmp;						\
+									\
+	head->rbh_min = head->rbh_max = tmp = RB_ROOT(head);		\
+	while (tmp != NULL) {						\
+		head->rbh_min = tmp;					\
+		tmp = RB_LEFT(tmp, field);				\
+	}								\
+	for (tmp = RB_ROOT(head); tmp != NULL; tmp = RB_RIGHT(tmp, field)) \
+		head->rbh_max = tmp;					\
+}									\
+									\
+static __unused __inline struct type *					\
+name##_RB_CACHE_GET(struct name *head, int val)				\
+{									\
+	return (val < 0 ? head->rbh_min : head->rbh_max);		\
+}
+
+#define _RB_GENERATE_AUGMENT_CHECK(name, type, check, always, verify)	\
+static __unused __inline int						\
+name##_RB_AUGMENT_CHECK(struct type *elm)				\
+{									\
+	(void)elm;							\
+	return (check(elm) || always);					\
+}									\
+_RB_GENERATE_AUGMENT_VERIFY(name, type, verify)
+
+#ifdef _RB_DIAGNOSTIC
+#ifndef RB_AUGMENT
+#define _RB_AUGMENT_VERIFY(x) RB_AUGMENT_CHECK(x)
+#else
+#define _RB_AUGMENT_VERIFY(x) 0
+#endif
+#define _RB_GENERATE_AUGMENT_VERIFY(name, type, verify)			\
+static __unused __inline int						\
+name##_RB_AUGMENT_VERIFY(struct type *elm)				\
+{									\
+	(void)elm;							\
+	return (verify(elm));						\
+}
 #define RB_GENERATE_RANK(name, type, field, attr)			\
 /*									\
  * Return the rank of the subtree rooted at elm, or -1 if the subtree	\
@@ -525,14 +1387,20 @@ name##_RB_RANK(struct type *elm)					\
 	    name##_RB_RANK(right);					\
 	if (left_rank != right_rank ||					\
 	    (left_rank == 2 && left == NULL && right == NULL) ||	\
-	    _RB_AUGMENT_VERIFY(elm))					\
+	    name##_RB_AUGMENT_VERIFY(elm))				\
 		return (-1);						\
 	return (left_rank);						\
 }
 #else
+#define _RB_GENERATE_AUGMENT_VERIFY(name, type, verify)
 #define RB_GENERATE_RANK(name, type, field, attr)
 #endif
 
+/*
+ * RB_GENERATE_COMPACT keeps its own copies of the rank rules in
+ * RB_GENERATE_INSERT_COLOR, RB_GENERATE_REMOVE_COLOR and RB_GENERATE_REMOVE,
+ * written on 32-bit links; a change to any of these must be made there too.
+ */
 #define RB_GENERATE_INSERT_COLOR(name, type, field, attr)		\
 attr struct type *							\
 name##_RB_INSERT_COLOR(struct name *head,				\
@@ -544,10 +1412,9 @@ name##_RB_INSERT_COLOR(struct name *head,				\
 	 * with a black non-null child and a red null child. The        \
 	 * balance criterion "the rank of any leaf is 1" precludes the  \
 	 * possibility of two red null children for the initial parent. \
-	 * So the first loop iteration cannot lead to accessing an      \
-	 * uninitialized 'child', and a later iteration can only happen \
-	 * when a value has been assigned to 'child' in the previous    \
-	 * one.								\
+	 * RB_JOIN also calls this with an interior elm whose rank is	\
+	 * one more than its parent's former child on that side, so	\
+	 * 'child' is reloaded from elm before a double rotation.	\
 	 */								\
 	struct type *child, *child_up, *gpar;				\
 	__uintptr_t elmdir, sibdir;					\
@@ -592,6 +1459,7 @@ name##_RB_INSERT_COLOR(struct name *head,				\
 			 *	 x      y	 w     \		\
 			 *				x		\
 			 */						\
+			child = _RB_LINK(elm, sibdir, field);		\
 			RB_ROTATE(elm, child, elmdir, field);		\
 			child_up = _RB_UP(child, field);		\
 			if (_RB_BITS(child_up) & sibdir)		\
@@ -629,8 +1497,8 @@ name##_RB_INSERT_COLOR(struct name *head,				\
 		 * so update augmentation for them.			\
 		 */							\
 		if (elm != child)					\
-			(void)RB_AUGMENT_CHECK(elm);			\
-		(void)RB_AUGMENT_CHECK(parent);				\
+			(void)_RB_AUGMENT_CHECK(name, elm);		\
+		(void)_RB_AUGMENT_CHECK(name, parent);			\
 		return (child);						\
 	} while ((parent = gpar) != NULL);				\
 	return (NULL);							\
@@ -760,17 +1628,17 @@ name##_RB_REMOVE_COLOR(struct name *head,				\
 		 * augmentation for it.					\
 		 */							\
 		if (sib != elm)						\
-			(void)RB_AUGMENT_CHECK(sib);			\
+			(void)_RB_AUGMENT_CHECK(name, sib);		\
 		return (parent);					\
 	} while (elm = parent, (parent = gpar) != NULL);		\
 	return (NULL);							\
 }
 
-#define _RB_AUGMENT_WALK(elm, match, field)				\
+#define _RB_AUGMENT_WALK(name, elm, match, field)			\
 do {									\
 	if (match == elm)						\
 		match = NULL;						\
-} while (RB_AUGMENT_CHECK(elm) &&					\
+} while (_RB_AUGMENT_CHECK(name, elm) &&				\
     (elm = RB_PARENT(elm, field)) != NULL)
 
 #define RB_GENERATE_REMOVE(name, type, field, attr)			\
@@ -779,6 +1647,7 @@ name##_RB_REMOVE(struct name *head, struct type *out)			\
 {									\
 	struct type *child, *in, *opar, *parent;			\
 									\
+	name##_RB_CACHE_REMOVE(head, out);				\
 	child = RB_LEFT(out, field);					\
 	in = RB_RIGHT(out, field);					\
 	opar = _RB_UP(out, field);					\
@@ -812,15 +1681,15 @@ name##_RB_REMOVE(struct name *head, struct type *out)			\
 			opar = NULL;					\
 			parent = RB_PARENT(parent, field);		\
 		}							\
-		_RB_AUGMENT_WALK(parent, opar, field);			\
+		_RB_AUGMENT_WALK(name, parent, opar, field);		\
 		if (opar != NULL) {					\
 			/*						\
 			 * Elements rotated into the search path have	\
 			 * changed subtrees, so update augmentation for	\
 			 * them if AUGMENT_WALK didn't.			\
 			 */						\
-			(void)RB_AUGMENT_CHECK(opar);			\
-			(void)RB_AUGMENT_CHECK(RB_PARENT(opar, field));	\
+			(void)_RB_AUGMENT_CHECK(name, opar);		\
+			(void)_RB_AUGMENT_CHECK(name, RB_PARENT(opar, field)); \
 		}							\
 	}								\
 	return (out);							\
@@ -830,22 +1699,23 @@ name##_RB_REMOVE(struct name *head, struct type *out)			\
 /* Inserts a node into the RB tree */					\
 attr struct type *							\
 name##_RB_INSERT_FINISH(struct name *head, struct type *parent,		\
-    struct type **pptr, struct type *elm)				\
+    struct type *volatile *pptr, struct type *elm)			\
 {									\
 	struct type *tmp = NULL;					\
 									\
 	RB_SET(elm, parent, field);					\
 	*pptr = elm;							\
+	name##_RB_CACHE_INSERT(head, elm);				\
 	if (parent != NULL)						\
 		tmp = name##_RB_INSERT_COLOR(head, parent, elm);	\
-	_RB_AUGMENT_WALK(elm, tmp, field);				\
+	_RB_AUGMENT_WALK(name, elm, tmp, field);			\
 	if (tmp != NULL)						\
 		/*							\
 		 * An element rotated into the search path has a	\
 		 * changed subtree, so update augmentation for it if	\
 		 * AUGMENT_WALK didn't.					\
 		 */							\
-		(void)RB_AUGMENT_CHECK(tmp);				\
+		(void)_RB_AUGMENT_CHECK(name, tmp);			\
 	return (NULL);							\
 }
 
@@ -855,10 +1725,12 @@ attr struct type *							\
 name##_RB_INSERT(struct name *head, struct type *elm)			\
 {									\
 	struct type *tmp;						\
-	struct type **tmpp = &RB_ROOT(head);				\
+	__typeof(&RB_LEFT(elm, field)) tmpp = &RB_ROOT(head);		\
 	struct type *parent = NULL;					\
 									\
+	name##_RB_PREPARE(elm);						\
 	while ((tmp = *tmpp) != NULL) {					\
+		_RB_PREFETCH_CHILDREN(tmp, field);			\
 		parent = tmp;						\
 		__typeof(cmp(NULL, NULL)) comp = (cmp)(elm, parent);	\
 		if (comp < 0)						\
@@ -872,13 +1744,16 @@ name##_RB_INSERT(struct name *head, struct type *elm)			\
 }
 
 #define RB_GENERATE_FIND(name, type, field, cmp, attr)			\
+	_RB_GENERATE_FIND(name, name##_RB_FIND, type, field, cmp, attr)
+#define _RB_GENERATE_FIND(name, fn, type, field, cmp, attr)		\
 /* Finds the node with the same key as elm */				\
 attr struct type *							\
-name##_RB_FIND(struct name *head, struct type *elm)			\
+fn(struct name *head, struct type *elm)					\
 {									\
 	struct type *tmp = RB_ROOT(head);				\
 	__typeof(cmp(NULL, NULL)) comp;					\
 	while (tmp) {							\
+		_RB_PREFETCH_CHILDREN(tmp, field);			\
 		comp = cmp(elm, tmp);					\
 		if (comp < 0)						\
 			tmp = RB_LEFT(tmp, field);			\
@@ -891,14 +1766,17 @@ name##_RB_FIND(struct name *head, struct type *elm)			\
 }
 
 #define RB_GENERATE_NFIND(name, type, field, cmp, attr)			\
+	_RB_GENERATE_NFIND(name, name##_RB_NFIND, type, field, cmp, attr)
+#define _RB_GENERATE_NFIND(name, fn, type, field, cmp, attr)		\
 /* Finds the first node greater than or equal to the search key */	\
 attr struct type *							\
-name##_RB_NFIND(struct name *head, struct type *elm)			\
+fn(struct name *head, struct type *elm)					\
 {									\
 	struct type *tmp = RB_ROOT(head);				\
 	struct type *res = NULL;					\
 	__typeof(cmp(NULL, NULL)) comp;					\
 	while (tmp) {							\
+		_RB_PREFETCH_CHILDREN(tmp, field);			\
 		comp = cmp(elm, tmp);					\
 		if (comp < 0) {						\
 			res = tmp;					\
@@ -912,6 +1790,29 @@ name##_RB_NFIND(struct name *head, struct type *elm)			\
 	return (res);							\
 }
 
+#define RB_GENERATE_PFIND(name, type, field, cmp, attr)			\
+/* Finds the last node less than or equal to the search key */		\
+attr struct type *							\
+name##_RB_PFIND(struct name *head, struct type *elm)			\
+{									\
+	struct type *tmp = RB_ROOT(head);				\
+	struct type *res = NULL;					\
+	__typeof(cmp(NULL, NULL)) comp;					\
+	while (tmp) {							\
+		_RB_PREFETCH_CHILDREN(tmp, field);			\
+		comp = cmp(elm, tmp);					\
+		if (comp > 0) {						\
+			res = tmp;					\
+			tmp = RB_RIGHT(tmp, field);			\
+		}							\
+		else if (comp < 0)					\
+			tmp = RB_LEFT(tmp, field);			\
+		else							\
+			return (tmp);					\
+	}								\
+	return (res);							\
+}
+
 #define RB_GENERATE_NEXT(name, type, field, attr)			\
 /* ARGSUSED */								\
 attr struct type *							\
@@ -927,6 +1828,7 @@ name##_RB_NEXT(struct type *elm)					\
 			elm = RB_PARENT(elm, field);			\
 		elm = RB_PARENT(elm, field);				\
 	}								\
+	_RB_PREFETCH_STEP(elm, _RB_R, field);				\
 	return (elm);							\
 }
 
@@ -945,8 +1847,9 @@ name##_RB_INSERT_NEXT(struct name *head,				\
     struct type *elm, struct type *next)				\
 {									\
 	struct type *tmp;						\
-	struct type **tmpp = &RB_RIGHT(elm, field);			\
+	__typeof(&RB_RIGHT(elm, field)) tmpp = &RB_RIGHT(elm, field);	\
 									\
+	name##_RB_PREPARE(next);					\
 	_RB_ORDER_CHECK(cmp, elm, next);				\
 	if (name##_RB_NEXT(elm) != NULL)				\
 		_RB_ORDER_CHECK(cmp, next, name##_RB_NEXT(elm));	\
@@ -972,6 +1875,7 @@ name##_RB_PREV(struct type *elm)					\
 			elm = RB_PARENT(elm, field);			\
 		elm = RB_PARENT(elm, field);				\
 	}								\
+	_RB_PREFETCH_STEP(elm, _RB_L, field);				\
 	return (elm);							\
 }
 
@@ -982,8 +1886,9 @@ name##_RB_INSERT_PREV(struct name *head,				\
     struct type *elm, struct type *prev)				\
 {									\
 	struct type *tmp;						\
-	struct type **tmpp = &RB_LEFT(elm, field);			\
+	__typeof(&RB_LEFT(elm, field)) tmpp = &RB_LEFT(elm, field);	\
 									\
+	name##_RB_PREPARE(prev);					\
 	_RB_ORDER_CHECK(cmp, prev, elm);				\
 	if (name##_RB_PREV(elm) != NULL)				\
 		_RB_ORDER_CHECK(cmp, name##_RB_PREV(elm), prev);	\
@@ -1000,6 +1905,9 @@ name##_RB_MINMAX(struct name *head, int val)				\
 {									\
 	struct type *tmp = RB_ROOT(head);				\
 	struct type *parent = NULL;					\
+	if (tmp != NULL &&						\
+	    (parent = name##_RB_CACHE_GET(head, val)) != NULL)		\
+		return (parent);					\
 	while (tmp) {							\
 		parent = tmp;						\
 		if (val < 0)						\
@@ -1015,6 +1923,8 @@ attr struct type *							\
 name##_RB_REINSERT(struct name *head, struct type *elm)			\
 {									\
 	struct type *cmpelm;						\
+									\
+	name##_RB_PREPARE(elm);						\
 	if (((cmpelm = RB_PREV(name, head, elm)) != NULL &&		\
 	    cmp(cmpelm, elm) >= 0) ||					\
 	    ((cmpelm = RB_NEXT(name, head, elm)) != NULL &&		\
@@ -1026,49 +1936,3157 @@ name##_RB_REINSERT(struct name *head, struct type *elm)			\
 	return (NULL);							\
 }									\
 
-#define RB_NEGINF	-1
-#define RB_INF	1
+/*
+ * Order statistics.  In a tree generated by RB_GENERATE_AUGMENT with
+ * name##_RB_SIZE_UPDATE as the augment function, each node keeps the number of
+ * nodes in the subtree rooted at it in sfield, an unsigned integer field of
+ * struct type.  The functions generated by RB_GENERATE_SIZE use those counts
+ * to find the node at a given position in the ordering, the position of a
+ * given node, and the number of nodes in a range of keys, in O(lg n) time.
+ * Positions count from 0.
+ */
+#define RB_PROTOTYPE_SIZE(name, type, field, sfield, cmp)		\
+	RB_PROTOTYPE_SIZE_INTERNAL(name, type, field, sfield, cmp,)
+#define RB_PROTOTYPE_SIZE_STATIC(name, type, field, sfield, cmp)	\
+	RB_PROTOTYPE_SIZE_INTERNAL(name, type, field, sfield, cmp,	\
+	    __unused static)
+#define RB_PROTOTYPE_SIZE_INTERNAL(name, type, field, sfield, cmp, attr) \
+	attr int name##_RB_SIZE_UPDATE(struct type *);			\
+	attr struct type *name##_RB_SELECT(struct name *, size_t);	\
+	attr size_t name##_RB_ORDER_RANK(struct type *);		\
+	attr size_t name##_RB_COUNT_BELOW(struct name *, struct type *, int); \
+	attr size_t name##_RB_COUNT_RANGE(struct name *, struct type *,	\
+	    struct type *);						\
+	attr size_t name##_RB_COUNT(struct name *);
 
-#define RB_INSERT(name, x, y)	name##_RB_INSERT(x, y)
-#define RB_INSERT_NEXT(name, x, y, z)	name##_RB_INSERT_NEXT(x, y, z)
-#define RB_INSERT_PREV(name, x, y, z)	name##_RB_INSERT_PREV(x, y, z)
-#define RB_REMOVE(name, x, y)	name##_RB_REMOVE(x, y)
-#define RB_FIND(name, x, y)	name##_RB_FIND(x, y)
-#define RB_NFIND(name, x, y)	name##_RB_NFIND(x, y)
-#define RB_NEXT(name, x, y)	name##_RB_NEXT(y)
-#define RB_PREV(name, x, y)	name##_RB_PREV(y)
-#define RB_MIN(name, x)		name##_RB_MINMAX(x, RB_NEGINF)
-#define RB_MAX(name, x)		name##_RB_MINMAX(x, RB_INF)
-#define RB_REINSERT(name, x, y)	name##_RB_REINSERT(x, y)
+#define RB_GENERATE_SIZE(name, type, field, sfield, cmp)		\
+	RB_GENERATE_SIZE_INTERNAL(name, type, field, sfield, cmp,)
+#define RB_GENERATE_SIZE_STATIC(name, type, field, sfield, cmp)		\
+	RB_GENERATE_SIZE_INTERNAL(name, type, field, sfield, cmp,	\
+	    __unused static)
+#define RB_GENERATE_SIZE_INTERNAL(name, type, field, sfield, cmp, attr)	\
+/* Recomputes the subtree size of elm; returns true if it changed */	\
+attr int								\
+name##_RB_SIZE_UPDATE(struct type *elm)					\
+{									\
+	size_t size = 1 + _RB_SIZE(RB_LEFT(elm, field), sfield) +	\
+	    _RB_SIZE(RB_RIGHT(elm, field), sfield);			\
+	if ((size_t)(elm)->sfield == size)				\
+		return (0);						\
+	(elm)->sfield = size;						\
+	return (1);							\
+}									\
+									\
+/* Finds the node at position k, or NULL if there are k or fewer nodes */ \
+attr struct type *							\
+name##_RB_SELECT(struct name *head, size_t k)				\
+{									\
+	struct type *tmp = RB_ROOT(head);				\
+	size_t left;							\
+	while (tmp) {							\
+		left = _RB_SIZE(RB_LEFT(tmp, field), sfield);		\
+		if (k < left)						\
+			tmp = RB_LEFT(tmp, field);			\
+		else if (k > left) {					\
+			k -= left + 1;					\
+			tmp = RB_RIGHT(tmp, field);			\
+		} else							\
+			return (tmp);					\
+	}								\
+	return (NULL);							\
+}									\
+									\
+/* Returns the position of elm in its tree */				\
+attr size_t								\
+name##_RB_ORDER_RANK(struct type *elm)					\
+{									\
+	struct type *parent;						\
+	size_t rank = _RB_SIZE(RB_LEFT(elm, field), sfield);		\
+	while ((parent = RB_PARENT(elm, field)) != NULL) {		\
+		if (elm == RB_RIGHT(parent, field))			\
+			rank += _RB_SIZE(RB_LEFT(parent, field), sfield) + 1; \
+		elm = parent;						\
+	}								\
+	return (rank);							\
+}									\
+									\
+/*									\
+ * Counts the nodes less than elm, or, if inclusive is true, the nodes	\
+ * less than or equal to elm.						\
+ */									\
+attr size_t								\
+name##_RB_COUNT_BELOW(struct name *head, struct type *elm, int inclusive) \
+{									\
+	struct type *tmp = RB_ROOT(head);				\
+	size_t count = 0;						\
+	__typeof(cmp(NULL, NULL)) comp;					\
+	while (tmp) {							\
+		comp = cmp(elm, tmp);					\
+		if (comp < 0 || (comp == 0 && !inclusive))		\
+			tmp = RB_LEFT(tmp, field);			\
+		else {							\
+			count += _RB_SIZE(RB_LEFT(tmp, field), sfield) + 1; \
+			tmp = RB_RIGHT(tmp, field);			\
+		}							\
+	}								\
+	return (count);							\
+}									\
+									\
+/* Counts the nodes not less than lo and not greater than hi */		\
+attr size_t								\
+name##_RB_COUNT_RANGE(struct name *head, struct type *lo, struct type *hi) \
+{									\
+	size_t below_lo = name##_RB_COUNT_BELOW(head, lo, 0);		\
+	size_t upto_hi = name##_RB_COUNT_BELOW(head, hi, 1);		\
+	return (upto_hi > below_lo ? upto_hi - below_lo : 0);		\
+}									\
+									\
+/* Counts all the nodes in the tree */					\
+attr size_t								\
+name##_RB_COUNT(struct name *head)					\
+{									\
+	return (_RB_SIZE(RB_ROOT(head), sfield));			\
+}
 
-#define RB_FOREACH(x, name, head)					\
-	for ((x) = RB_MIN(name, head);					\
-	     (x) != NULL;						\
-	     (x) = name##_RB_NEXT(x))
+#define _RB_SIZE(elm, sfield)	((elm) == NULL ? 0 : (size_t)(elm)->sfield)
 
-#define RB_FOREACH_FROM(x, name, y)					\
-	for ((x) = (y);							\
-	    ((x) != NULL) && ((y) = name##_RB_NEXT(x), (x) != NULL);	\
-	     (x) = (y))
+/*
+ * Interval trees.  Each node holds a closed interval [lofield, hifield] of an
+ * integer or other arithmetic type, and the tree must be ordered by lofield,
+ * that is, cmp must order nodes by lofield first.  In a tree generated by
+ * RB_GENERATE_AUGMENT with name##_RB_OVERLAP_UPDATE as the augment function,
+ * maxfield of each node holds the greatest hifield in the subtree rooted at
+ * it.  The functions generated by RB_GENERATE_INTERVAL use that to find the
+ * intervals overlapping [lo, hi] in order of lofield, each in O(lg n) time.
+ * After changing hifield of a node in the tree, call RB_UPDATE_AUGMENT_NAME.
+ */
+#define _RB_FIELD_TYPE(type, kfield)	__typeof(((struct type *)0)->kfield)
 
-#define RB_FOREACH_SAFE(x, name, head, y)				\
-	for ((x) = RB_MIN(name, head);					\
-	    ((x) != NULL) && ((y) = name##_RB_NEXT(x), (x) != NULL);	\
-	     (x) = (y))
+#define RB_PROTOTYPE_INTERVAL(name, type, field, lofield, hifield, maxfield) \
+	RB_PROTOTYPE_INTERVAL_INTERNAL(name, type, field, lofield,	\
+	    hifield, maxfield,)
+#define RB_PROTOTYPE_INTERVAL_STATIC(name, type, field, lofield, hifield, \
+    maxfield)								\
+	RB_PROTOTYPE_INTERVAL_INTERNAL(name, type, field, lofield,	\
+	    hifield, maxfield, __unused static)
+#define RB_PROTOTYPE_INTERVAL_INTERNAL(name, type, field, lofield,	\
+    hifield, maxfield, attr)						\
+	attr int name##_RB_OVERLAP_UPDATE(struct type *);		\
+	attr struct type *name##_RB_OVERLAP_SUBTREE(struct type *,	\
+	    _RB_FIELD_TYPE(type, lofield), _RB_FIELD_TYPE(type, lofield)); \
+	attr struct type *name##_RB_FIND_OVERLAP(struct name *,		\
+	    _RB_FIELD_TYPE(type, lofield), _RB_FIELD_TYPE(type, lofield)); \
+	attr struct type *name##_RB_NEXT_OVERLAP(struct type *,		\
+	    _RB_FIELD_TYPE(type, lofield), _RB_FIELD_TYPE(type, lofield));
 
-#define RB_FOREACH_REVERSE(x, name, head)				\
-	for ((x) = RB_MAX(name, head);					\
-	     (x) != NULL;						\
-	     (x) = name##_RB_PREV(x))
+#define RB_GENERATE_INTERVAL(name, type, field, lofield, hifield, maxfield) \
+	RB_GENERATE_INTERVAL_INTERNAL(name, type, field, lofield,	\
+	    hifield, maxfield,)
+#define RB_GENERATE_INTERVAL_STATIC(name, type, field, lofield, hifield, \
+    maxfield)								\
+	RB_GENERATE_INTERVAL_INTERNAL(name, type, field, lofield,	\
+	    hifield, maxfield, __unused static)
+#define RB_GENERATE_INTERVAL_INTERNAL(name, type, field, lofield,	\
+    hifield, maxfield, attr)						\
+/* Recomputes the subtree maximum of elm; returns true if it changed */	\
+attr int								\
+name##_RB_OVERLAP_UPDATE(struct type *elm)				\
+{									\
+	struct type *child;						\
+	_RB_FIELD_TYPE(type, lofield) max = (elm)->hifield;		\
+	if ((child = RB_LEFT(elm, field)) != NULL &&			\
+	    (child)->maxfield > max)					\
+		max = (child)->maxfield;				\
+	if ((child = RB_RIGHT(elm, field)) != NULL &&			\
+	    (child)->maxfield > max)					\
+		max = (child)->maxfield;				\
+	if ((elm)->maxfield == max)					\
+		return (0);						\
+	(elm)->maxfield = max;						\
+	return (1);							\
+}									\
+									\
+/*									\
+ * Finds the least node of the subtree rooted at elm that overlaps	\
+ * [lo, hi].  If the left subtree reaches lo, either it holds an	\
+ * overlapping node, or its interval reaching lo starts after hi, as	\
+ * do all the nodes after it, so the rest of the subtree can be skipped. \
+ */									\
+attr struct type *							\
+name##_RB_OVERLAP_SUBTREE(struct type *elm,				\
+    _RB_FIELD_TYPE(type, lofield) lo, _RB_FIELD_TYPE(type, lofield) hi)	\
+{									\
+	struct type *left;						\
+	while (elm) {							\
+		left = RB_LEFT(elm, field);				\
+		if (left != NULL && (left)->maxfield >= lo)		\
+			elm = left;					\
+		else if ((elm)->lofield > hi)				\
+			return (NULL);					\
+		else if ((elm)->hifield >= lo)				\
+			return (elm);					\
+		else							\
+			elm = RB_RIGHT(elm, field);			\
+	}								\
+	return (NULL);							\
+}									\
+									\
+/* Finds the least node that overlaps [lo, hi] */			\
+attr struct type *							\
+name##_RB_FIND_OVERLAP(struct name *head,				\
+    _RB_FIELD_TYPE(type, lofield) lo, _RB_FIELD_TYPE(type, lofield) hi)	\
+{									\
+	return (name##_RB_OVERLAP_SUBTREE(RB_ROOT(head), lo, hi));	\
+}									\
+									\
+/* Finds the least node after elm that overlaps [lo, hi] */		\
+attr struct type *							\
+name##_RB_NEXT_OVERLAP(struct type *elm,				\
+    _RB_FIELD_TYPE(type, lofield) lo, _RB_FIELD_TYPE(type, lofield) hi)	\
+{									\
+	struct type *parent, *tmp;					\
+	tmp = RB_RIGHT(elm, field);					\
+	if (tmp != NULL && (tmp)->maxfield >= lo &&			\
+	    (tmp = name##_RB_OVERLAP_SUBTREE(tmp, lo, hi)) != NULL)	\
+		return (tmp);						\
+	while ((parent = RB_PARENT(elm, field)) != NULL) {		\
+		if (elm == RB_LEFT(parent, field)) {			\
+			if ((parent)->lofield > hi)			\
+				return (NULL);				\
+			if ((parent)->hifield >= lo)			\
+				return (parent);			\
+			tmp = RB_RIGHT(parent, field);			\
+			if (tmp != NULL && (tmp)->maxfield >= lo &&	\
+			    (tmp = name##_RB_OVERLAP_SUBTREE(tmp, lo, hi)) \
+			    != NULL)					\
+				return (tmp);				\
+		}							\
+		elm = parent;						\
+	}								\
+	return (NULL);							\
+}
 
-#define RB_FOREACH_REVERSE_FROM(x, name, y)				\
-	for ((x) = (y);							\
-	    ((x) != NULL) && ((y) = name##_RB_PREV(x), (x) != NULL);	\
-	     (x) = (y))
+/*
+ * Subtree aggregates.  In a tree generated by RB_GENERATE_AUGMENT with
+ * name##_RB_AGGREGATE_UPDATE as the augment function, each node keeps in
+ * aggfield the combination, in key order, of value(x) for every node x in the
+ * subtree rooted at it.  combine(a, b) must be associative, with identity as
+ * its identity element; it need not be commutative.  A sum, a minimum and a
+ * maximum are all examples, as is a struct holding several of them.
+ * equal(a, b) returns true when two aggregates are the same, so that the
+ * update reports whether it changed the node, which _RB_DIAGNOSTIC checks;
+ * it must not compare the padding of a struct.  As with any augment given
+ * to RB_GENERATE_AUGMENT, updates still continue up to the root.
+ * The functions generated by RB_GENERATE_AGGREGATE combine the values of a
+ * range of keys from O(lg n) subtree aggregates.  After changing the value
+ * of a node in the tree, call RB_UPDATE_AUGMENT_NAME.
+ */
+#define RB_PROTOTYPE_AGGREGATE(name, type, field, aggfield, cmp)	\
+	RB_PROTOTYPE_AGGREGATE_INTERNAL(name, type, field, aggfield, cmp,)
+#define RB_PROTOTYPE_AGGREGATE_STATIC(name, type, field, aggfield, cmp)	\
+	RB_PROTOTYPE_AGGREGATE_INTERNAL(name, type, field, aggfield, cmp, \
+	    __unused static)
+#define RB_PROTOTYPE_AGGREGATE_INTERNAL(name, type, field, aggfield, cmp, \
+    attr)								\
+	attr int name##_RB_AGGREGATE_UPDATE(struct type *);		\
+	attr _RB_FIELD_TYPE(type, aggfield)				\
+	    name##_RB_REDUCE_RANGE(struct name *, struct type *, struct type *); \
+	attr _RB_FIELD_TYPE(type, aggfield) name##_RB_REDUCE(struct name *);
 
-#define RB_FOREACH_REVERSE_SAFE(x, name, head, y)			\
-	for ((x) = RB_MAX(name, head);					\
-	    ((x) != NULL) && ((y) = name##_RB_PREV(x), (x) != NULL);	\
-	     (x) = (y))
+#define RB_GENERATE_AGGREGATE(name, type, field, aggfield, cmp, value,	\
+    combine, identity, equal)						\
+	RB_GENERATE_AGGREGATE_INTERNAL(name, type, field, aggfield, cmp, \
+	    value, combine, identity, equal,)
+#define RB_GENERATE_AGGREGATE_STATIC(name, type, field, aggfield, cmp,	\
+    value, combine, identity, equal)					\
+	RB_GENERATE_AGGREGATE_INTERNAL(name, type, field, aggfield, cmp, \
+	    value, combine, identity, equal, __unused static)
+#define RB_GENERATE_AGGREGATE_INTERNAL(name, type, field, aggfield, cmp, \
+    value, combine, identity, equal, attr)				\
+/* Recomputes the subtree aggregate of elm; returns true if it changed */ \
+attr int								\
+name##_RB_AGGREGATE_UPDATE(struct type *elm)				\
+{									\
+	_RB_FIELD_TYPE(type, aggfield) agg;				\
+									\
+	agg = combine(combine(_RB_AGGREGATE(RB_LEFT(elm, field),	\
+	    aggfield, identity), value(elm)),				\
+	    _RB_AGGREGATE(RB_RIGHT(elm, field), aggfield, identity));	\
+	if (equal((elm)->aggfield, agg))				\
+		return (0);						\
+	(elm)->aggfield = agg;						\
+	return (1);							\
+}									\
+									\
+/*									\
+ * Combines the values of the nodes not less than lo and not greater	\
+ * than hi.  Below the node where the searches for lo and hi part, the	\
+ * search for lo collects the subtrees to its right, and the search	\
+ * for hi the subtrees to its left.					\
+ */									\
+attr _RB_FIELD_TYPE(type, aggfield)					\
+name##_RB_REDUCE_RANGE(struct name *head, struct type *lo,		\
+    struct type *hi)							\
+{									\
+	_RB_FIELD_TYPE(type, aggfield) left, right;			\
+	struct type *tmp = RB_ROOT(head);				\
+	struct type *elm;						\
+									\
+	while (tmp) {							\
+		if (cmp(lo, tmp) > 0)					\
+			tmp = RB_RIGHT(tmp, field);			\
+		else if (cmp(hi, tmp) < 0)				\
+			tmp = RB_LEFT(tmp, field);			\
+		else							\
+			break;						\
+	}								\
+	if (tmp == NULL)						\
+		return (identity);					\
+	left = identity;						\
+	elm = RB_LEFT(tmp, field);					\
+	while (elm) {							\
+		if (cmp(lo, elm) <= 0) {				\
+			left = combine(combine(value(elm),		\
+			    _RB_AGGREGATE(RB_RIGHT(elm, field), aggfield, \
+			    identity)), left);				\
+			elm = RB_LEFT(elm, field);			\
+		} else							\
+			elm = RB_RIGHT(elm, field);			\
+	}								\
+	right = identity;						\
+	elm = RB_RIGHT(tmp, field);					\
+	while (elm) {							\
+		if (cmp(hi, elm) >= 0) {				\
+			right = combine(right, combine(			\
+			    _RB_AGGREGATE(RB_LEFT(elm, field), aggfield, \
+			    identity), value(elm)));			\
+			elm = RB_RIGHT(elm, field);			\
+		} else							\
+			elm = RB_LEFT(elm, field);			\
+	}								\
+	return (combine(combine(left, value(tmp)), right));		\
+}									\
+									\
+/* Combines the values of all the nodes in the tree */			\
+attr _RB_FIELD_TYPE(type, aggfield)					\
+name##_RB_REDUCE(struct name *head)					\
+{									\
+	return (_RB_AGGREGATE(RB_ROOT(head), aggfield, identity));	\
+}
+
+#define _RB_AGGREGATE(elm, aggfield, identity)				\
+	((elm) == NULL ? (identity) : (elm)->aggfield)
+
+/*
+ * Bulk construction.  The functions generated by RB_GENERATE_BUILD replace
+ * the contents of a tree with n nodes supplied in increasing order, either
+ * from an array of pointers or one at a time by a function called with arg,
+ * which suits draining a sorted list.  They link the nodes into a perfectly
+ * balanced tree, and update augmentation data from the bottom up, in O(n)
+ * time and with no calls to cmp.
+ */
+#define RB_PROTOTYPE_BUILD(name, type, field)				\
+	RB_PROTOTYPE_BUILD_INTERNAL(name, type, field,)
+#define RB_PROTOTYPE_BUILD_STATIC(name, type, field)			\
+	RB_PROTOTYPE_BUILD_INTERNAL(name, type, field, __unused static)
+#define RB_PROTOTYPE_BUILD_INTERNAL(name, type, field, attr)		\
+	attr struct type *name##_RB_BUILD_SUBTREE(size_t, struct type ***, \
+	    struct type *(*)(void *), void *, int *);			\
+	attr void name##_RB_BUILD_SORTED(struct name *, struct type **,	\
+	    size_t);							\
+	attr void name##_RB_BUILD_SORTED_ITER(struct name *, size_t,	\
+	    struct type *(*)(void *), void *);
+
+#define RB_GENERATE_BUILD(name, type, field)				\
+	RB_GENERATE_BUILD_INTERNAL(name, type, field,)
+#define RB_GENERATE_BUILD_STATIC(name, type, field)			\
+	RB_GENERATE_BUILD_INTERNAL(name, type, field, __unused static)
+#define RB_GENERATE_BUILD_INTERNAL(name, type, field, attr)		\
+/*									\
+ * Builds a subtree of n nodes taken from *elemsp, or from next(arg) if	\
+ * elemsp is NULL, and stores its rank in *rankp.  The left subtree	\
+ * gets the larger half, so its rank is never less than the rank of	\
+ * the right subtree, and exceeds it by at most one.			\
+ */									\
+attr struct type *							\
+name##_RB_BUILD_SUBTREE(size_t n, struct type ***elemsp,		\
+    struct type *(*next)(void *), void *arg, int *rankp)		\
+{									\
+	struct type *elm, *left, *right;				\
+	int left_rank, right_rank;					\
+									\
+	if (n == 0) {							\
+		*rankp = 0;						\
+		return (NULL);						\
+	}								\
+	left = name##_RB_BUILD_SUBTREE(n / 2, elemsp, next, arg,	\
+	    &left_rank);						\
+	elm = elemsp != NULL ? *(*elemsp)++ : next(arg);		\
+	name##_RB_PREPARE(elm);						\
+	right = name##_RB_BUILD_SUBTREE(n - n / 2 - 1, elemsp, next, arg, \
+	    &right_rank);						\
+	RB_SET(elm, NULL, field);					\
+	if ((RB_LEFT(elm, field) = left) != NULL)			\
+		RB_SET_PARENT(left, elm, field);			\
+	if ((RB_RIGHT(elm, field) = right) != NULL)			\
+		RB_SET_PARENT(right, elm, field);			\
+	if (right_rank < left_rank)					\
+		_RB_BITSUP(elm, field) |= _RB_R;			\
+	*rankp = left_rank + 1;						\
+	(void)_RB_AUGMENT_CHECK(name, elm);				\
+	return (elm);							\
+}									\
+									\
+/* Replaces the tree with the n nodes of elems, in increasing order */	\
+attr void								\
+name##_RB_BUILD_SORTED(struct name *head, struct type **elems, size_t n) \
+{									\
+	int rank;							\
+	RB_ROOT(head) = name##_RB_BUILD_SUBTREE(n, &elems, NULL, NULL,	\
+	    &rank);							\
+	name##_RB_CACHE_RESET(head);					\
+}									\
+									\
+/* Replaces the tree with n nodes returned, in increasing order, by next */ \
+attr void								\
+name##_RB_BUILD_SORTED_ITER(struct name *head, size_t n,		\
+    struct type *(*next)(void *), void *arg)				\
+{									\
+	int rank;							\
+	RB_ROOT(head) = name##_RB_BUILD_SUBTREE(n, NULL, next, arg, &rank); \
+	name##_RB_CACHE_RESET(head);					\
+}
+
+/*
+ * Weighted rebuilds of rank-balanced trees.  A tree rebuilt by weight by
+ * RB_REBUILD no longer keeps the rank rules, so until RB_BUILD_SORTED
+ * rebuilds it balanced, from the same array of nodes, it may only be
+ * searched and walked: RB_FIND, RB_NFIND, RB_FIND_COUNT, RB_MIN, RB_MAX,
+ * RB_NEXT, RB_PREV and the RB_FOREACH loops.  Augmentation data is
+ * updated for the new shape.
+ */
+#define _RB_WEIGHT_LINK(name, elm, left, right, field) do {		\
+	RB_SET(elm, NULL, field);					\
+	if ((RB_LEFT(elm, field) = (left)) != NULL)			\
+		RB_SET_PARENT(left, elm, field);			\
+	if ((RB_RIGHT(elm, field) = (right)) != NULL)			\
+		RB_SET_PARENT(right, elm, field);			\
+	(void)_RB_AUGMENT_CHECK(name, elm);				\
+} while (/*CONSTCOND*/ 0)
+
+#define RB_PROTOTYPE_WEIGHT(name, type, field, cmp, cfield)		\
+	RB_PROTOTYPE_WEIGHT_INTERNAL(name, type, field, cmp, cfield,)
+#define RB_PROTOTYPE_WEIGHT_STATIC(name, type, field, cmp, cfield)	\
+	RB_PROTOTYPE_WEIGHT_INTERNAL(name, type, field, cmp, cfield,	\
+	    __unused static)
+#define RB_PROTOTYPE_WEIGHT_INTERNAL(name, type, field, cmp, cfield, attr) \
+	attr struct type *name##_RB_FIND_COUNT(struct name *,		\
+	    struct type *);						\
+	attr size_t name##_RB_REBUILD(struct name *, struct type **, size_t);
+
+#define RB_GENERATE_WEIGHT(name, type, field, cmp, cfield)		\
+	RB_GENERATE_WEIGHT_INTERNAL(name, type, field, cmp, cfield,)
+#define RB_GENERATE_WEIGHT_STATIC(name, type, field, cmp, cfield)	\
+	RB_GENERATE_WEIGHT_INTERNAL(name, type, field, cmp, cfield,	\
+	    __unused static)
+#define RB_GENERATE_WEIGHT_INTERNAL(name, type, field, cmp, cfield, attr) \
+_WEIGHT_GENERATE(name, _RB, type, field, cfield, _RB_WEIGHT_LINK)	\
+									\
+/* Finds the node with the same key as elm, and counts it */		\
+attr struct type *							\
+name##_RB_FIND_COUNT(struct name *head, struct type *elm)		\
+{									\
+	struct type *tmp = RB_ROOT(head);				\
+	__typeof(cmp(NULL, NULL)) comp;					\
+	while (tmp) {							\
+		_RB_PREFETCH_CHILDREN(tmp, field);			\
+		comp = cmp(elm, tmp);					\
+		if (comp < 0)						\
+			tmp = RB_LEFT(tmp, field);			\
+		else if (comp > 0)					\
+			tmp = RB_RIGHT(tmp, field);			\
+		else {							\
+			tmp->cfield++;					\
+			return (tmp);					\
+		}							\
+	}								\
+	return (NULL);							\
+}									\
+									\
+/*									\
+ * Stores the nodes of the tree in elms, in increasing order, and	\
+ * rebuilds it by weight, if it has no more than n nodes.  Returns the	\
+ * number of nodes.							\
+ */									\
+attr size_t								\
+name##_RB_REBUILD(struct name *head, struct type **elms, size_t n)	\
+{									\
+	struct type *elm;						\
+	size_t count = 0;						\
+									\
+	for (elm = RB_MIN(name, head); elm != NULL;			\
+	    elm = name##_RB_NEXT(elm)) {				\
+		if (count < n)						\
+			elms[count] = elm;				\
+		count++;						\
+	}								\
+	if (count <= n) {						\
+		RB_ROOT(head) = name##_RB_WEIGHT_REBUILD(elms, count);	\
+		name##_RB_CACHE_RESET(head);				\
+	}								\
+	return (count);							\
+}
+
+/*
+ * Join and split.  The functions generated by RB_GENERATE_JOIN concatenate
+ * two trees around a pivot, every element of the first preceding the pivot
+ * and every element of the second following it, and cut a tree at a key
+ * into the elements less than it and the rest.  Both work on subtree ranks,
+ * so they take O(lg n) time, instead of the O(k lg n) of moving k elements
+ * one at a time.  For an augmented tree, each join walks the augmentation
+ * update to the root, so a split takes O(lg^2 n) time.
+ */
+#define RB_PROTOTYPE_JOIN(name, type, field, cmp)			\
+	RB_PROTOTYPE_JOIN_INTERNAL(name, type, field, cmp,)
+#define RB_PROTOTYPE_JOIN_STATIC(name, type, field, cmp)		\
+	RB_PROTOTYPE_JOIN_INTERNAL(name, type, field, cmp, __unused static)
+#define RB_PROTOTYPE_JOIN_INTERNAL(name, type, field, cmp, attr)	\
+	attr int name##_RB_ROOT_RANK(struct type *);			\
+	attr struct type *name##_RB_JOIN_RANKED(struct type *, int,	\
+	    struct type *, struct type *, int, int *);			\
+	attr struct type *name##_RB_SPLIT_RANKED(struct type *, int,	\
+	    struct type *, struct type **, int *, struct type **, int *); \
+	attr void name##_RB_JOIN(struct name *, struct type *,		\
+	    struct name *);						\
+	attr void name##_RB_SPLIT(struct name *, struct type *,		\
+	    struct name *, struct name *);
+
+#define RB_GENERATE_JOIN(name, type, field, cmp)			\
+	RB_GENERATE_JOIN_INTERNAL(name, type, field, cmp,)
+#define RB_GENERATE_JOIN_STATIC(name, type, field, cmp)			\
+	RB_GENERATE_JOIN_INTERNAL(name, type, field, cmp, __unused static)
+#define RB_GENERATE_JOIN_INTERNAL(name, type, field, cmp, attr)		\
+/* Returns the rank of the subtree rooted at elm, 0 if elm is NULL */	\
+attr int								\
+name##_RB_ROOT_RANK(struct type *elm)					\
+{									\
+	int rank = 0;							\
+									\
+	while (elm != NULL) {						\
+		rank += (_RB_BITSUP(elm, field) & _RB_L) ? 2 : 1;	\
+		elm = RB_LEFT(elm, field);				\
+	}								\
+	return (rank);							\
+}									\
+									\
+/*									\
+ * Joins the detached subtrees left and right, of ranks lrank and rrank, \
+ * with elm between them.  Returns the new root, and stores its rank in	\
+ * *rankp.  If the ranks differ by more than one, elm replaces the first \
+ * node on the inner spine of the taller subtree whose rank is within	\
+ * one of the shorter subtree, taking that node and the shorter subtree	\
+ * as children, and is rebalanced upward like a newly inserted leaf.	\
+ */									\
+attr struct type *							\
+name##_RB_JOIN_RANKED(struct type *left, int lrank, struct type *elm,	\
+    struct type *right, int rrank, int *rankp)				\
+{									\
+	struct name head;						\
+	struct type *root, *small, *parent, *child, *tmp;		\
+	__uintptr_t dir, rootbits;					\
+	int rank, srank, crank;						\
+									\
+	if (lrank - rrank > 1) {					\
+		root = left; rank = lrank;				\
+		small = right; srank = rrank;				\
+		dir = _RB_R;						\
+	} else if (rrank - lrank > 1) {					\
+		root = right; rank = rrank;				\
+		small = left; srank = lrank;				\
+		dir = _RB_L;						\
+	} else {							\
+		RB_SET(elm, NULL, field);				\
+		if ((RB_LEFT(elm, field) = left) != NULL)		\
+			RB_SET_PARENT(left, elm, field);		\
+		if ((RB_RIGHT(elm, field) = right) != NULL)		\
+			RB_SET_PARENT(right, elm, field);		\
+		if (lrank < rrank)					\
+			_RB_BITSUP(elm, field) |= _RB_L;		\
+		else if (rrank < lrank)					\
+			_RB_BITSUP(elm, field) |= _RB_R;		\
+		*rankp = (lrank < rrank ? rrank : lrank) + 1;		\
+		(void)_RB_AUGMENT_CHECK(name, elm);			\
+		return (elm);						\
+	}								\
+	parent = NULL;							\
+	child = root;							\
+	crank = rank;							\
+	while (crank > srank + 1) {					\
+		parent = child;						\
+		crank -= (_RB_BITSUP(child, field) & dir) ? 2 : 1;	\
+		child = _RB_LINK(child, dir, field);			\
+	}								\
+	RB_SET(elm, parent, field);					\
+	if ((_RB_LINK(elm, dir ^ _RB_LR, field) = child) != NULL)	\
+		RB_SET_PARENT(child, elm, field);			\
+	if ((_RB_LINK(elm, dir, field) = small) != NULL)		\
+		RB_SET_PARENT(small, elm, field);			\
+	if (srank < crank)						\
+		_RB_BITSUP(elm, field) |= dir;				\
+	_RB_LINK(parent, dir, field) = elm;				\
+	(void)_RB_AUGMENT_CHECK(name, elm);				\
+	/*								\
+	 * elm has rank crank + 1, one more than the node it replaced,	\
+	 * so its parent is out of balance exactly as after an insert.	\
+	 * The rank of the whole tree grew if and only if the root was	\
+	 * reached with both of its edges short.			\
+	 */								\
+	RB_ROOT(&head) = root;						\
+	rootbits = _RB_BITSUP(root, field) & _RB_LR;			\
+	tmp = name##_RB_INSERT_COLOR(&head, parent, elm);		\
+	if (RB_ROOT(&head) == root && rootbits == 0 &&			\
+	    (_RB_BITSUP(root, field) & _RB_LR) != 0)			\
+		rank++;							\
+	_RB_AUGMENT_WALK(name, elm, tmp, field);			\
+	if (tmp != NULL)						\
+		(void)_RB_AUGMENT_CHECK(name, tmp);			\
+	*rankp = rank;							\
+	return (RB_ROOT(&head));					\
+}									\
+									\
+/*									\
+ * Splits the subtree rooted at root, of the given rank, into the	\
+ * elements less than elm and those greater, stored in *ltp and *gtp	\
+ * with their ranks.  Returns the element equal to elm, detached, or	\
+ * NULL.  Each node on the search path is joined, with the subtree it	\
+ * keeps on the far side of the path, onto the result on that side,	\
+ * working up from the bottom so that the joined ranks keep increasing. \
+ */									\
+attr struct type *							\
+name##_RB_SPLIT_RANKED(struct type *root, int rank, struct type *elm,	\
+    struct type **ltp, int *ltrankp, struct type **gtp, int *gtrankp)	\
+{									\
+	struct type *tmp, *parent, *next, *lt, *gt, *sub;		\
+	__uintptr_t dir, nextdir;					\
+	int comp, ltrank, gtrank, subrank;				\
+									\
+	tmp = root;							\
+	parent = NULL;							\
+	dir = 0;							\
+	while (tmp != NULL) {						\
+		comp = cmp(elm, tmp);					\
+		if (comp == 0)						\
+			break;						\
+		parent = tmp;						\
+		dir = comp < 0 ? _RB_L : _RB_R;				\
+		rank -= (_RB_BITSUP(tmp, field) & dir) ? 2 : 1;		\
+		tmp = _RB_LINK(tmp, dir, field);			\
+	}								\
+	lt = gt = NULL;							\
+	ltrank = gtrank = 0;						\
+	if (tmp != NULL) {						\
+		if ((lt = RB_LEFT(tmp, field)) != NULL) {		\
+			ltrank = rank -					\
+			    ((_RB_BITSUP(tmp, field) & _RB_L) ? 2 : 1);	\
+			RB_SET_PARENT(lt, NULL, field);			\
+		}							\
+		if ((gt = RB_RIGHT(tmp, field)) != NULL) {		\
+			gtrank = rank -					\
+			    ((_RB_BITSUP(tmp, field) & _RB_R) ? 2 : 1);	\
+			RB_SET_PARENT(gt, NULL, field);			\
+		}							\
+	}								\
+	while (parent != NULL) {					\
+		next = RB_PARENT(parent, field);			\
+		nextdir = next != NULL && RB_RIGHT(next, field) == parent ? \
+		    _RB_R : _RB_L;					\
+		rank += (_RB_BITSUP(parent, field) & dir) ? 2 : 1;	\
+		sub = _RB_LINK(parent, dir ^ _RB_LR, field);		\
+		subrank = rank -					\
+		    ((_RB_BITSUP(parent, field) & (dir ^ _RB_LR)) ? 2 : 1); \
+		if (sub != NULL)					\
+			RB_SET_PARENT(sub, NULL, field);		\
+		if (dir == _RB_L)					\
+			gt = name##_RB_JOIN_RANKED(gt, gtrank, parent,	\
+			    sub, subrank, &gtrank);			\
+		else							\
+			lt = name##_RB_JOIN_RANKED(sub, subrank, parent, \
+			    lt, ltrank, &ltrank);			\
+		dir = nextdir;						\
+		parent = next;						\
+	}								\
+	*ltp = lt;							\
+	*ltrankp = ltrank;						\
+	*gtp = gt;							\
+	*gtrankp = gtrank;						\
+	return (tmp);							\
+}									\
+									\
+/*									\
+ * Appends elm, and then the elements of right, to left; right is left	\
+ * empty.								\
+ */									\
+attr void								\
+name##_RB_JOIN(struct name *left, struct type *elm, struct name *right)	\
+{									\
+	int rank;							\
+									\
+	name##_RB_PREPARE(elm);						\
+	RB_ROOT(left) = name##_RB_JOIN_RANKED(RB_ROOT(left),		\
+	    name##_RB_ROOT_RANK(RB_ROOT(left)), elm, RB_ROOT(right),	\
+	    name##_RB_ROOT_RANK(RB_ROOT(right)), &rank);		\
+	RB_INIT(right);							\
+	name##_RB_CACHE_RESET(left);					\
+}									\
+									\
+/*									\
+ * Moves the elements of head less than elm to lt, and the rest to ge.	\
+ * Either may be head itself.						\
+ */									\
+attr void								\
+name##_RB_SPLIT(struct name *head, struct type *elm, struct name *lt,	\
+    struct name *ge)							\
+{									\
+	struct type *found, *ltroot, *geroot;				\
+	int ltrank, gerank;						\
+									\
+	found = name##_RB_SPLIT_RANKED(RB_ROOT(head),			\
+	    name##_RB_ROOT_RANK(RB_ROOT(head)), elm,			\
+	    &ltroot, &ltrank, &geroot, &gerank);			\
+	if (found != NULL)						\
+		geroot = name##_RB_JOIN_RANKED(NULL, 0, found, geroot,	\
+		    gerank, &gerank);					\
+	RB_INIT(head);							\
+	RB_ROOT(lt) = ltroot;						\
+	RB_ROOT(ge) = geroot;						\
+	name##_RB_CACHE_RESET(lt);					\
+	name##_RB_CACHE_RESET(ge);					\
+}
+
+/*
+ * Set operations.  The functions generated by RB_GENERATE_SETOPS, which
+ * needs RB_GENERATE_JOIN for the same tree, combine two trees by splitting
+ * the second at the root of the first, recursing on the two halves, and
+ * joining the results.  With m and n elements, m <= n, they do
+ * O(m lg(n/m + 1)) work.  The two recursive calls touch disjoint nodes, so
+ * a caller may supply fork, which must run run(left) and run(right),
+ * possibly concurrently, and return once both have finished.  It is called
+ * only for subtrees of the first tree with rank at least cutoff; a subtree
+ * of rank r has between about 2^(r/2) and 2^r elements.  No node moves
+ * between trees other than as described for each operation:
+ *
+ * RB_SET_UNION moves every element of b into a, except those with a key
+ * already in a, which go to rest.  b is left empty.
+ *
+ * RB_SET_INTERSECT moves the elements of a with no equal key in b to rest.
+ * b is left unchanged.
+ *
+ * RB_SET_DIFFERENCE moves the elements of a with an equal key in b to rest.
+ * b is left unchanged.
+ */
+#define RB_SET_UNION		0
+#define RB_SET_INTERSECT	1
+#define RB_SET_DIFFERENCE	2
+
+#define RB_PROTOTYPE_SETOPS(name, type, field, cmp)			\
+	RB_PROTOTYPE_SETOPS_INTERNAL(name, type, field, cmp,)
+#define RB_PROTOTYPE_SETOPS_STATIC(name, type, field, cmp)		\
+	RB_PROTOTYPE_SETOPS_INTERNAL(name, type, field, cmp, __unused static)
+#define RB_PROTOTYPE_SETOPS_INTERNAL(name, type, field, cmp, attr)	\
+	struct name##_RB_SETOP_TASK {					\
+		struct type *a, *b, *rest;				\
+		int arank, brank, restrank;				\
+		int op, cutoff;						\
+		void (*fork)(void (*)(void *), void *, void *, void *);	\
+		void *arg;						\
+	};								\
+	attr struct type *name##_RB_CONCAT_RANKED(struct type *, int,	\
+	    struct type *, int, int *);					\
+	attr void name##_RB_SETOP_RUN(void *);				\
+	attr void name##_RB_SETOP(struct name *, struct name *,		\
+	    struct name *, int,						\
+	    void (*)(void (*)(void *), void *, void *, void *), void *, int);
+
+#define RB_GENERATE_SETOPS(name, type, field, cmp)			\
+	RB_GENERATE_SETOPS_INTERNAL(name, type, field, cmp,)
+#define RB_GENERATE_SETOPS_STATIC(name, type, field, cmp)		\
+	RB_GENERATE_SETOPS_INTERNAL(name, type, field, cmp, __unused static)
+#define RB_GENERATE_SETOPS_INTERNAL(name, type, field, cmp, attr)	\
+/* Joins the detached subtrees left and right, with no element between */ \
+attr struct type *							\
+name##_RB_CONCAT_RANKED(struct type *left, int lrank, struct type *right, \
+    int rrank, int *rankp)						\
+{									\
+	struct type *max, *gt;						\
+	int gtrank;							\
+									\
+	if (left == NULL || right == NULL) {				\
+		*rankp = left == NULL ? rrank : lrank;			\
+		return (left == NULL ? right : left);			\
+	}								\
+	for (max = left; RB_RIGHT(max, field) != NULL;			\
+	    max = RB_RIGHT(max, field))					\
+		continue;						\
+	max = name##_RB_SPLIT_RANKED(left, lrank, max, &left, &lrank,	\
+	    &gt, &gtrank);						\
+	return (name##_RB_JOIN_RANKED(left, lrank, max, right, rrank,	\
+	    rankp));							\
+}									\
+									\
+/* Runs one set operation task, splitting it in two around a->root */	\
+attr void								\
+name##_RB_SETOP_RUN(void *v)						\
+{									\
+	struct name##_RB_SETOP_TASK *task = v, sub[2];			\
+	struct type *root = task->a, *eq;				\
+	__uintptr_t dir;						\
+	int i;								\
+									\
+	task->rest = NULL;						\
+	task->restrank = 0;						\
+	if (task->a == NULL || task->b == NULL) {			\
+		if (task->op == RB_SET_UNION && task->a == NULL) {	\
+			task->a = task->b;				\
+			task->arank = task->brank;			\
+			task->b = NULL;					\
+			task->brank = 0;				\
+		} else if (task->op == RB_SET_INTERSECT) {		\
+			task->rest = task->a;				\
+			task->restrank = task->arank;			\
+			task->a = NULL;					\
+			task->arank = 0;				\
+		}							\
+		return;							\
+	}								\
+	for (i = 0; i < 2; i++) {					\
+		dir = i == 0 ? _RB_L : _RB_R;				\
+		sub[i] = *task;						\
+		sub[i].a = _RB_LINK(root, dir, field);			\
+		sub[i].arank = task->arank -				\
+		    ((_RB_BITSUP(root, field) & dir) ? 2 : 1);		\
+		if (sub[i].a != NULL)					\
+			RB_SET_PARENT(sub[i].a, NULL, field);		\
+	}								\
+	eq = name##_RB_SPLIT_RANKED(task->b, task->brank, root,		\
+	    &sub[0].b, &sub[0].brank, &sub[1].b, &sub[1].brank);	\
+	if (task->fork != NULL && task->arank >= task->cutoff)		\
+		task->fork(name##_RB_SETOP_RUN, &sub[0], &sub[1], task->arg); \
+	else {								\
+		name##_RB_SETOP_RUN(&sub[0]);				\
+		name##_RB_SETOP_RUN(&sub[1]);				\
+	}								\
+	if (task->op == RB_SET_UNION) {					\
+		/* sub[i].b are now empty, and eq is a duplicate */	\
+		task->b = NULL;						\
+		task->brank = 0;					\
+		task->a = name##_RB_JOIN_RANKED(sub[0].a, sub[0].arank,	\
+		    root, sub[1].a, sub[1].arank, &task->arank);	\
+		task->rest = eq == NULL ?				\
+		    name##_RB_CONCAT_RANKED(sub[0].rest, sub[0].restrank, \
+		    sub[1].rest, sub[1].restrank, &task->restrank) :	\
+		    name##_RB_JOIN_RANKED(sub[0].rest, sub[0].restrank,	\
+		    eq, sub[1].rest, sub[1].restrank, &task->restrank);	\
+		return;							\
+	}								\
+	if ((eq != NULL) == (task->op == RB_SET_INTERSECT)) {		\
+		task->a = name##_RB_JOIN_RANKED(sub[0].a, sub[0].arank,	\
+		    root, sub[1].a, sub[1].arank, &task->arank);	\
+		task->rest = name##_RB_CONCAT_RANKED(sub[0].rest,	\
+		    sub[0].restrank, sub[1].rest, sub[1].restrank,	\
+		    &task->restrank);					\
+	} else {							\
+		task->a = name##_RB_CONCAT_RANKED(sub[0].a, sub[0].arank, \
+		    sub[1].a, sub[1].arank, &task->arank);		\
+		task->rest = name##_RB_JOIN_RANKED(sub[0].rest,		\
+		    sub[0].restrank, root, sub[1].rest, sub[1].restrank, \
+		    &task->restrank);					\
+	}								\
+	task->b = eq == NULL ?						\
+	    name##_RB_CONCAT_RANKED(sub[0].b, sub[0].brank, sub[1].b,	\
+	    sub[1].brank, &task->brank) :				\
+	    name##_RB_JOIN_RANKED(sub[0].b, sub[0].brank, eq, sub[1].b,	\
+	    sub[1].brank, &task->brank);				\
+}									\
+									\
+/*									\
+ * Applies op, one of RB_SET_*, to a and b, moving the elements that	\
+ * op removes to rest, which must be empty.  fork may be NULL.		\
+ */									\
+attr void								\
+name##_RB_SETOP(struct name *a, struct name *b, struct name *rest, int op, \
+    void (*fork)(void (*)(void *), void *, void *, void *), void *arg,	\
+    int cutoff)								\
+{									\
+	struct name##_RB_SETOP_TASK task;				\
+									\
+	task.a = RB_ROOT(a);						\
+	task.arank = name##_RB_ROOT_RANK(task.a);			\
+	task.b = RB_ROOT(b);						\
+	task.brank = name##_RB_ROOT_RANK(task.b);			\
+	task.op = op;							\
+	task.cutoff = cutoff;						\
+	task.fork = fork;						\
+	task.arg = arg;							\
+	name##_RB_SETOP_RUN(&task);					\
+	RB_ROOT(a) = task.a;						\
+	RB_ROOT(b) = task.b;						\
+	RB_ROOT(rest) = task.rest;					\
+	name##_RB_CACHE_RESET(a);					\
+	name##_RB_CACHE_RESET(b);					\
+	name##_RB_CACHE_RESET(rest);					\
+}
+
+/*
+ * Range iteration.  RB_GENERATE_RANGE generates RB_PFIND, the counterpart
+ * of RB_NFIND, and functions that find the ends of the closed range
+ * [lo, hi] with one search each, so that RB_FOREACH_RANGE and
+ * RB_FOREACH_REVERSE_RANGE step through it with RB_NEXT or RB_PREV and
+ * no further calls to cmp.
+ */
+#define RB_PROTOTYPE_RANGE(name, type, field, cmp)			\
+	RB_PROTOTYPE_RANGE_INTERNAL(name, type, field, cmp,)
+#define RB_PROTOTYPE_RANGE_STATIC(name, type, field, cmp)		\
+	RB_PROTOTYPE_RANGE_INTERNAL(name, type, field, cmp, __unused static)
+#define RB_PROTOTYPE_RANGE_INTERNAL(name, type, field, cmp, attr)	\
+	RB_PROTOTYPE_PFIND(name, type, attr);				\
+	attr struct type *name##_RB_RANGE(struct name *, struct type *,	\
+	    struct type *, struct type **);				\
+	attr struct type *name##_RB_RANGE_REVERSE(struct name *,	\
+	    struct type *, struct type *, struct type **);		\
+	attr size_t name##_RB_RANGE_COLLECT(struct name *, struct type *, \
+	    struct type *, struct type **, size_t);
+
+#define RB_GENERATE_RANGE(name, type, field, cmp)			\
+	RB_GENERATE_RANGE_INTERNAL(name, type, field, cmp,)
+#define RB_GENERATE_RANGE_STATIC(name, type, field, cmp)		\
+	RB_GENERATE_RANGE_INTERNAL(name, type, field, cmp, __unused static)
+#define RB_GENERATE_RANGE_INTERNAL(name, type, field, cmp, attr)	\
+	RB_GENERATE_PFIND(name, type, field, cmp, attr)			\
+									\
+/*									\
+ * Stores the first node of [lo, hi] in *firstp, and returns the first	\
+ * node after hi, where an in-order walk from *firstp must stop.	\
+ */									\
+attr struct type *							\
+name##_RB_RANGE(struct name *head, struct type *lo, struct type *hi,	\
+    struct type **firstp)						\
+{									\
+	struct type *tmp = RB_ROOT(head);				\
+	struct type *stop = NULL;					\
+									\
+	while (tmp) {							\
+		if (cmp(hi, tmp) < 0) {					\
+			stop = tmp;					\
+			tmp = RB_LEFT(tmp, field);			\
+		} else							\
+			tmp = RB_RIGHT(tmp, field);			\
+	}								\
+	*firstp = cmp(lo, hi) > 0 ? stop : name##_RB_NFIND(head, lo);	\
+	return (stop);							\
+}									\
+									\
+/*									\
+ * Stores the last node of [lo, hi] in *firstp, and returns the last	\
+ * node before lo, where a reverse walk from *firstp must stop.		\
+ */									\
+attr struct type *							\
+name##_RB_RANGE_REVERSE(struct name *head, struct type *lo,		\
+    struct type *hi, struct type **firstp)				\
+{									\
+	struct type *tmp = RB_ROOT(head);				\
+	struct type *stop = NULL;					\
+									\
+	while (tmp) {							\
+		if (cmp(lo, tmp) > 0) {					\
+			stop = tmp;					\
+			tmp = RB_RIGHT(tmp, field);			\
+		} else							\
+			tmp = RB_LEFT(tmp, field);			\
+	}								\
+	*firstp = cmp(lo, hi) > 0 ? stop : name##_RB_PFIND(head, hi);	\
+	return (stop);							\
+}									\
+									\
+/* Stores up to max nodes of [lo, hi] in out, in order, and counts them */ \
+attr size_t								\
+name##_RB_RANGE_COLLECT(struct name *head, struct type *lo,		\
+    struct type *hi, struct type **out, size_t max)			\
+{									\
+	struct type *tmp;						\
+	size_t n = 0;							\
+									\
+	RB_FOREACH_RANGE(tmp, name, head, lo, hi) {			\
+		if (n == max)						\
+			break;						\
+		out[n++] = tmp;						\
+	}								\
+	return (n);							\
+}
+
+/*
+ * Frozen trees.  A tree that is built once and then only searched can be
+ * copied by RB_FREEZE into an array of keys in Eytzinger order, the order
+ * of a breadth-first walk of a complete tree, where the children of entry
+ * i are entries 2i+1 and 2i+2, with a parallel array of node pointers.
+ * The first levels share a few cache lines, and the search computes each
+ * next index with no branch, fetching ahead the descendants as many levels
+ * down as fill one RB_CACHE_LINE, so lookups stream through memory instead
+ * of chasing links.  The keys are read from keyfield and compared with <,
+ * so the tree must be ordered by keyfield.  The arrays do not change when
+ * the tree does.
+ */
+#ifndef RB_CACHE_LINE
+#define RB_CACHE_LINE	64
+#endif
+
+#define RB_PROTOTYPE_FREEZE(name, type, field, keyfield)		\
+	RB_PROTOTYPE_FREEZE_INTERNAL(name, type, field, keyfield,)
+#define RB_PROTOTYPE_FREEZE_STATIC(name, type, field, keyfield)		\
+	RB_PROTOTYPE_FREEZE_INTERNAL(name, type, field, keyfield,	\
+	    __unused static)
+#define RB_PROTOTYPE_FREEZE_INTERNAL(name, type, field, keyfield, attr) \
+	attr struct type *name##_RB_FREEZE_FILL(struct type *, size_t,	\
+	    size_t, _RB_FIELD_TYPE(type, keyfield) *, struct type **);	\
+	attr size_t name##_RB_FREEZE(struct name *,			\
+	    _RB_FIELD_TYPE(type, keyfield) *, struct type **, size_t);	\
+	attr size_t name##_RB_FROZEN_LOWER_BOUND(			\
+	    const _RB_FIELD_TYPE(type, keyfield) *, size_t,		\
+	    _RB_FIELD_TYPE(type, keyfield));				\
+	attr struct type *name##_RB_FROZEN_FIND(			\
+	    const _RB_FIELD_TYPE(type, keyfield) *, struct type **,	\
+	    size_t, _RB_FIELD_TYPE(type, keyfield));			\
+	attr struct type *name##_RB_FROZEN_NFIND(			\
+	    const _RB_FIELD_TYPE(type, keyfield) *, struct type **,	\
+	    size_t, _RB_FIELD_TYPE(type, keyfield));
+
+#define RB_GENERATE_FREEZE(name, type, field, keyfield)			\
+	RB_GENERATE_FREEZE_INTERNAL(name, type, field, keyfield,)
+#define RB_GENERATE_FREEZE_STATIC(name, type, field, keyfield)		\
+	RB_GENERATE_FREEZE_INTERNAL(name, type, field, keyfield,	\
+	    __unused static)
+#define RB_GENERATE_FREEZE_INTERNAL(name, type, field, keyfield, attr)	\
+/*									\
+ * Fills the subtree of Eytzinger entry i, numbered from 1, with elm	\
+ * and the nodes after it, in order.  Returns the next node to place.	\
+ */									\
+attr struct type *							\
+name##_RB_FREEZE_FILL(struct type *elm, size_t i, size_t n,		\
+    _RB_FIELD_TYPE(type, keyfield) *keys, struct type **elms)		\
+{									\
+	if (i > n)							\
+		return (elm);						\
+	elm = name##_RB_FREEZE_FILL(elm, 2 * i, n, keys, elms);		\
+	keys[i - 1] = elm->keyfield;					\
+	if (elms != NULL)						\
+		elms[i - 1] = elm;					\
+	return (name##_RB_FREEZE_FILL(name##_RB_NEXT(elm), 2 * i + 1, n, \
+	    keys, elms));						\
+}									\
+									\
+/*									\
+ * Returns the number of nodes in the tree.  If it is at most n, also	\
+ * stores their keys in keys, and if elms is not NULL, the nodes in	\
+ * elms, in Eytzinger order.						\
+ */									\
+attr size_t								\
+name##_RB_FREEZE(struct name *head, _RB_FIELD_TYPE(type, keyfield) *keys, \
+    struct type **elms, size_t n)					\
+{									\
+	struct type *elm;						\
+	size_t count = 0;						\
+									\
+	RB_FOREACH(elm, name, head)					\
+		count++;						\
+	if (count <= n)							\
+		name##_RB_FREEZE_FILL(RB_MIN(name, head), 1, count, keys, \
+		    elms);						\
+	return (count);							\
+}									\
+									\
+/* Returns the index of the first key not less than key, or n if none */ \
+attr size_t								\
+name##_RB_FROZEN_LOWER_BOUND(const _RB_FIELD_TYPE(type, keyfield) *keys, \
+    size_t n, _RB_FIELD_TYPE(type, keyfield) key)			\
+{									\
+	size_t i = 1, ahead, next;					\
+									\
+	/* The descendants of i, levels down, start at ahead * i */	\
+	for (ahead = 1; 2 * ahead * sizeof(*keys) <= RB_CACHE_LINE;	\
+	    ahead *= 2)							\
+		;							\
+	while (i <= n) {						\
+		next = ahead * i;					\
+		_RB_PREFETCH(keys + (next < n ? next : n) - 1);		\
+		i = 2 * i + (keys[i - 1] < key);			\
+	}								\
+	/* Undo the right turns, and the last left turn */		\
+	while (i & 1)							\
+		i >>= 1;						\
+	i >>= 1;							\
+	return (i == 0 ? n : i - 1);					\
+}									\
+									\
+/* Finds the node with the given key in a frozen tree */		\
+attr struct type *							\
+name##_RB_FROZEN_FIND(const _RB_FIELD_TYPE(type, keyfield) *keys,	\
+    struct type **elms, size_t n, _RB_FIELD_TYPE(type, keyfield) key)	\
+{									\
+	size_t i = name##_RB_FROZEN_LOWER_BOUND(keys, n, key);		\
+									\
+	return (i < n && !(key < keys[i]) ? elms[i] : NULL);		\
+}									\
+									\
+/* Finds the first node with a key not less than key */			\
+attr struct type *							\
+name##_RB_FROZEN_NFIND(const _RB_FIELD_TYPE(type, keyfield) *keys,	\
+    struct type **elms, size_t n, _RB_FIELD_TYPE(type, keyfield) key)	\
+{									\
+	size_t i = name##_RB_FROZEN_LOWER_BOUND(keys, n, key);		\
+									\
+	return (i < n ? elms[i] : NULL);				\
+}
+
+/*
+ * Key lookups.  The functions generated by RB_GENERATE_KEY search by a key
+ * value rather than by a node, so no dummy node need be built.  key_cmp is
+ * called as key_cmp(key, elm) and must order keys as cmp orders nodes.
+ * RB_GENERATE_KEY_FIELD compares an arithmetic keyfield of the nodes with
+ * < and >, which compilers inline into the descent.
+ */
+#define RB_PROTOTYPE_KEY(name, type, field, key_type)			\
+	RB_PROTOTYPE_KEY_INTERNAL(name, type, field, key_type,)
+#define RB_PROTOTYPE_KEY_STATIC(name, type, field, key_type)		\
+	RB_PROTOTYPE_KEY_INTERNAL(name, type, field, key_type, __unused static)
+#define RB_PROTOTYPE_KEY_INTERNAL(name, type, field, key_type, attr)	\
+	attr struct type *name##_RB_FIND_KEY(struct name *, key_type);	\
+	attr struct type *name##_RB_NFIND_KEY(struct name *, key_type);	\
+	attr struct type *name##_RB_PFIND_KEY(struct name *, key_type);
+#define RB_PROTOTYPE_KEY_FIELD(name, type, field, keyfield)		\
+	RB_PROTOTYPE_KEY(name, type, field, _RB_FIELD_TYPE(type, keyfield))
+#define RB_PROTOTYPE_KEY_FIELD_STATIC(name, type, field, keyfield)	\
+	RB_PROTOTYPE_KEY_STATIC(name, type, field,			\
+	    _RB_FIELD_TYPE(type, keyfield))
+
+#define RB_GENERATE_KEY(name, type, field, key_type, key_cmp)		\
+	RB_GENERATE_KEY_INTERNAL(name, type, field, key_type, key_cmp,)
+#define RB_GENERATE_KEY_STATIC(name, type, field, key_type, key_cmp)	\
+	RB_GENERATE_KEY_INTERNAL(name, type, field, key_type, key_cmp,	\
+	    __unused static)
+#define RB_GENERATE_KEY_FIELD(name, type, field, keyfield)		\
+	_RB_GENERATE_KEY_FIELD(name, type, field, keyfield,)
+#define RB_GENERATE_KEY_FIELD_STATIC(name, type, field, keyfield)	\
+	_RB_GENERATE_KEY_FIELD(name, type, field, keyfield, __unused static)
+#define _RB_GENERATE_KEY_FIELD(name, type, field, keyfield, attr)	\
+static __inline int							\
+name##_RB_KEY_CMP(_RB_FIELD_TYPE(type, keyfield) key, struct type *elm)	\
+{									\
+	return ((key > elm->keyfield) - (key < elm->keyfield));		\
+}									\
+RB_GENERATE_KEY_INTERNAL(name, type, field,				\
+    _RB_FIELD_TYPE(type, keyfield), name##_RB_KEY_CMP, attr)
+#define RB_GENERATE_KEY_INTERNAL(name, type, field, key_type, key_cmp, attr) \
+/* Finds the node with the given key */					\
+attr struct type *							\
+name##_RB_FIND_KEY(struct name *head, key_type key)			\
+{									\
+	struct type *tmp = RB_ROOT(head);				\
+	__typeof(key_cmp(key, NULL)) comp;				\
+	while (tmp) {							\
+		_RB_PREFETCH_CHILDREN(tmp, field);			\
+		comp = key_cmp(key, tmp);				\
+		if (comp < 0)						\
+			tmp = RB_LEFT(tmp, field);			\
+		else if (comp > 0)					\
+			tmp = RB_RIGHT(tmp, field);			\
+		else							\
+			return (tmp);					\
+	}								\
+	return (NULL);							\
+}									\
+									\
+/* Finds the first node greater than or equal to the key */		\
+attr struct type *							\
+name##_RB_NFIND_KEY(struct name *head, key_type key)			\
+{									\
+	struct type *tmp = RB_ROOT(head);				\
+	struct type *res = NULL;					\
+	__typeof(key_cmp(key, NULL)) comp;				\
+	while (tmp) {							\
+		_RB_PREFETCH_CHILDREN(tmp, field);			\
+		comp = key_cmp(key, tmp);				\
+		if (comp < 0) {						\
+			res = tmp;					\
+			tmp = RB_LEFT(tmp, field);			\
+		}							\
+		else if (comp > 0)					\
+			tmp = RB_RIGHT(tmp, field);			\
+		else							\
+			return (tmp);					\
+	}								\
+	return (res);							\
+}									\
+									\
+/* Finds the last node less than or equal to the key */			\
+attr struct type *							\
+name##_RB_PFIND_KEY(struct name *head, key_type key)			\
+{									\
+	struct type *tmp = RB_ROOT(head);				\
+	struct type *res = NULL;					\
+	__typeof(key_cmp(key, NULL)) comp;				\
+	while (tmp) {							\
+		_RB_PREFETCH_CHILDREN(tmp, field);			\
+		comp = key_cmp(key, tmp);				\
+		if (comp > 0) {						\
+			res = tmp;					\
+			tmp = RB_RIGHT(tmp, field);			\
+		}							\
+		else if (comp < 0)					\
+			tmp = RB_LEFT(tmp, field);			\
+		else							\
+			return (tmp);					\
+	}								\
+	return (res);							\
+}
+
+/*
+ * Hinted search.  RB_FIND_FROM and RB_INSERT_HINT start from hint, a node
+ * of the tree expected to be near elm, instead of from the root.  They
+ * climb from hint until elm falls between the ancestors bounding the
+ * subtree reached, comparing only at those ancestors, and then descend
+ * into it.  One search may climb nearly to the root even when elm is next
+ * to hint, but when each hint is the node the previous search returned,
+ * the cost amortized over the run grows with the log of the distance
+ * between successive keys rather than of the size of the tree.  A NULL
+ * hint starts from the root.
+ */
+#define RB_PROTOTYPE_HINT(name, type, field, cmp)			\
+	RB_PROTOTYPE_HINT_INTERNAL(name, type, field, cmp,)
+#define RB_PROTOTYPE_HINT_STATIC(name, type, field, cmp)		\
+	RB_PROTOTYPE_HINT_INTERNAL(name, type, field, cmp, __unused static)
+#define RB_PROTOTYPE_HINT_INTERNAL(name, type, field, cmp, attr)	\
+	attr struct type *name##_RB_FIND_FROM(struct name *,		\
+	    struct type *, struct type *);				\
+	attr struct type *name##_RB_INSERT_HINT(struct name *,		\
+	    struct type *, struct type *);
+
+#define RB_GENERATE_HINT(name, type, field, cmp)			\
+	RB_GENERATE_HINT_INTERNAL(name, type, field, cmp,)
+#define RB_GENERATE_HINT_STATIC(name, type, field, cmp)			\
+	RB_GENERATE_HINT_INTERNAL(name, type, field, cmp, __unused static)
+#define RB_GENERATE_HINT_INTERNAL(name, type, field, cmp, attr)		\
+/* Returns the lowest ancestor of hint whose subtree would hold elm */	\
+static __unused __inline struct type *					\
+name##_RB_CLIMB(struct name *head, struct type *hint, struct type *elm)	\
+{									\
+	struct type *from, *parent;					\
+	__typeof(cmp(NULL, NULL)) comp;					\
+	__uintptr_t dir;						\
+									\
+	if (hint == NULL)						\
+		return (RB_ROOT(head));					\
+	if ((comp = cmp(elm, hint)) == 0)				\
+		return (hint);						\
+	dir = comp < 0 ? _RB_L : _RB_R;					\
+	/*								\
+	 * Climb to the first ancestor on the far side of elm.  Those	\
+	 * passed on the near side need no comparison, and the descent	\
+	 * starts from the last one compared, not the top of the climb.	\
+	 */								\
+	from = hint;							\
+	while ((parent = RB_PARENT(hint, field)) != NULL) {		\
+		if (_RB_LINK(parent, dir, field) != hint) {		\
+			comp = cmp(elm, parent);			\
+			if (comp == 0)					\
+				return (parent);			\
+			if ((comp < 0) != (dir == _RB_L))		\
+				break;					\
+			from = parent;					\
+		}							\
+		hint = parent;						\
+	}								\
+	return (from);							\
+}									\
+									\
+/* Finds the node with the same key as elm, searching from hint */	\
+attr struct type *							\
+name##_RB_FIND_FROM(struct name *head, struct type *hint,		\
+    struct type *elm)							\
+{									\
+	struct type *tmp;						\
+	__typeof(cmp(NULL, NULL)) comp;					\
+									\
+	tmp = name##_RB_CLIMB(head, hint, elm);				\
+	while (tmp) {							\
+		comp = cmp(elm, tmp);					\
+		if (comp < 0)						\
+			tmp = RB_LEFT(tmp, field);			\
+		else if (comp > 0)					\
+			tmp = RB_RIGHT(tmp, field);			\
+		else							\
+			return (tmp);					\
+	}								\
+	return (NULL);							\
+}									\
+									\
+/* Inserts a node into the RB tree, searching from hint */		\
+attr struct type *							\
+name##_RB_INSERT_HINT(struct name *head, struct type *hint,		\
+    struct type *elm)							\
+{									\
+	struct type *tmp, *parent = NULL;				\
+	struct type **tmpp = &RB_ROOT(head);				\
+	__typeof(cmp(NULL, NULL)) comp;					\
+									\
+	name##_RB_PREPARE(elm);						\
+	tmp = name##_RB_CLIMB(head, hint, elm);				\
+	while (tmp != NULL) {						\
+		parent = tmp;						\
+		comp = cmp(elm, parent);				\
+		if (comp < 0)						\
+			tmpp = &RB_LEFT(parent, field);			\
+		else if (comp > 0)					\
+			tmpp = &RB_RIGHT(parent, field);		\
+		else							\
+			return (parent);				\
+		tmp = *tmpp;						\
+	}								\
+	return (name##_RB_INSERT_FINISH(head, parent, tmpp, elm));	\
+}
+
+/*
+ * Batched lookups.  A lone RB_FIND is a chain of dependent loads, one miss
+ * per level in a tree larger than the cache.  RB_FIND_BATCH runs up to
+ * RB_BATCH_GROUP searches in lockstep: each round takes one step in every
+ * unfinished search and prefetches the node it moves to, so the misses of
+ * the whole group are outstanding at once, and the next round finds them
+ * loaded.  results[i] is set to RB_FIND(name, head, keys[i]).
+ */
+#ifndef RB_BATCH_GROUP
+#define RB_BATCH_GROUP	16
+#endif
+
+#define RB_PROTOTYPE_BATCH(name, type, field, cmp)			\
+	RB_PROTOTYPE_BATCH_INTERNAL(name, type, field, cmp,)
+#define RB_PROTOTYPE_BATCH_STATIC(name, type, field, cmp)		\
+	RB_PROTOTYPE_BATCH_INTERNAL(name, type, field, cmp, __unused static)
+#define RB_PROTOTYPE_BATCH_INTERNAL(name, type, field, cmp, attr)	\
+	attr void name##_RB_FIND_BATCH(struct name *, struct type **,	\
+	    struct type **, size_t);
+
+#define RB_GENERATE_BATCH(name, type, field, cmp)			\
+	RB_GENERATE_BATCH_INTERNAL(name, type, field, cmp,)
+#define RB_GENERATE_BATCH_STATIC(name, type, field, cmp)		\
+	RB_GENERATE_BATCH_INTERNAL(name, type, field, cmp, __unused static)
+#define RB_GENERATE_BATCH_INTERNAL(name, type, field, cmp, attr)	\
+/* Finds the node with the same key as each of keys[0..n) */		\
+attr void								\
+name##_RB_FIND_BATCH(struct name *head, struct type **keys,		\
+    struct type **results, size_t n)					\
+{									\
+	struct type *cur[RB_BATCH_GROUP];				\
+	__typeof(cmp(NULL, NULL)) comp;					\
+	size_t i, m, live;						\
+									\
+	for (; n > 0; keys += m, results += m, n -= m) {		\
+		m = n < RB_BATCH_GROUP ? n : RB_BATCH_GROUP;		\
+		for (i = 0; i < m; i++) {				\
+			cur[i] = RB_ROOT(head);				\
+			results[i] = NULL;				\
+		}							\
+		do {							\
+			live = 0;					\
+			for (i = 0; i < m; i++) {			\
+				if (cur[i] == NULL)			\
+					continue;			\
+				comp = cmp(keys[i], cur[i]);		\
+				if (comp == 0) {			\
+					results[i] = cur[i];		\
+					cur[i] = NULL;			\
+					continue;			\
+				}					\
+				cur[i] = comp < 0 ?			\
+				    RB_LEFT(cur[i], field) :		\
+				    RB_RIGHT(cur[i], field);		\
+				if (cur[i] != NULL) {			\
+					_RB_PREFETCH(cur[i]);		\
+					live++;				\
+				}					\
+			}						\
+		} while (live > 0);					\
+	}								\
+}
+
+/*
+ * Partitions.  RB_PARTITION cuts a tree into at most k ranges of about
+ * equal size, so a scan of a large tree can be shared among threads that
+ * each walk one range.  With no size field to go by, a subtree of rank r
+ * is taken to hold (RB_PARTITION_BASE / 100)^r nodes, so the ranges are
+ * only as even as the tree is; on random trees the largest is within
+ * about twice its share.  The estimates are kept in integers, in
+ * hundredths of a node.  On return, range i runs from bounds[i] up to but
+ * not including bounds[i + 1], and bounds[m] is NULL, where m, at most k,
+ * is returned; bounds must have room for k + 1 entries.  Trees with
+ * RB_GENERATE_SIZE can instead use RB_GENERATE_PARTITION_SIZE, which has
+ * the same prototype and cuts by position, so that the ranges differ in
+ * size by at most one node.
+ */
+#ifndef RB_PARTITION_BASE
+#define RB_PARTITION_BASE	160
+#endif
+
+/* A cut position of 1, the end of a subtree, in fixed point */
+#define _RB_PARTITION_ONE	((uint64_t)1 << 32)
+
+#define RB_PROTOTYPE_PARTITION(name, type, field)			\
+	RB_PROTOTYPE_PARTITION_INTERNAL(name, type, field,)
+#define RB_PROTOTYPE_PARTITION_STATIC(name, type, field)		\
+	RB_PROTOTYPE_PARTITION_INTERNAL(name, type, field, __unused static)
+#define RB_PROTOTYPE_PARTITION_INTERNAL(name, type, field, attr)	\
+	attr size_t name##_RB_PARTITION(struct name *, size_t,		\
+	    struct type **);
+
+#define RB_GENERATE_PARTITION(name, type, field)			\
+	RB_GENERATE_PARTITION_INTERNAL(name, type, field,)
+#define RB_GENERATE_PARTITION_STATIC(name, type, field)			\
+	RB_GENERATE_PARTITION_INTERNAL(name, type, field, __unused static)
+#define RB_GENERATE_PARTITION_INTERNAL(name, type, field, attr)		\
+/* Estimates the size of the subtree at elm from its rank, in hundredths */ \
+static __unused __inline uint64_t					\
+name##_RB_EST_SIZE(struct type *elm)					\
+{									\
+	uint64_t size = 100;						\
+									\
+	while (elm != NULL && size <= UINT64_MAX / RB_PARTITION_BASE /	\
+	    RB_PARTITION_BASE) {					\
+		size = size * RB_PARTITION_BASE / 100;			\
+		if (_RB_BITSUP(elm, field) & _RB_L)			\
+			size = size * RB_PARTITION_BASE / 100;		\
+		elm = RB_LEFT(elm, field);				\
+	}								\
+	return (size - 100);						\
+}									\
+									\
+/* Cuts the tree into at most k ranges, and returns their number */	\
+attr size_t								\
+name##_RB_PARTITION(struct name *head, size_t k, struct type **bounds)	\
+{									\
+	struct type *tmp;						\
+	uint64_t lsize, rsize, size, lo, hi, target;			\
+	size_t i, m = 0;						\
+									\
+	if (k == 0)							\
+		return (0);						\
+	if (RB_EMPTY(head)) {						\
+		bounds[0] = NULL;					\
+		return (0);						\
+	}								\
+	bounds[m++] = RB_MIN(name, head);				\
+	for (i = 1; i < k; i++) {					\
+		/*							\
+		 * target is the cut as a fraction of the subtree at	\
+		 * tmp.  The left subtree, tmp and the right subtree	\
+		 * split that fraction in proportion to their estimates,	\
+		 * and target is rescaled to the part it falls in.	\
+		 */							\
+		target = _RB_PARTITION_ONE * i / k;			\
+		tmp = RB_ROOT(head);					\
+		for (;;) {						\
+			lsize = name##_RB_EST_SIZE(RB_LEFT(tmp, field)); \
+			rsize = name##_RB_EST_SIZE(RB_RIGHT(tmp, field)); \
+			while (lsize + rsize >= (uint64_t)1 << 30) {	\
+				lsize >>= 1;				\
+				rsize >>= 1;				\
+			}						\
+			size = lsize + 100 + rsize;			\
+			lo = lsize * _RB_PARTITION_ONE / size;		\
+			hi = (lsize + 100) * _RB_PARTITION_ONE / size;	\
+			if (target < lo) {				\
+				target = target * size / lsize;		\
+				tmp = RB_LEFT(tmp, field);		\
+			} else if (target >= hi && rsize > 0) {		\
+				target = (target - hi) * size / rsize;	\
+				if (target >= _RB_PARTITION_ONE)	\
+					target = _RB_PARTITION_ONE - 1;	\
+				tmp = RB_RIGHT(tmp, field);		\
+			} else						\
+				break;					\
+		}							\
+		if (tmp != bounds[m - 1])				\
+			bounds[m++] = tmp;				\
+	}								\
+	bounds[m] = NULL;						\
+	return (m);							\
+}
+
+/*
+ * Exact partitions, for trees with RB_GENERATE_SIZE.  Cut i is the node
+ * at position i * n / k, found with RB_SELECT.
+ */
+#define RB_GENERATE_PARTITION_SIZE(name, type, field)			\
+	RB_GENERATE_PARTITION_SIZE_INTERNAL(name, type, field,)
+#define RB_GENERATE_PARTITION_SIZE_STATIC(name, type, field)		\
+	RB_GENERATE_PARTITION_SIZE_INTERNAL(name, type, field,		\
+	    __unused static)
+#define RB_GENERATE_PARTITION_SIZE_INTERNAL(name, type, field, attr)	\
+/* Cuts the tree into at most k ranges, and returns their number */	\
+attr size_t								\
+name##_RB_PARTITION(struct name *head, size_t k, struct type **bounds)	\
+{									\
+	size_t i, m = 0, n = name##_RB_COUNT(head);			\
+									\
+	if (k == 0)							\
+		return (0);						\
+	if (k > n)							\
+		k = n;							\
+	for (i = 0; i < k; i++)						\
+		bounds[m++] = name##_RB_SELECT(head,			\
+		    n / k * i + n % k * i / k);				\
+	bounds[m] = NULL;						\
+	return (m);							\
+}
+
+/*
+ * Compact trees.  A node declared with RB_ENTRY_COMPACT holds its three
+ * links as 32-bit words rather than pointers, 12 bytes instead of 24 on
+ * 64-bit machines, and so must come from a single array, the pool named
+ * to RB_GENERATE_COMPACT, an expression for the address of its first
+ * element that is evaluated wherever a link is followed.  A link holds one
+ * more than the index of the node it points to, shifted left two places,
+ * or 0 for none, so the rank bits go in the low bits of the parent link as
+ * they do in a pointer, and a pool may hold up to 2^30 - 1 nodes.  The tree
+ * head is an ordinary RB_HEAD, and RB_INSERT, RB_REMOVE, RB_FIND, RB_NFIND,
+ * RB_PFIND, RB_NEXT, RB_PREV, RB_MIN, RB_MAX and the RB_FOREACH loops work
+ * on it unchanged.  Compact trees cannot be augmented, and the other
+ * opt-in generators, which follow pointer links, do not apply to them.
+ * Each function RB_GENERATE_COMPACT emits is the one named in the comment
+ * above it, step for step, with words in place of pointers and without
+ * the augmentation and cache hooks; a fix to either must be made to both.
+ */
+#define RB_ENTRY_COMPACT(type)						\
+struct {								\
+	uint32_t rbe_link[3];						\
+}
+
+#define _RB_CLINK(name, w, dir, field)					\
+	(name##_RB_CNODE(w)->field.rbe_link[dir])
+#define _RB_CUP(name, w, field)		_RB_CLINK(name, w, 0, field)
+#define _RB_CLEFT(name, w, field)	_RB_CLINK(name, w, _RB_L, field)
+#define _RB_CRIGHT(name, w, field)	_RB_CLINK(name, w, _RB_R, field)
+#define _RB_CPTR(w)			((w) & ~(uint32_t)_RB_LR)
+
+#define _RB_CSET_PARENT(name, dst, src, field) do {			\
+	_RB_CUP(name, dst, field) = (src) |				\
+	    (_RB_CUP(name, dst, field) & (uint32_t)_RB_LR);		\
+} while (/*CONSTCOND*/ 0)
+
+#define _RB_CSWAP_CHILD(name, head, par, out, in, field) do {		\
+	if ((par) == 0)							\
+		RB_ROOT(head) = name##_RB_CELM(in);			\
+	else if ((out) == _RB_CLEFT(name, par, field))			\
+		_RB_CLEFT(name, par, field) = (in);			\
+	else								\
+		_RB_CRIGHT(name, par, field) = (in);			\
+} while (/*CONSTCOND*/ 0)
+
+/* RB_ROTATE, on compact links */
+#define _RB_CROTATE(name, elm, tmp, dir, field) do {			\
+	if ((_RB_CLINK(name, elm, (dir) ^ _RB_LR, field) =		\
+	    _RB_CLINK(name, tmp, dir, field)) != 0)			\
+		_RB_CSET_PARENT(name, _RB_CLINK(name, tmp, dir, field),	\
+		    elm, field);					\
+	_RB_CLINK(name, tmp, dir, field) = (elm);			\
+	_RB_CSET_PARENT(name, elm, tmp, field);				\
+} while (/*CONSTCOND*/ 0)
+
+#define RB_PROTOTYPE_COMPACT(name, type, field, cmp)			\
+	RB_PROTOTYPE_COMPACT_INTERNAL(name, type, field, cmp,)
+#define RB_PROTOTYPE_COMPACT_STATIC(name, type, field, cmp)		\
+	RB_PROTOTYPE_COMPACT_INTERNAL(name, type, field, cmp, __unused static)
+#define RB_PROTOTYPE_COMPACT_INTERNAL(name, type, field, cmp, attr)	\
+	RB_PROTOTYPE_RANK(name, type, attr)				\
+	attr void name##_RB_INSERT_COLOR(struct name *, uint32_t,	\
+	    uint32_t);							\
+	attr void name##_RB_REMOVE_COLOR(struct name *, uint32_t,	\
+	    uint32_t);							\
+	RB_PROTOTYPE_INSERT(name, type, attr);				\
+	RB_PROTOTYPE_REMOVE(name, type, attr);				\
+	RB_PROTOTYPE_FIND(name, type, attr);				\
+	RB_PROTOTYPE_NFIND(name, type, attr);				\
+	RB_PROTOTYPE_PFIND(name, type, attr);				\
+	RB_PROTOTYPE_NEXT(name, type, attr);				\
+	RB_PROTOTYPE_PREV(name, type, attr);				\
+	RB_PROTOTYPE_MINMAX(name, type, attr);
+
+#define RB_GENERATE_COMPACT(name, type, field, cmp, pool)		\
+	RB_GENERATE_COMPACT_INTERNAL(name, type, field, cmp, pool,)
+#define RB_GENERATE_COMPACT_STATIC(name, type, field, cmp, pool)	\
+	RB_GENERATE_COMPACT_INTERNAL(name, type, field, cmp, pool,	\
+	    __unused static)
+#define RB_GENERATE_COMPACT_INTERNAL(name, type, field, cmp, pool, attr) \
+/* The node that a nonzero link w points to */				\
+static __unused __inline struct type *					\
+name##_RB_CNODE(uint32_t w)						\
+{									\
+	return (&(pool)[(w >> 2) - 1]);					\
+}									\
+									\
+static __unused __inline struct type *					\
+name##_RB_CELM(uint32_t w)						\
+{									\
+	return (w == 0 ? NULL : name##_RB_CNODE(w));			\
+}									\
+									\
+/* The link to elm, which may be NULL */				\
+static __unused __inline uint32_t					\
+name##_RB_CWORD(struct type *elm)					\
+{									\
+	return (elm == NULL ? 0 : (uint32_t)(elm - (pool) + 1) << 2);	\
+}									\
+	_RB_GENERATE_COMPACT_RANK(name, type, field, attr)		\
+									\
+/* RB_GENERATE_INSERT_COLOR, on compact links */			\
+attr void								\
+name##_RB_INSERT_COLOR(struct name *head, uint32_t parent, uint32_t elm) \
+{									\
+	uint32_t child, child_up, gpar, elmdir, sibdir;			\
+									\
+	do {								\
+		gpar = _RB_CUP(name, parent, field);			\
+		elmdir = _RB_CRIGHT(name, parent, field) == elm ?	\
+		    _RB_R : _RB_L;					\
+		if (gpar & elmdir) {					\
+			_RB_CUP(name, parent, field) ^= elmdir;		\
+			return;						\
+		}							\
+		sibdir = elmdir ^ _RB_LR;				\
+		_RB_CUP(name, parent, field) ^= sibdir;			\
+		if ((gpar & _RB_LR) == 0) {				\
+			elm = parent;					\
+			continue;					\
+		}							\
+		_RB_CUP(name, parent, field) = gpar = _RB_CPTR(gpar);	\
+		if (_RB_CUP(name, elm, field) & elmdir) {		\
+			child = _RB_CLINK(name, elm, sibdir, field);	\
+			_RB_CROTATE(name, elm, child, elmdir, field);	\
+			child_up = _RB_CUP(name, child, field);		\
+			if (child_up & sibdir)				\
+				_RB_CUP(name, parent, field) ^= elmdir;	\
+			if (child_up & elmdir)				\
+				_RB_CUP(name, elm, field) ^= _RB_LR;	\
+			else						\
+				_RB_CUP(name, elm, field) ^= elmdir;	\
+		} else							\
+			child = elm;					\
+		_RB_CROTATE(name, parent, child, sibdir, field);	\
+		_RB_CUP(name, child, field) = gpar;			\
+		_RB_CSWAP_CHILD(name, head, gpar, parent, child, field); \
+		return;							\
+	} while ((parent = gpar) != 0);					\
+}									\
+									\
+/* RB_GENERATE_REMOVE_COLOR, on compact links */			\
+attr void								\
+name##_RB_REMOVE_COLOR(struct name *head, uint32_t parent, uint32_t elm) \
+{									\
+	uint32_t gpar, sib, up, elmdir, sibdir;				\
+									\
+	if (_RB_CRIGHT(name, parent, field) == elm &&			\
+	    _RB_CLEFT(name, parent, field) == elm) {			\
+		_RB_CUP(name, parent, field) =				\
+		    _RB_CPTR(_RB_CUP(name, parent, field));		\
+		elm = parent;						\
+		if ((parent = _RB_CUP(name, elm, field)) == 0)		\
+			return;						\
+	}								\
+	do {								\
+		gpar = _RB_CUP(name, parent, field);			\
+		elmdir = _RB_CRIGHT(name, parent, field) == elm ?	\
+		    _RB_R : _RB_L;					\
+		gpar ^= elmdir;						\
+		if (gpar & elmdir) {					\
+			_RB_CUP(name, parent, field) = gpar;		\
+			return;						\
+		}							\
+		if (gpar & _RB_LR) {					\
+			gpar ^= _RB_LR;					\
+			_RB_CUP(name, parent, field) = gpar;		\
+			gpar = _RB_CPTR(gpar);				\
+			continue;					\
+		}							\
+		sibdir = elmdir ^ _RB_LR;				\
+		sib = _RB_CLINK(name, parent, sibdir, field);		\
+		up = _RB_CUP(name, sib, field) ^ _RB_LR;		\
+		if ((up & _RB_LR) == 0) {				\
+			_RB_CUP(name, sib, field) = up;			\
+			continue;					\
+		}							\
+		if ((up & sibdir) == 0) {				\
+			elm = _RB_CLINK(name, sib, elmdir, field);	\
+			_RB_CROTATE(name, sib, elm, sibdir, field);	\
+			up = _RB_CUP(name, elm, field);			\
+			_RB_CUP(name, parent, field) ^=			\
+			    (up & elmdir) ? _RB_LR : elmdir;		\
+			_RB_CUP(name, sib, field) ^=			\
+			    (up & sibdir) ? _RB_LR : sibdir;		\
+			_RB_CUP(name, elm, field) |= _RB_LR;		\
+		} else {						\
+			if ((up & elmdir) == 0)				\
+				_RB_CUP(name, parent, field) ^= elmdir;	\
+			_RB_CUP(name, sib, field) ^= sibdir;		\
+			elm = sib;					\
+		}							\
+		_RB_CROTATE(name, parent, elm, elmdir, field);		\
+		_RB_CSET_PARENT(name, elm, gpar, field);		\
+		_RB_CSWAP_CHILD(name, head, gpar, parent, elm, field);	\
+		return;							\
+	} while (elm = parent, (parent = gpar) != 0);			\
+}									\
+									\
+/* RB_GENERATE_INSERT, on compact links */				\
+attr struct type *							\
+name##_RB_INSERT(struct name *head, struct type *elm)			\
+{									\
+	uint32_t e = name##_RB_CWORD(elm);				\
+	uint32_t tmp = name##_RB_CWORD(RB_ROOT(head));			\
+	uint32_t parent = 0, dir = 0;					\
+	__typeof(cmp(NULL, NULL)) comp;					\
+									\
+	while (tmp != 0) {						\
+		parent = tmp;						\
+		comp = cmp(elm, name##_RB_CNODE(tmp));			\
+		if (comp < 0)						\
+			dir = _RB_L;					\
+		else if (comp > 0)					\
+			dir = _RB_R;					\
+		else							\
+			return (name##_RB_CNODE(tmp));			\
+		tmp = _RB_CLINK(name, tmp, dir, field);			\
+	}								\
+	_RB_CUP(name, e, field) = parent;				\
+	_RB_CLEFT(name, e, field) = _RB_CRIGHT(name, e, field) = 0;	\
+	if (parent == 0)						\
+		RB_ROOT(head) = elm;					\
+	else {								\
+		_RB_CLINK(name, parent, dir, field) = e;		\
+		name##_RB_INSERT_COLOR(head, parent, e);		\
+	}								\
+	return (NULL);							\
+}									\
+									\
+/* RB_GENERATE_REMOVE, on compact links */				\
+attr struct type *							\
+name##_RB_REMOVE(struct name *head, struct type *elm)			\
+{									\
+	uint32_t out = name##_RB_CWORD(elm);				\
+	uint32_t child, in, opar, parent;				\
+									\
+	child = _RB_CLEFT(name, out, field);				\
+	in = _RB_CRIGHT(name, out, field);				\
+	opar = _RB_CUP(name, out, field);				\
+	if (in == 0 || child == 0) {					\
+		in = child = (in == 0 ? child : in);			\
+		parent = opar = _RB_CPTR(opar);				\
+	} else {							\
+		parent = in;						\
+		while (_RB_CLEFT(name, in, field))			\
+			in = _RB_CLEFT(name, in, field);		\
+		_RB_CSET_PARENT(name, child, in, field);		\
+		_RB_CLEFT(name, in, field) = child;			\
+		child = _RB_CRIGHT(name, in, field);			\
+		if (parent != in) {					\
+			_RB_CSET_PARENT(name, parent, in, field);	\
+			_RB_CRIGHT(name, in, field) = parent;		\
+			parent = _RB_CPTR(_RB_CUP(name, in, field));	\
+			_RB_CLEFT(name, parent, field) = child;		\
+		}							\
+		_RB_CUP(name, in, field) = opar;			\
+		opar = _RB_CPTR(opar);					\
+	}								\
+	_RB_CSWAP_CHILD(name, head, opar, out, in, field);		\
+	if (child != 0)							\
+		_RB_CUP(name, child, field) = parent;			\
+	if (parent != 0)						\
+		name##_RB_REMOVE_COLOR(head, parent, child);		\
+	return (elm);							\
+}									\
+									\
+/* Finds the node with the same key as elm */				\
+attr struct type *							\
+name##_RB_FIND(struct name *head, struct type *elm)			\
+{									\
+	uint32_t tmp = name##_RB_CWORD(RB_ROOT(head));			\
+	__typeof(cmp(NULL, NULL)) comp;					\
+									\
+	while (tmp != 0) {						\
+		comp = cmp(elm, name##_RB_CNODE(tmp));			\
+		if (comp < 0)						\
+			tmp = _RB_CLEFT(name, tmp, field);		\
+		else if (comp > 0)					\
+			tmp = _RB_CRIGHT(name, tmp, field);		\
+		else							\
+			return (name##_RB_CNODE(tmp));			\
+	}								\
+	return (NULL);							\
+}									\
+									\
+/* Finds the first node greater than or equal to the search key */	\
+attr struct type *							\
+name##_RB_NFIND(struct name *head, struct type *elm)			\
+{									\
+	uint32_t tmp = name##_RB_CWORD(RB_ROOT(head));			\
+	uint32_t res = 0;						\
+	__typeof(cmp(NULL, NULL)) comp;					\
+									\
+	while (tmp != 0) {						\
+		comp = cmp(elm, name##_RB_CNODE(tmp));			\
+		if (comp < 0) {						\
+			res = tmp;					\
+			tmp = _RB_CLEFT(name, tmp, field);		\
+		} else if (comp > 0)					\
+			tmp = _RB_CRIGHT(name, tmp, field);		\
+		else							\
+			return (name##_RB_CNODE(tmp));			\
+	}								\
+	return (name##_RB_CELM(res));					\
+}									\
+									\
+/* Finds the last node less than or equal to the search key */		\
+attr struct type *							\
+name##_RB_PFIND(struct name *head, struct type *elm)			\
+{									\
+	uint32_t tmp = name##_RB_CWORD(RB_ROOT(head));			\
+	uint32_t res = 0;						\
+	__typeof(cmp(NULL, NULL)) comp;					\
+									\
+	while (tmp != 0) {						\
+		comp = cmp(elm, name##_RB_CNODE(tmp));			\
+		if (comp > 0) {						\
+			res = tmp;					\
+			tmp = _RB_CRIGHT(name, tmp, field);		\
+		} else if (comp < 0)					\
+			tmp = _RB_CLEFT(name, tmp, field);		\
+		else							\
+			return (name##_RB_CNODE(tmp));			\
+	}								\
+	return (name##_RB_CELM(res));					\
+}									\
+									\
+/* RB_GENERATE_NEXT, on compact links */				\
+attr struct type *							\
+name##_RB_NEXT(struct type *elm)					\
+{									\
+	uint32_t tmp = name##_RB_CWORD(elm), up;			\
+									\
+	if (_RB_CRIGHT(name, tmp, field)) {				\
+		tmp = _RB_CRIGHT(name, tmp, field);			\
+		while (_RB_CLEFT(name, tmp, field))			\
+			tmp = _RB_CLEFT(name, tmp, field);		\
+		return (name##_RB_CNODE(tmp));				\
+	}								\
+	while ((up = _RB_CPTR(_RB_CUP(name, tmp, field))) != 0 &&	\
+	    tmp == _RB_CRIGHT(name, up, field))				\
+		tmp = up;						\
+	return (name##_RB_CELM(up));					\
+}									\
+									\
+/* RB_GENERATE_PREV, on compact links */				\
+attr struct type *							\
+name##_RB_PREV(struct type *elm)					\
+{									\
+	uint32_t tmp = name##_RB_CWORD(elm), up;			\
+									\
+	if (_RB_CLEFT(name, tmp, field)) {				\
+		tmp = _RB_CLEFT(name, tmp, field);			\
+		while (_RB_CRIGHT(name, tmp, field))			\
+			tmp = _RB_CRIGHT(name, tmp, field);		\
+		return (name##_RB_CNODE(tmp));				\
+	}								\
+	while ((up = _RB_CPTR(_RB_CUP(name, tmp, field))) != 0 &&	\
+	    tmp == _RB_CLEFT(name, up, field))				\
+		tmp = up;						\
+	return (name##_RB_CELM(up));					\
+}									\
+									\
+/* RB_GENERATE_MINMAX, on compact links */				\
+attr struct type *							\
+name##_RB_MINMAX(struct name *head, int val)				\
+{									\
+	uint32_t tmp = name##_RB_CWORD(RB_ROOT(head));			\
+	uint32_t parent = 0;						\
+									\
+	while (tmp != 0) {						\
+		parent = tmp;						\
+		tmp = _RB_CLINK(name, tmp, val < 0 ? _RB_L : _RB_R,	\
+		    field);						\
+	}								\
+	return (name##_RB_CELM(parent));				\
+}
+
+#ifdef _RB_DIAGNOSTIC
+#define _RB_GENERATE_COMPACT_RANK(name, type, field, attr)		\
+/* name##_RB_RANK, on compact links */					\
+static __unused int							\
+name##_RB_CRANK(uint32_t elm)						\
+{									\
+	uint32_t left, right, up;					\
+	int left_rank, right_rank;					\
+									\
+	if (elm == 0)							\
+		return (0);						\
+	up = _RB_CUP(name, elm, field);					\
+	left = _RB_CLEFT(name, elm, field);				\
+	left_rank = ((up & _RB_L) ? 2 : 1) + name##_RB_CRANK(left);	\
+	right = _RB_CRIGHT(name, elm, field);				\
+	right_rank = ((up & _RB_R) ? 2 : 1) + name##_RB_CRANK(right);	\
+	if (left_rank != right_rank ||					\
+	    (left_rank == 2 && left == 0 && right == 0))		\
+		return (-1);						\
+	return (left_rank);						\
+}									\
+									\
+attr int								\
+name##_RB_RANK(struct type *elm)					\
+{									\
+	return (name##_RB_CRANK(name##_RB_CWORD(elm)));			\
+}
+#else
+#define _RB_GENERATE_COMPACT_RANK(name, type, field, attr)
+#endif
+
+/*
+ * Two-link trees.  A node declared with RB_ENTRY_PATH has no parent link,
+ * only left and right, with the rank bits of both in the low bits of the
+ * left link, so it is two thirds the size of an RB_ENTRY.  Insert and
+ * remove record the path from the root in an array of RB_PATH_MAX nodes
+ * on the stack and rebalance back up it, and in-order iteration keeps its
+ * own path in a struct name##_RB_ITER.  RB_INSERT, RB_REMOVE, RB_FIND,
+ * RB_NFIND, RB_PFIND, RB_MIN and RB_MAX work on these trees; RB_NEXT,
+ * RB_PREV and the RB_FOREACH loops do not, and RB_FOREACH_PATH takes their
+ * place.  RB_REMOVE finds the node by its key, so keys must be unique, as
+ * RB_INSERT keeps them.  Two-link trees cannot be augmented.
+ */
+#ifndef RB_PATH_MAX
+/* The height of a tree of n nodes is at most 2 lg n */
+#define RB_PATH_MAX	(2 * 8 * (int)sizeof(void *))
+#endif
+
+#define RB_ENTRY_PATH(type)						\
+struct {								\
+	struct type *rbe_link[2];					\
+}
+
+#define _RB_PBITS(elm, field)		_RB_BITS((elm)->field.rbe_link[0])
+#define _RB_PLEFT(elm, field)		_RB_PTR((elm)->field.rbe_link[0])
+#define _RB_PRIGHT(elm, field)		(elm)->field.rbe_link[1]
+#define _RB_PLINK(elm, dir, field)					\
+	((dir) == _RB_L ? _RB_PLEFT(elm, field) : _RB_PRIGHT(elm, field))
+
+/* Sets the dir link of elm to child, keeping the rank bits of elm */
+#define _RB_PSET(elm, dir, child, field) do {				\
+	if ((dir) == _RB_L)						\
+		(elm)->field.rbe_link[0] =				\
+		    (__typeof((elm)->field.rbe_link[0]))		\
+		    ((__uintptr_t)(child) | (_RB_PBITS(elm, field) & _RB_LR)); \
+	else								\
+		(elm)->field.rbe_link[1] = (child);			\
+} while (/*CONSTCOND*/ 0)
+
+#define _RB_PSWAP_CHILD(head, par, out, in, field) do {			\
+	if ((par) == NULL)						\
+		RB_ROOT(head) = (in);					\
+	else if (_RB_PRIGHT(par, field) == (out))			\
+		_RB_PRIGHT(par, field) = (in);				\
+	else								\
+		_RB_PSET(par, _RB_L, in, field);			\
+} while (/*CONSTCOND*/ 0)
+
+#define RB_PROTOTYPE_PATH(name, type, field, cmp)			\
+	RB_PROTOTYPE_PATH_INTERNAL(name, type, field, cmp,)
+#define RB_PROTOTYPE_PATH_STATIC(name, type, field, cmp)		\
+	RB_PROTOTYPE_PATH_INTERNAL(name, type, field, cmp, __unused static)
+#define RB_PROTOTYPE_PATH_INTERNAL(name, type, field, cmp, attr)	\
+	RB_PROTOTYPE_INSERT(name, type, attr);				\
+	RB_PROTOTYPE_REMOVE(name, type, attr);				\
+	_RB_PROTOTYPE_PATH_SEARCH(name, type, attr)
+#define _RB_PROTOTYPE_PATH_SEARCH(name, type, attr)			\
+	struct name##_RB_ITER {						\
+		struct type *rbi_path[RB_PATH_MAX];			\
+		int rbi_depth;						\
+	};								\
+	RB_PROTOTYPE_RANK(name, type, attr)				\
+	RB_PROTOTYPE_FIND(name, type, attr);				\
+	RB_PROTOTYPE_NFIND(name, type, attr);				\
+	RB_PROTOTYPE_PFIND(name, type, attr);				\
+	RB_PROTOTYPE_MINMAX(name, type, attr);				\
+	attr struct type *name##_RB_ITER_FIRST(struct name *,		\
+	    struct name##_RB_ITER *);					\
+	attr struct type *name##_RB_ITER_NEXT(struct name##_RB_ITER *);
+
+#define RB_GENERATE_PATH(name, type, field, cmp)			\
+	RB_GENERATE_PATH_INTERNAL(name, type, field, cmp,)
+#define RB_GENERATE_PATH_STATIC(name, type, field, cmp)			\
+	RB_GENERATE_PATH_INTERNAL(name, type, field, cmp, __unused static)
+#define RB_GENERATE_PATH_INTERNAL(name, type, field, cmp, attr)		\
+	_RB_GENERATE_PATH_SEARCH(name, type, field, cmp, attr)		\
+									\
+attr struct type *							\
+name##_RB_INSERT(struct name *head, struct type *elm)			\
+{									\
+	struct type *path[RB_PATH_MAX];					\
+	struct type *tmp = RB_ROOT(head), *parent, *child, *top;	\
+	__uintptr_t dir = _RB_L, sibdir, bits;				\
+	__typeof(cmp(NULL, NULL)) comp;					\
+	int depth = 0;							\
+									\
+	while (tmp != NULL) {						\
+		comp = cmp(elm, tmp);					\
+		if (comp == 0)						\
+			return (tmp);					\
+		path[depth++] = tmp;					\
+		dir = comp < 0 ? _RB_L : _RB_R;				\
+		tmp = _RB_PLINK(tmp, dir, field);			\
+	}								\
+	elm->field.rbe_link[0] = elm->field.rbe_link[1] = NULL;		\
+	if (depth == 0) {						\
+		RB_ROOT(head) = elm;					\
+		return (NULL);						\
+	}								\
+	_RB_PSET(path[depth - 1], dir, elm, field);			\
+	tmp = elm;							\
+	while (depth > 0) {						\
+		/* the rank of the tree rooted at tmp grew */		\
+		parent = path[--depth];					\
+		dir = _RB_PRIGHT(parent, field) == tmp ? _RB_R : _RB_L;	\
+		bits = _RB_PBITS(parent, field);			\
+		if (bits & dir) {					\
+			/* shorten the parent-tmp edge to rebalance */	\
+			_RB_PBITS(parent, field) ^= dir;		\
+			return (NULL);					\
+		}							\
+		sibdir = dir ^ _RB_LR;					\
+		if ((bits & sibdir) == 0) {				\
+			/* promote parent, retry from it */		\
+			_RB_PBITS(parent, field) |= sibdir;		\
+			tmp = parent;					\
+			continue;					\
+		}							\
+		child = _RB_PLINK(tmp, sibdir, field);			\
+		if (_RB_PBITS(tmp, field) & sibdir) {			\
+			/* the outer edge below tmp is short: rotate */	\
+			_RB_PSET(parent, dir, child, field);		\
+			_RB_PSET(tmp, sibdir, parent, field);		\
+			_RB_PBITS(parent, field) &= ~_RB_LR;		\
+			_RB_PBITS(tmp, field) &= ~_RB_LR;		\
+			top = tmp;					\
+		} else {						\
+			/* the inner edge is short: rotate twice */	\
+			bits = _RB_PBITS(child, field);			\
+			_RB_PSET(tmp, sibdir,				\
+			    _RB_PLINK(child, dir, field), field);	\
+			_RB_PSET(parent, dir,				\
+			    _RB_PLINK(child, sibdir, field), field);	\
+			_RB_PSET(child, dir, tmp, field);		\
+			_RB_PSET(child, sibdir, parent, field);		\
+			_RB_PBITS(tmp, field) &= ~_RB_LR;		\
+			_RB_PBITS(tmp, field) |=			\
+			    (bits & dir) ? sibdir : 0;			\
+			_RB_PBITS(parent, field) &= ~_RB_LR;		\
+			_RB_PBITS(parent, field) |=			\
+			    (bits & sibdir) ? dir : 0;			\
+			_RB_PBITS(child, field) &= ~_RB_LR;		\
+			top = child;					\
+		}							\
+		_RB_PSWAP_CHILD(head, depth > 0 ? path[depth - 1] : NULL, \
+		    parent, top, field);				\
+		return (NULL);						\
+	}								\
+	return (NULL);							\
+}									\
+									\
+attr struct type *							\
+name##_RB_REMOVE(struct name *head, struct type *elm)			\
+{									\
+	struct type *path[RB_PATH_MAX];					\
+	struct type *tmp = RB_ROOT(head), *parent, *sib, *child;	\
+	__uintptr_t dir, sibdir, bits, sibbits;				\
+	__typeof(cmp(NULL, NULL)) comp;					\
+	int depth = 0, elmdepth;					\
+									\
+	while (tmp != NULL && (comp = cmp(elm, tmp)) != 0) {		\
+		path[depth++] = tmp;					\
+		tmp = _RB_PLINK(tmp, comp < 0 ? _RB_L : _RB_R, field);	\
+	}								\
+	if (tmp != elm)							\
+		return (NULL);						\
+	if (_RB_PLEFT(elm, field) != NULL &&				\
+	    _RB_PRIGHT(elm, field) != NULL) {				\
+		/* unlink the successor, and put it in the place of elm */ \
+		elmdepth = depth;					\
+		path[depth++] = elm;					\
+		tmp = _RB_PRIGHT(elm, field);				\
+		while (_RB_PLEFT(tmp, field) != NULL) {			\
+			path[depth++] = tmp;				\
+			tmp = _RB_PLEFT(tmp, field);			\
+		}							\
+		parent = path[depth - 1];				\
+		dir = parent == elm ? _RB_R : _RB_L;			\
+		_RB_PSET(parent, dir, _RB_PRIGHT(tmp, field), field);	\
+		tmp->field = elm->field;				\
+		_RB_PSWAP_CHILD(head,					\
+		    elmdepth > 0 ? path[elmdepth - 1] : NULL, elm, tmp,	\
+		    field);						\
+		path[elmdepth] = tmp;					\
+	} else {							\
+		child = _RB_PLEFT(elm, field) != NULL ?			\
+		    _RB_PLEFT(elm, field) : _RB_PRIGHT(elm, field);	\
+		if (depth == 0) {					\
+			RB_ROOT(head) = child;				\
+			return (elm);					\
+		}							\
+		parent = path[depth - 1];				\
+		dir = _RB_PRIGHT(parent, field) == elm ? _RB_R : _RB_L;	\
+		_RB_PSET(parent, dir, child, field);			\
+	}								\
+	for (;;) {							\
+		/* the dir edge of path[depth - 1] lengthened */	\
+		parent = path[--depth];					\
+		bits = _RB_PBITS(parent, field);			\
+		sibdir = dir ^ _RB_LR;					\
+		if ((bits & dir) == 0) {				\
+			_RB_PBITS(parent, field) |= dir;		\
+			if ((bits & sibdir) == 0 ||			\
+			    _RB_PLEFT(parent, field) != NULL ||		\
+			    _RB_PRIGHT(parent, field) != NULL)		\
+				return (elm);				\
+			/* demote a leaf of rank 2 */			\
+			_RB_PBITS(parent, field) &= ~_RB_LR;		\
+		} else if (bits & sibdir) {				\
+			/* demote parent */				\
+			_RB_PBITS(parent, field) ^= sibdir;		\
+		} else {						\
+			sib = _RB_PLINK(parent, sibdir, field);		\
+			sibbits = _RB_PBITS(sib, field);		\
+			if ((sibbits & _RB_LR) == _RB_LR) {		\
+				/* demote parent and sib */		\
+				_RB_PBITS(sib, field) &= ~_RB_LR;	\
+			} else {					\
+				child = _RB_PLINK(sib, dir, field);	\
+				if ((sibbits & sibdir) == 0) {		\
+					/* outer edge short: rotate */	\
+					_RB_PSET(parent, sibdir, child,	\
+					    field);			\
+					_RB_PSET(sib, dir, parent, field); \
+					_RB_PBITS(parent, field) &=	\
+					    ~sibdir;			\
+					_RB_PBITS(parent, field) |=	\
+					    (sibbits & dir) ? sibdir : 0; \
+					_RB_PBITS(sib, field) &= ~_RB_LR; \
+					_RB_PBITS(sib, field) |= sibdir; \
+					if (_RB_PLEFT(parent, field) ==	\
+					    NULL &&			\
+					    _RB_PRIGHT(parent, field) ==\
+					    NULL) {			\
+						_RB_PBITS(parent,	\
+						    field) &= ~_RB_LR;	\
+						_RB_PBITS(sib, field) |= \
+						    dir;		\
+					}				\
+					tmp = sib;			\
+				} else {				\
+					/* rotate twice */		\
+					bits = _RB_PBITS(child, field);	\
+					_RB_PSET(parent, sibdir,	\
+					    _RB_PLINK(child, dir, field), \
+					    field);			\
+					_RB_PSET(sib, dir,		\
+					    _RB_PLINK(child, sibdir,	\
+					    field), field);		\
+					_RB_PSET(child, dir, parent,	\
+					    field);			\
+					_RB_PSET(child, sibdir, sib,	\
+					    field);			\
+					_RB_PBITS(parent, field) &=	\
+					    ~_RB_LR;			\
+					_RB_PBITS(parent, field) |=	\
+					    (bits & dir) ? sibdir : 0;	\
+					_RB_PBITS(sib, field) &= ~_RB_LR; \
+					_RB_PBITS(sib, field) |=	\
+					    (bits & sibdir) ? dir : 0;	\
+					_RB_PBITS(child, field) |= _RB_LR; \
+					tmp = child;			\
+				}					\
+				_RB_PSWAP_CHILD(head, depth > 0 ?	\
+				    path[depth - 1] : NULL, parent, tmp, \
+				    field);				\
+				return (elm);				\
+			}						\
+		}							\
+		/* the rank of parent shrank, retry from its parent */	\
+		if (depth == 0)						\
+			return (elm);					\
+		dir = _RB_PRIGHT(path[depth - 1], field) == parent ?	\
+		    _RB_R : _RB_L;					\
+	}								\
+}
+
+#define _RB_GENERATE_PATH_SEARCH(name, type, field, cmp, attr)		\
+	_RB_GENERATE_PATH_RANK(name, type, field, attr)			\
+									\
+/* Finds the node with the same key as elm */				\
+attr struct type *							\
+name##_RB_FIND(struct name *head, struct type *elm)			\
+{									\
+	struct type *tmp = RB_ROOT(head);				\
+	__typeof(cmp(NULL, NULL)) comp;					\
+									\
+	while (tmp != NULL) {						\
+		comp = cmp(elm, tmp);					\
+		if (comp == 0)						\
+			return (tmp);					\
+		tmp = _RB_PLINK(tmp, comp < 0 ? _RB_L : _RB_R, field);	\
+	}								\
+	return (NULL);							\
+}									\
+									\
+/* Finds the first node greater than or equal to the search key */	\
+attr struct type *							\
+name##_RB_NFIND(struct name *head, struct type *elm)			\
+{									\
+	struct type *tmp = RB_ROOT(head), *res = NULL;			\
+	__typeof(cmp(NULL, NULL)) comp;					\
+									\
+	while (tmp != NULL) {						\
+		comp = cmp(elm, tmp);					\
+		if (comp < 0) {						\
+			res = tmp;					\
+			tmp = _RB_PLEFT(tmp, field);			\
+		} else if (comp > 0)					\
+			tmp = _RB_PRIGHT(tmp, field);			\
+		else							\
+			return (tmp);					\
+	}								\
+	return (res);							\
+}									\
+									\
+/* Finds the last node less than or equal to the search key */		\
+attr struct type *							\
+name##_RB_PFIND(struct name *head, struct type *elm)			\
+{									\
+	struct type *tmp = RB_ROOT(head), *res = NULL;			\
+	__typeof(cmp(NULL, NULL)) comp;					\
+									\
+	while (tmp != NULL) {						\
+		comp = cmp(elm, tmp);					\
+		if (comp > 0) {						\
+			res = tmp;					\
+			tmp = _RB_PRIGHT(tmp, field);			\
+		} else if (comp < 0)					\
+			tmp = _RB_PLEFT(tmp, field);			\
+		else							\
+			return (tmp);					\
+	}								\
+	return (res);							\
+}									\
+									\
+attr struct type *							\
+name##_RB_MINMAX(struct name *head, int val)				\
+{									\
+	struct type *tmp = RB_ROOT(head), *parent = NULL;		\
+									\
+	while (tmp != NULL) {						\
+		parent = tmp;						\
+		tmp = _RB_PLINK(tmp, val < 0 ? _RB_L : _RB_R, field);	\
+	}								\
+	return (parent);						\
+}									\
+									\
+/* Starts an in-order walk of the tree, and returns its first node */	\
+attr struct type *							\
+name##_RB_ITER_FIRST(struct name *head, struct name##_RB_ITER *iter)	\
+{									\
+	struct type *tmp;						\
+									\
+	iter->rbi_depth = 0;						\
+	for (tmp = RB_ROOT(head); tmp != NULL; tmp = _RB_PLEFT(tmp, field)) \
+		iter->rbi_path[iter->rbi_depth++] = tmp;		\
+	return (iter->rbi_depth > 0 ?					\
+	    iter->rbi_path[iter->rbi_depth - 1] : NULL);		\
+}									\
+									\
+/* Returns the node after the one last returned */			\
+attr struct type *							\
+name##_RB_ITER_NEXT(struct name##_RB_ITER *iter)			\
+{									\
+	struct type *tmp;						\
+									\
+	tmp = _RB_PRIGHT(iter->rbi_path[--iter->rbi_depth], field);	\
+	for (; tmp != NULL; tmp = _RB_PLEFT(tmp, field))		\
+		iter->rbi_path[iter->rbi_depth++] = tmp;		\
+	return (iter->rbi_depth > 0 ?					\
+	    iter->rbi_path[iter->rbi_depth - 1] : NULL);		\
+}
+
+#ifdef _RB_DIAGNOSTIC
+#define _RB_GENERATE_PATH_RANK(name, type, field, attr)			\
+/* name##_RB_RANK, on two-link trees */					\
+attr int								\
+name##_RB_RANK(struct type *elm)					\
+{									\
+	struct type *left, *right;					\
+	int left_rank, right_rank;					\
+									\
+	if (elm == NULL)						\
+		return (0);						\
+	left = _RB_PLEFT(elm, field);					\
+	left_rank = ((_RB_PBITS(elm, field) & _RB_L) ? 2 : 1) +		\
+	    name##_RB_RANK(left);					\
+	right = _RB_PRIGHT(elm, field);					\
+	right_rank = ((_RB_PBITS(elm, field) & _RB_R) ? 2 : 1) +	\
+	    name##_RB_RANK(right);					\
+	if (left_rank != right_rank ||					\
+	    (left_rank == 2 && left == NULL && right == NULL))		\
+		return (-1);						\
+	return (left_rank);						\
+}
+#else
+#define _RB_GENERATE_PATH_RANK(name, type, field, attr)
+#endif
+
+/*
+ * Persistent trees.  A write to a tree declared with RB_PERSIST_HEAD does
+ * not change any node a reader can see: it copies the nodes on the path it
+ * changes, and the siblings it rebalances, into nodes from alloc, and
+ * publishes the root of the new version with a single store.  RB_SNAPSHOT
+ * returns a head for the newest version, which stays unchanged while the
+ * writer goes on, and can be read with RB_FIND, RB_NFIND, RB_PFIND,
+ * RB_MIN, RB_MAX and RB_FOREACH_PATH, from any thread.  Nodes are linked
+ * with RB_ENTRY_PATH.  alloc(head) returns a node to copy into, or NULL,
+ * in which case the write fails and the tree is unchanged.  When a write
+ * publishes, each node it replaced or removed is passed to
+ * retire(head, elm), after rbh_gen counts the new version; the node is
+ * still part of older versions, and must not be freed until no reader of
+ * a version before rbh_gen remains.  The copies of a failed write are
+ * retired the same way.  RB_INSERT links elm itself, and returns elm if
+ * alloc fails.  RB_REMOVE removes the node with the key of elm, and
+ * returns it, or NULL if there is none or alloc fails.  Since a write
+ * copies nodes, a node of one version may not be the node with the same
+ * key in the next; look it up again.  Writers must be serialized by the
+ * caller.
+ */
+#define RB_PERSIST_HEAD(name, type)					\
+struct name {								\
+	struct type *rbh_root; /* root of the newest version */		\
+	unsigned long rbh_gen; /* count of versions published */	\
+}
+
+/* The most nodes a write copies: its path, and a sibling per level */
+#define _RB_PLOG_MAX	(2 * RB_PATH_MAX + 2)
+
+#define RB_PROTOTYPE_PERSIST(name, type, field, cmp)			\
+	RB_PROTOTYPE_PERSIST_INTERNAL(name, type, field, cmp,)
+#define RB_PROTOTYPE_PERSIST_STATIC(name, type, field, cmp)		\
+	RB_PROTOTYPE_PERSIST_INTERNAL(name, type, field, cmp, __unused static)
+#define RB_PROTOTYPE_PERSIST_INTERNAL(name, type, field, cmp, attr)	\
+	struct name##_RB_PLOG {						\
+		struct type *rbp_old[_RB_PLOG_MAX];			\
+		struct type *rbp_new[_RB_PLOG_MAX];			\
+		int rbp_n;						\
+	};								\
+	RB_PROTOTYPE_INSERT(name, type, attr);				\
+	RB_PROTOTYPE_REMOVE(name, type, attr);				\
+	attr struct name name##_RB_SNAPSHOT(struct name *);		\
+	_RB_PROTOTYPE_PATH_SEARCH(name, type, attr)
+
+#define RB_GENERATE_PERSIST(name, type, field, cmp, alloc, retire)	\
+	RB_GENERATE_PERSIST_INTERNAL(name, type, field, cmp, alloc, retire,)
+#define RB_GENERATE_PERSIST_STATIC(name, type, field, cmp, alloc, retire) \
+	RB_GENERATE_PERSIST_INTERNAL(name, type, field, cmp, alloc,	\
+	    retire, __unused static)
+#define RB_GENERATE_PERSIST_INTERNAL(name, type, field, cmp, alloc,	\
+    retire, attr)							\
+	_RB_GENERATE_PATH_SEARCH(name, type, field, cmp, attr)		\
+									\
+/* Copies elm into a node of the version being built */			\
+static __unused __inline struct type *					\
+name##_RB_PCOPY(struct name *head, struct name##_RB_PLOG *log,		\
+    struct type *elm)							\
+{									\
+	struct type *copy;						\
+									\
+	if ((copy = alloc(head)) == NULL)				\
+		return (NULL);						\
+	*copy = *elm;							\
+	log->rbp_old[log->rbp_n] = elm;					\
+	log->rbp_new[log->rbp_n++] = copy;				\
+	return (copy);							\
+}									\
+									\
+/* Publishes a new version, and retires the nodes it replaced */	\
+static __unused void							\
+name##_RB_PPUBLISH(struct name *head, struct name##_RB_PLOG *log,	\
+    struct type *root)							\
+{									\
+	int i;								\
+									\
+	__atomic_store_n(&RB_ROOT(head), root, __ATOMIC_RELEASE);	\
+	__atomic_store_n(&head->rbh_gen, head->rbh_gen + 1,		\
+	    __ATOMIC_RELEASE);						\
+	for (i = 0; i < log->rbp_n; i++)				\
+		retire(head, log->rbp_old[i]);				\
+}									\
+									\
+/* Abandons a version, and retires its copies */			\
+static __unused void							\
+name##_RB_PABORT(struct name *head, struct name##_RB_PLOG *log)		\
+{									\
+	int i;								\
+									\
+	for (i = 0; i < log->rbp_n; i++)				\
+		retire(head, log->rbp_new[i]);				\
+}									\
+									\
+/* Replaces path[0..depth) with copies linked from the root of tree */	\
+static __unused int							\
+name##_RB_PCOPY_PATH(struct name *head, struct name##_RB_PLOG *log,	\
+    struct name *tree, struct type **path, int depth)			\
+{									\
+	struct type *copy;						\
+	__uintptr_t dir;						\
+	int i;								\
+									\
+	for (i = 0; i < depth; i++) {					\
+		if ((copy = name##_RB_PCOPY(head, log, path[i])) == NULL) \
+			return (-1);					\
+		if (i == 0)						\
+			RB_ROOT(tree) = copy;				\
+		else {							\
+			dir = _RB_PRIGHT(path[i - 1], field) == path[i] ? \
+			    _RB_R : _RB_L;				\
+			_RB_PSET(path[i - 1], dir, copy, field);	\
+		}							\
+		path[i] = copy;						\
+	}								\
+	return (0);							\
+}									\
+									\
+attr struct type *							\
+name##_RB_INSERT(struct name *head, struct type *elm)			\
+{									\
+	struct name##_RB_PLOG log;					\
+	struct name tree;						\
+	struct type *path[RB_PATH_MAX];					\
+	struct type *tmp = RB_ROOT(head), *parent, *child, *top;	\
+	__uintptr_t dir = _RB_L, sibdir, bits;				\
+	__typeof(cmp(NULL, NULL)) comp;					\
+	int depth = 0;							\
+									\
+	while (tmp != NULL) {						\
+		comp = cmp(elm, tmp);					\
+		if (comp == 0)						\
+			return (tmp);					\
+		path[depth++] = tmp;					\
+		dir = comp < 0 ? _RB_L : _RB_R;				\
+		tmp = _RB_PLINK(tmp, dir, field);			\
+	}								\
+	elm->field.rbe_link[0] = elm->field.rbe_link[1] = NULL;		\
+	log.rbp_n = 0;							\
+	RB_ROOT(&tree) = elm;						\
+	if (name##_RB_PCOPY_PATH(head, &log, &tree, path, depth) != 0) { \
+		name##_RB_PABORT(head, &log);				\
+		return (elm);						\
+	}								\
+	if (depth > 0)							\
+		_RB_PSET(path[depth - 1], dir, elm, field);		\
+	tmp = elm;							\
+	while (depth > 0) {						\
+		/* the rank of the tree rooted at tmp grew */		\
+		parent = path[--depth];					\
+		dir = _RB_PRIGHT(parent, field) == tmp ? _RB_R : _RB_L;	\
+		bits = _RB_PBITS(parent, field);			\
+		if (bits & dir) {					\
+			/* shorten the parent-tmp edge to rebalance */	\
+			_RB_PBITS(parent, field) ^= dir;		\
+			break;						\
+		}							\
+		sibdir = dir ^ _RB_LR;					\
+		if ((bits & sibdir) == 0) {				\
+			/* promote parent, retry from it */		\
+			_RB_PBITS(parent, field) |= sibdir;		\
+			tmp = parent;					\
+			continue;					\
+		}							\
+		/* the nodes rotated are all on the path, and copies */	\
+		child = _RB_PLINK(tmp, sibdir, field);			\
+		if (_RB_PBITS(tmp, field) & sibdir) {			\
+			/* the outer edge below tmp is short: rotate */	\
+			_RB_PSET(parent, dir, child, field);		\
+			_RB_PSET(tmp, sibdir, parent, field);		\
+			_RB_PBITS(parent, field) &= ~_RB_LR;		\
+			_RB_PBITS(tmp, field) &= ~_RB_LR;		\
+			top = tmp;					\
+		} else {						\
+			/* the inner edge is short: rotate twice */	\
+			bits = _RB_PBITS(child, field);			\
+			_RB_PSET(tmp, sibdir,				\
+			    _RB_PLINK(child, dir, field), field);	\
+			_RB_PSET(parent, dir,				\
+			    _RB_PLINK(child, sibdir, field), field);	\
+			_RB_PSET(child, dir, tmp, field);		\
+			_RB_PSET(child, sibdir, parent, field);		\
+			_RB_PBITS(tmp, field) &= ~_RB_LR;		\
+			_RB_PBITS(tmp, field) |=			\
+			    (bits & dir) ? sibdir : 0;			\
+			_RB_PBITS(parent, field) &= ~_RB_LR;		\
+			_RB_PBITS(parent, field) |=			\
+			    (bits & sibdir) ? dir : 0;			\
+			_RB_PBITS(child, field) &= ~_RB_LR;		\
+			top = child;					\
+		}							\
+		_RB_PSWAP_CHILD(&tree, depth > 0 ? path[depth - 1] : NULL, \
+		    parent, top, field);				\
+		break;							\
+	}								\
+	name##_RB_PPUBLISH(head, &log, RB_ROOT(&tree));			\
+	return (NULL);							\
+}									\
+									\
+attr struct type *							\
+name##_RB_REMOVE(struct name *head, struct type *elm)			\
+{									\
+	struct name##_RB_PLOG log;					\
+	struct name tree;						\
+	struct type *path[RB_PATH_MAX];					\
+	struct type *tmp = RB_ROOT(head), *parent, *sib, *child;	\
+	struct type *out, *gone;					\
+	__typeof(elm->field) entry;					\
+	__uintptr_t dir, sibdir, bits, sibbits;				\
+	__typeof(cmp(NULL, NULL)) comp;					\
+	int depth = 0, elmdepth;					\
+									\
+	while (tmp != NULL && (comp = cmp(elm, tmp)) != 0) {		\
+		path[depth++] = tmp;					\
+		tmp = _RB_PLINK(tmp, comp < 0 ? _RB_L : _RB_R, field);	\
+	}								\
+	if (tmp == NULL)						\
+		return (NULL);						\
+	out = gone = tmp;						\
+	elmdepth = depth;						\
+	if (_RB_PLEFT(out, field) != NULL &&				\
+	    _RB_PRIGHT(out, field) != NULL) {				\
+		/* the successor leaves its place, for that of out */	\
+		path[depth++] = out;					\
+		gone = _RB_PRIGHT(out, field);				\
+		while (_RB_PLEFT(gone, field) != NULL) {		\
+			path[depth++] = gone;				\
+			gone = _RB_PLEFT(gone, field);			\
+		}							\
+	}								\
+	log.rbp_n = 0;							\
+	RB_ROOT(&tree) = NULL;						\
+	if (name##_RB_PCOPY_PATH(head, &log, &tree, path, depth) != 0)	\
+		goto fail;						\
+	if (gone != out) {						\
+		/* the copy of out becomes a copy of the successor */	\
+		entry = path[elmdepth]->field;				\
+		*path[elmdepth] = *gone;				\
+		path[elmdepth]->field = entry;				\
+		parent = path[depth - 1];				\
+		dir = depth - 1 == elmdepth ? _RB_R : _RB_L;		\
+		_RB_PSET(parent, dir, _RB_PRIGHT(gone, field), field);	\
+	} else {							\
+		child = _RB_PLEFT(out, field) != NULL ?			\
+		    _RB_PLEFT(out, field) : _RB_PRIGHT(out, field);	\
+		if (depth == 0) {					\
+			name##_RB_PPUBLISH(head, &log, child);		\
+			retire(head, out);				\
+			return (out);					\
+		}							\
+		parent = path[depth - 1];				\
+		dir = _RB_PRIGHT(parent, field) == out ? _RB_R : _RB_L;	\
+		_RB_PSET(parent, dir, child, field);			\
+	}								\
+	for (;;) {							\
+		/* the dir edge of path[depth - 1] lengthened */	\
+		parent = path[--depth];					\
+		bits = _RB_PBITS(parent, field);			\
+		sibdir = dir ^ _RB_LR;					\
+		if ((bits & dir) == 0) {				\
+			_RB_PBITS(parent, field) |= dir;		\
+			if ((bits & sibdir) == 0 ||			\
+			    _RB_PLEFT(parent, field) != NULL ||		\
+			    _RB_PRIGHT(parent, field) != NULL)		\
+				break;					\
+			/* demote a leaf of rank 2 */			\
+			_RB_PBITS(parent, field) &= ~_RB_LR;		\
+		} else if (bits & sibdir) {				\
+			/* demote parent */				\
+			_RB_PBITS(parent, field) ^= sibdir;		\
+		} else {						\
+			/* sib is off the path, so copy it to change it */ \
+			sib = name##_RB_PCOPY(head, &log,		\
+			    _RB_PLINK(parent, sibdir, field));		\
+			if (sib == NULL)				\
+				goto fail;				\
+			_RB_PSET(parent, sibdir, sib, field);		\
+			sibbits = _RB_PBITS(sib, field);		\
+			if ((sibbits & _RB_LR) == _RB_LR) {		\
+				/* demote parent and sib */		\
+				_RB_PBITS(sib, field) &= ~_RB_LR;	\
+			} else {					\
+				child = _RB_PLINK(sib, dir, field);	\
+				if ((sibbits & sibdir) == 0) {		\
+					/* outer edge short: rotate */	\
+					_RB_PSET(parent, sibdir, child,	\
+					    field);			\
+					_RB_PSET(sib, dir, parent, field); \
+					_RB_PBITS(parent, field) &=	\
+					    ~sibdir;			\
+					_RB_PBITS(parent, field) |=	\
+					    (sibbits & dir) ? sibdir : 0; \
+					_RB_PBITS(sib, field) &= ~_RB_LR; \
+					_RB_PBITS(sib, field) |= sibdir; \
+					if (_RB_PLEFT(parent, field) ==	\
+					    NULL &&			\
+					    _RB_PRIGHT(parent, field) ==\
+					    NULL) {			\
+						_RB_PBITS(parent,	\
+						    field) &= ~_RB_LR;	\
+						_RB_PBITS(sib, field) |= \
+						    dir;		\
+					}				\
+					tmp = sib;			\
+				} else {				\
+					/* rotate twice */		\
+					child = name##_RB_PCOPY(head,	\
+					    &log, child);		\
+					if (child == NULL)		\
+						goto fail;		\
+					bits = _RB_PBITS(child, field);	\
+					_RB_PSET(parent, sibdir,	\
+					    _RB_PLINK(child, dir, field), \
+					    field);			\
+					_RB_PSET(sib, dir,		\
+					    _RB_PLINK(child, sibdir,	\
+					    field), field);		\
+					_RB_PSET(child, dir, parent,	\
+					    field);			\
+					_RB_PSET(child, sibdir, sib,	\
+					    field);			\
+					_RB_PBITS(parent, field) &=	\
+					    ~_RB_LR;			\
+					_RB_PBITS(parent, field) |=	\
+					    (bits & dir) ? sibdir : 0;	\
+					_RB_PBITS(sib, field) &= ~_RB_LR; \
+					_RB_PBITS(sib, field) |=	\
+					    (bits & sibdir) ? dir : 0;	\
+					_RB_PBITS(child, field) |= _RB_LR; \
+					tmp = child;			\
+				}					\
+				_RB_PSWAP_CHILD(&tree, depth > 0 ?	\
+				    path[depth - 1] : NULL, parent, tmp, \
+				    field);				\
+				break;					\
+			}						\
+		}							\
+		/* the rank of parent shrank, retry from its parent */	\
+		if (depth == 0)						\
+			break;						\
+		dir = _RB_PRIGHT(path[depth - 1], field) == parent ?	\
+		    _RB_R : _RB_L;					\
+	}								\
+	name##_RB_PPUBLISH(head, &log, RB_ROOT(&tree));			\
+	retire(head, gone);						\
+	return (out);							\
+fail:									\
+	name##_RB_PABORT(head, &log);					\
+	return (NULL);							\
+}									\
+									\
+/* Returns a head for the newest version, for readers */		\
+attr struct name							\
+name##_RB_SNAPSHOT(struct name *head)					\
+{									\
+	struct name snap;						\
+									\
+	snap.rbh_gen = __atomic_load_n(&head->rbh_gen, __ATOMIC_ACQUIRE); \
+	snap.rbh_root = __atomic_load_n(&RB_ROOT(head), __ATOMIC_ACQUIRE); \
+	return (snap);							\
+}
+
+/*
+ * Latch trees, for lookups that take no lock and write no shared memory.
+ * Each node declared with RB_ENTRY_LATCH is linked into two copies of the
+ * tree, and the sequence count in the head tells readers which copy to
+ * search.  A writer bumps the count to send readers to copy 1, updates
+ * copy 0, bumps it again to send them back, and updates copy 1, so the
+ * copy readers are sent to is never being changed.  A reader that started
+ * on a copy just before the writer turned to it may see that copy half
+ * changed; it notices the count moved and searches again, and gives up a
+ * descent longer than RB_PATH_MAX, since a half-rotated copy can have a
+ * cycle.  RB_INSERT and RB_REMOVE are the writers, and must be serialized
+ * by the caller, as by a mutex.  RB_FIND and RB_NFIND are the readers, and
+ * may run at any time, concurrently with each other and a writer.  A node
+ * removed from the tree must not be freed or reused until every reader
+ * that might be looking at it has finished.  A writer may walk the tree
+ * with RB_FOREACH_LATCH.  The links and roots readers follow are volatile,
+ * so each store the writer makes to them is a single store, never split
+ * or elided.
+ */
+#define RB_LATCH_HEAD(name, type)					\
+struct name {								\
+	struct name##_RB_LATCH0 {					\
+		struct type *volatile rbh_root;				\
+	} rbl_tree0;							\
+	struct name##_RB_LATCH1 {					\
+		struct type *volatile rbh_root;				\
+	} rbl_tree1;							\
+	unsigned int rbl_seq; /* low bit is the copy to search */	\
+}
+
+#define RB_LATCH_INITIALIZER(root)					\
+	{ { NULL }, { NULL }, 0 }
+
+#define RB_LATCH_INIT(root) do {					\
+	RB_INIT(&(root)->rbl_tree0);					\
+	RB_INIT(&(root)->rbl_tree1);					\
+	(root)->rbl_seq = 0;						\
+} while (/*CONSTCOND*/ 0)
+
+#define RB_ENTRY_LATCH(type)						\
+struct {								\
+	struct {							\
+		struct type *volatile rbe_link[3];			\
+	} rbl_copy[2];							\
+}
+
+/* Sends readers to the other copy, ordered between a writer's stores */
+#define _RB_LATCH(head) do {						\
+	__atomic_thread_fence(__ATOMIC_RELEASE);			\
+	__atomic_store_n(&(head)->rbl_seq, (head)->rbl_seq + 1,		\
+	    __ATOMIC_RELAXED);						\
+	__atomic_thread_fence(__ATOMIC_RELEASE);			\
+} while (/*CONSTCOND*/ 0)
+
+#define RB_PROTOTYPE_LATCH(name, type, field, cmp)			\
+	RB_PROTOTYPE_LATCH_INTERNAL(name, type, field, cmp,)
+#define RB_PROTOTYPE_LATCH_STATIC(name, type, field, cmp)		\
+	RB_PROTOTYPE_LATCH_INTERNAL(name, type, field, cmp, __unused static)
+#define RB_PROTOTYPE_LATCH_INTERNAL(name, type, field, cmp, attr)	\
+	RB_PROTOTYPE_INTERNAL(name##_RB_LATCH0, type, field.rbl_copy[0],	\
+	    cmp, __unused static)					\
+	RB_PROTOTYPE_INTERNAL(name##_RB_LATCH1, type, field.rbl_copy[1],	\
+	    cmp, __unused static)					\
+	RB_PROTOTYPE_INSERT(name, type, attr);				\
+	RB_PROTOTYPE_REMOVE(name, type, attr);				\
+	RB_PROTOTYPE_FIND(name, type, attr);				\
+	RB_PROTOTYPE_NFIND(name, type, attr);
+
+#define RB_GENERATE_LATCH(name, type, field, cmp)			\
+	RB_GENERATE_LATCH_INTERNAL(name, type, field, cmp,)
+#define RB_GENERATE_LATCH_STATIC(name, type, field, cmp)		\
+	RB_GENERATE_LATCH_INTERNAL(name, type, field, cmp, __unused static)
+#define RB_GENERATE_LATCH_INTERNAL(name, type, field, cmp, attr)	\
+	RB_GENERATE_INTERNAL(name##_RB_LATCH0, type, field.rbl_copy[0],	\
+	    cmp, __unused static)					\
+	RB_GENERATE_INTERNAL(name##_RB_LATCH1, type, field.rbl_copy[1],	\
+	    cmp, __unused static)					\
+									\
+/*									\
+ * Searches the copy the sequence count names for elm, and returns the	\
+ * equal node, or with nfind the least greater one if there is none.	\
+ */									\
+static __unused __inline struct type *					\
+name##_RB_LATCH_SEARCH(struct name *head, struct type *elm, int nfind)	\
+{									\
+	struct type *tmp, *res;						\
+	__typeof(cmp(NULL, NULL)) comp;					\
+	unsigned int seq, copy;						\
+	int depth;							\
+									\
+	do {								\
+		seq = __atomic_load_n(&head->rbl_seq, __ATOMIC_ACQUIRE); \
+		copy = seq & 1;						\
+		tmp = __atomic_load_n(copy ? &RB_ROOT(&head->rbl_tree1) : \
+		    &RB_ROOT(&head->rbl_tree0), __ATOMIC_RELAXED);	\
+		res = NULL;						\
+		for (depth = 0; tmp != NULL && depth < RB_PATH_MAX;	\
+		    depth++) {						\
+			comp = cmp(elm, tmp);				\
+			if (comp == 0) {				\
+				res = tmp;				\
+				break;					\
+			}						\
+			if (comp < 0 && nfind)				\
+				res = tmp;				\
+			tmp = __atomic_load_n(&_RB_LINK(tmp,		\
+			    comp < 0 ? _RB_L : _RB_R, field.rbl_copy[copy]), \
+			    __ATOMIC_RELAXED);				\
+		}							\
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);		\
+	} while (__atomic_load_n(&head->rbl_seq, __ATOMIC_RELAXED) != seq); \
+	return (res);							\
+}									\
+									\
+/* Inserts a node into both copies; callers serialize writers */	\
+attr struct type *							\
+name##_RB_INSERT(struct name *head, struct type *elm)			\
+{									\
+	struct type *tmp, *parent = NULL;				\
+	struct type *volatile *tmpp = &RB_ROOT(&head->rbl_tree0);	\
+	__typeof(cmp(NULL, NULL)) comp;					\
+									\
+	while ((tmp = *tmpp) != NULL) {					\
+		parent = tmp;						\
+		comp = cmp(elm, parent);				\
+		if (comp < 0)						\
+			tmpp = &RB_LEFT(parent, field.rbl_copy[0]);	\
+		else if (comp > 0)					\
+			tmpp = &RB_RIGHT(parent, field.rbl_copy[0]);	\
+		else							\
+			return (parent);				\
+	}								\
+	/* Links a reader may follow as soon as elm is reachable */	\
+	RB_LEFT(elm, field.rbl_copy[0]) = NULL;				\
+	RB_RIGHT(elm, field.rbl_copy[0]) = NULL;			\
+	RB_LEFT(elm, field.rbl_copy[1]) = NULL;				\
+	RB_RIGHT(elm, field.rbl_copy[1]) = NULL;			\
+	_RB_LATCH(head);						\
+	name##_RB_LATCH0_RB_INSERT_FINISH(&head->rbl_tree0, parent, tmpp, \
+	    elm);							\
+	_RB_LATCH(head);						\
+	name##_RB_LATCH1_RB_INSERT(&head->rbl_tree1, elm);		\
+	return (NULL);							\
+}									\
+									\
+/* Removes a node from both copies; callers serialize writers */	\
+attr struct type *							\
+name##_RB_REMOVE(struct name *head, struct type *elm)			\
+{									\
+	_RB_LATCH(head);						\
+	name##_RB_LATCH0_RB_REMOVE(&head->rbl_tree0, elm);		\
+	_RB_LATCH(head);						\
+	name##_RB_LATCH1_RB_REMOVE(&head->rbl_tree1, elm);		\
+	return (elm);							\
+}									\
+									\
+/* Finds the node with the same key as elm, without locking */		\
+attr struct type *							\
+name##_RB_FIND(struct name *head, struct type *elm)			\
+{									\
+	return (name##_RB_LATCH_SEARCH(head, elm, 0));			\
+}									\
+									\
+/* Finds the first node greater than or equal to the search key */	\
+attr struct type *							\
+name##_RB_NFIND(struct name *head, struct type *elm)			\
+{									\
+	return (name##_RB_LATCH_SEARCH(head, elm, 1));			\
+}
+
+/*
+ * Shared trees.  Every RB_GENERATE emits its own rebalancing, removal and
+ * iteration code, which differ between tree types only in the offset of
+ * the links within a node.  A node that embeds an RB_ENTRY_SHARED is
+ * linked through the entries themselves, not the nodes, so that code can
+ * be emitted once, by RB_GENERATE_SHARED_CORE in exactly one file, for
+ * all such trees.  RB_GENERATE_SHARED generates only what calls cmp, the
+ * insert and the searches, and wrappers that convert between a node and
+ * its entry.  RB_INSERT, RB_REMOVE, RB_FIND, RB_NFIND, RB_PFIND,
+ * RB_NEXT, RB_PREV, RB_MIN, RB_MAX and the RB_FOREACH loops work on these
+ * trees; they cannot be augmented, and the optional generators do not
+ * apply to them.  RB_ROOT of a shared head is a struct _rb_node *, the
+ * entry of the root; RB_ROOT_SHARED gives the node that embeds it.  Define
+ * RB_SHARED before including this file to declare shared trees.
+ */
+#ifdef RB_SHARED
+struct _rb_node {
+	RB_ENTRY(_rb_node) rbn_entry;
+};
+RB_HEAD(_rb_shared, _rb_node);
+
+#define RB_ENTRY_SHARED(type)		struct _rb_node
+#define RB_HEAD_SHARED(name, type)	RB_HEAD(name, _rb_node)
+#define RB_ROOT_SHARED(name, head)	name##_RB_ELM(RB_ROOT(head))
+
+RB_PROTOTYPE_RANK(_rb_shared, _rb_node,)
+RB_PROTOTYPE_INSERT_COLOR(_rb_shared, _rb_node,);
+RB_PROTOTYPE_REMOVE_COLOR(_rb_shared, _rb_node,);
+RB_PROTOTYPE_INSERT_FINISH(_rb_shared, _rb_node,);
+RB_PROTOTYPE_REMOVE(_rb_shared, _rb_node,);
+RB_PROTOTYPE_NEXT(_rb_shared, _rb_node,);
+RB_PROTOTYPE_PREV(_rb_shared, _rb_node,);
+RB_PROTOTYPE_MINMAX(_rb_shared, _rb_node,);
+
+#define _RB_AUGMENT_NONE(x)	0
+
+#define RB_GENERATE_SHARED_CORE()					\
+	_RB_GENERATE_AUGMENT_CHECK(_rb_shared, _rb_node,		\
+	    _RB_AUGMENT_NONE, 0, _RB_AUGMENT_NONE)			\
+	_RB_GENERATE_CACHE_NONE(_rb_shared, _rb_node)			\
+	RB_GENERATE_RANK(_rb_shared, _rb_node, rbn_entry,)		\
+	RB_GENERATE_INSERT_COLOR(_rb_shared, _rb_node, rbn_entry,)	\
+	RB_GENERATE_REMOVE_COLOR(_rb_shared, _rb_node, rbn_entry,)	\
+	RB_GENERATE_INSERT_FINISH(_rb_shared, _rb_node, rbn_entry,)	\
+	RB_GENERATE_REMOVE(_rb_shared, _rb_node, rbn_entry,)		\
+	RB_GENERATE_NEXT(_rb_shared, _rb_node, rbn_entry,)		\
+	RB_GENERATE_PREV(_rb_shared, _rb_node, rbn_entry,)		\
+	RB_GENERATE_MINMAX(_rb_shared, _rb_node, rbn_entry,)
+
+/* The node that embeds a non-null entry */
+#define _RB_SHARED_ELM(entry, type, field)				\
+	((struct type *)((char *)(entry) - offsetof(struct type, field)))
+
+#define RB_PROTOTYPE_SHARED(name, type, field, cmp)			\
+	RB_PROTOTYPE_SHARED_INTERNAL(name, type, field, cmp,)
+#define RB_PROTOTYPE_SHARED_STATIC(name, type, field, cmp)		\
+	RB_PROTOTYPE_SHARED_INTERNAL(name, type, field, cmp, __unused static)
+#define RB_PROTOTYPE_SHARED_INTERNAL(name, type, field, cmp, attr)	\
+	RB_PROTOTYPE_INSERT(name, type, attr);				\
+	RB_PROTOTYPE_REMOVE(name, type, attr);				\
+	RB_PROTOTYPE_FIND(name, type, attr);				\
+	RB_PROTOTYPE_NFIND(name, type, attr);				\
+	RB_PROTOTYPE_PFIND(name, type, attr);				\
+	RB_PROTOTYPE_NEXT(name, type, attr);				\
+	RB_PROTOTYPE_PREV(name, type, attr);				\
+	RB_PROTOTYPE_MINMAX(name, type, attr);
+
+#define RB_GENERATE_SHARED(name, type, field, cmp)			\
+	RB_GENERATE_SHARED_INTERNAL(name, type, field, cmp,)
+#define RB_GENERATE_SHARED_STATIC(name, type, field, cmp)		\
+	RB_GENERATE_SHARED_INTERNAL(name, type, field, cmp, __unused static)
+#define RB_GENERATE_SHARED_INTERNAL(name, type, field, cmp, attr)	\
+/* The node that embeds entry, or NULL */				\
+static __unused __inline struct type *					\
+name##_RB_ELM(struct _rb_node *entry)					\
+{									\
+	return (entry == NULL ? NULL : _RB_SHARED_ELM(entry, type, field)); \
+}									\
+									\
+/* Searches for elm: the equal node, or the nearest on the side dir */	\
+static __unused __inline struct type *					\
+name##_RB_SEARCH(struct name *head, struct type *elm, int dir)		\
+{									\
+	struct _rb_node *tmp = RB_ROOT(head), *res = NULL;		\
+	__typeof(cmp(NULL, NULL)) comp;					\
+									\
+	while (tmp) {							\
+		_RB_PREFETCH_CHILDREN(tmp, rbn_entry);			\
+		comp = cmp(elm, _RB_SHARED_ELM(tmp, type, field));	\
+		if (comp == 0)						\
+			return (_RB_SHARED_ELM(tmp, type, field));	\
+		if ((comp < 0 && dir > 0) || (comp > 0 && dir < 0))	\
+			res = tmp;					\
+		tmp = comp < 0 ? RB_LEFT(tmp, rbn_entry) :		\
+		    RB_RIGHT(tmp, rbn_entry);				\
+	}								\
+	return (name##_RB_ELM(res));					\
+}									\
+									\
+/* Inserts a node into the RB tree */					\
+attr struct type *							\
+name##_RB_INSERT(struct name *head, struct type *elm)			\
+{									\
+	struct _rb_shared core;						\
+	struct _rb_node *tmp, *parent = NULL;				\
+	struct _rb_node **tmpp = &RB_ROOT(&core);			\
+	__typeof(cmp(NULL, NULL)) comp;					\
+									\
+	RB_ROOT(&core) = RB_ROOT(head);					\
+	while ((tmp = *tmpp) != NULL) {					\
+		_RB_PREFETCH_CHILDREN(tmp, rbn_entry);			\
+		parent = tmp;						\
+		comp = cmp(elm, _RB_SHARED_ELM(parent, type, field));	\
+		if (comp < 0)						\
+			tmpp = &RB_LEFT(parent, rbn_entry);		\
+		else if (comp > 0)					\
+			tmpp = &RB_RIGHT(parent, rbn_entry);		\
+		else							\
+			return (_RB_SHARED_ELM(parent, type, field));	\
+	}								\
+	_rb_shared_RB_INSERT_FINISH(&core, parent, tmpp, &elm->field);	\
+	RB_ROOT(head) = RB_ROOT(&core);					\
+	return (NULL);							\
+}									\
+									\
+attr struct type *							\
+name##_RB_REMOVE(struct name *head, struct type *elm)			\
+{									\
+	struct _rb_shared core;						\
+									\
+	RB_ROOT(&core) = RB_ROOT(head);					\
+	_rb_shared_RB_REMOVE(&core, &elm->field);			\
+	RB_ROOT(head) = RB_ROOT(&core);					\
+	return (elm);							\
+}									\
+									\
+/* Finds the node with the same key as elm */				\
+attr struct type *							\
+name##_RB_FIND(struct name *head, struct type *elm)			\
+{									\
+	return (name##_RB_SEARCH(head, elm, 0));			\
+}									\
+									\
+/* Finds the first node greater than or equal to the search key */	\
+attr struct type *							\
+name##_RB_NFIND(struct name *head, struct type *elm)			\
+{									\
+	return (name##_RB_SEARCH(head, elm, 1));			\
+}									\
+									\
+/* Finds the last node less than or equal to the search key */		\
+attr struct type *							\
+name##_RB_PFIND(struct name *head, struct type *elm)			\
+{									\
+	return (name##_RB_SEARCH(head, elm, -1));			\
+}									\
+									\
+attr struct type *							\
+name##_RB_NEXT(struct type *elm)					\
+{									\
+	return (name##_RB_ELM(_rb_shared_RB_NEXT(&elm->field)));	\
+}									\
+									\
+attr struct type *							\
+name##_RB_PREV(struct type *elm)					\
+{									\
+	return (name##_RB_ELM(_rb_shared_RB_PREV(&elm->field)));	\
+}									\
+									\
+attr struct type *							\
+name##_RB_MINMAX(struct name *head, int val)				\
+{									\
+	struct _rb_shared core;						\
+									\
+	RB_ROOT(&core) = RB_ROOT(head);					\
+	return (name##_RB_ELM(_rb_shared_RB_MINMAX(&core, val)));	\
+}
+#endif /* RB_SHARED */
+
+#define RB_NEGINF	-1
+#define RB_INF	1
+
+#define RB_INSERT(name, x, y)	name##_RB_INSERT(x, y)
+#define RB_INSERT_NEXT(name, x, y, z)	name##_RB_INSERT_NEXT(x, y, z)
+#define RB_INSERT_PREV(name, x, y, z)	name##_RB_INSERT_PREV(x, y, z)
+#define RB_REMOVE(name, x, y)	name##_RB_REMOVE(x, y)
+#define RB_FIND(name, x, y)	name##_RB_FIND(x, y)
+#define RB_NFIND(name, x, y)	name##_RB_NFIND(x, y)
+#define RB_PFIND(name, x, y)	name##_RB_PFIND(x, y)
+#define RB_FIND_KEY(name, x, k)	name##_RB_FIND_KEY(x, k)
+#define RB_NFIND_KEY(name, x, k)	name##_RB_NFIND_KEY(x, k)
+#define RB_PFIND_KEY(name, x, k)	name##_RB_PFIND_KEY(x, k)
+#define RB_FIND_FROM(name, x, h, y)	name##_RB_FIND_FROM(x, h, y)
+#define RB_INSERT_HINT(name, x, h, y)	name##_RB_INSERT_HINT(x, h, y)
+#define RB_FIND_BATCH(name, x, keys, res, n)				\
+	name##_RB_FIND_BATCH(x, keys, res, n)
+#define RB_PARTITION(name, x, k, bounds)	name##_RB_PARTITION(x, k, bounds)
+#define RB_SNAPSHOT(name, x)	name##_RB_SNAPSHOT(x)
+#define RB_ITER(name)		struct name##_RB_ITER
+#define RB_ITER_FIRST(name, x, it)	name##_RB_ITER_FIRST(x, it)
+#define RB_ITER_NEXT(name, it)	name##_RB_ITER_NEXT(it)
+#define RB_NEXT(name, x, y)	name##_RB_NEXT(y)
+#define RB_PREV(name, x, y)	name##_RB_PREV(y)
+#define RB_MIN(name, x)		name##_RB_MINMAX(x, RB_NEGINF)
+#define RB_MAX(name, x)		name##_RB_MINMAX(x, RB_INF)
+#define RB_REINSERT(name, x, y)	name##_RB_REINSERT(x, y)
+#define RB_SELECT(name, x, y)	name##_RB_SELECT(x, y)
+#define RB_ORDER_RANK(name, x, y)	name##_RB_ORDER_RANK(y)
+#define RB_COUNT_RANGE(name, x, y, z)	name##_RB_COUNT_RANGE(x, y, z)
+#define RB_COUNT(name, x)	name##_RB_COUNT(x)
+#define RB_FIND_OVERLAP(name, x, lo, hi)	name##_RB_FIND_OVERLAP(x, lo, hi)
+#define RB_NEXT_OVERLAP(name, x, y, lo, hi)	name##_RB_NEXT_OVERLAP(y, lo, hi)
+#define RB_STAB(name, x, pt)	name##_RB_FIND_OVERLAP(x, pt, pt)
+#define RB_REDUCE_RANGE(name, x, lo, hi)	name##_RB_REDUCE_RANGE(x, lo, hi)
+#define RB_REDUCE(name, x)	name##_RB_REDUCE(x)
+#define RB_BUILD_SORTED(name, x, y, n)	name##_RB_BUILD_SORTED(x, y, n)
+#define RB_BUILD_SORTED_ITER(name, x, n, next, arg)			\
+	name##_RB_BUILD_SORTED_ITER(x, n, next, arg)
+#define RB_FIND_COUNT(name, x, y)	name##_RB_FIND_COUNT(x, y)
+#define RB_REBUILD(name, x, elms, n)	name##_RB_REBUILD(x, elms, n)
+#define RB_JOIN(name, x, y, z)	name##_RB_JOIN(x, y, z)
+#define RB_SPLIT(name, x, y, lt, ge)	name##_RB_SPLIT(x, y, lt, ge)
+#define RB_RANGE_COLLECT(name, x, lo, hi, out, max)			\
+	name##_RB_RANGE_COLLECT(x, lo, hi, out, max)
+#define RB_FREEZE(name, x, keys, elms, n)				\
+	name##_RB_FREEZE(x, keys, elms, n)
+#define RB_FROZEN_LOWER_BOUND(name, keys, n, k)				\
+	name##_RB_FROZEN_LOWER_BOUND(keys, n, k)
+#define RB_FROZEN_FIND(name, keys, elms, n, k)				\
+	name##_RB_FROZEN_FIND(keys, elms, n, k)
+#define RB_FROZEN_NFIND(name, keys, elms, n, k)				\
+	name##_RB_FROZEN_NFIND(keys, elms, n, k)
+#define RB_UNION(name, x, y, z)						\
+	name##_RB_SETOP(x, y, z, RB_SET_UNION, NULL, NULL, 0)
+#define RB_INTERSECT(name, x, y, z)					\
+	name##_RB_SETOP(x, y, z, RB_SET_INTERSECT, NULL, NULL, 0)
+#define RB_DIFFERENCE(name, x, y, z)					\
+	name##_RB_SETOP(x, y, z, RB_SET_DIFFERENCE, NULL, NULL, 0)
+#define RB_SETOP(name, x, y, z, op, fork, arg, cutoff)			\
+	name##_RB_SETOP(x, y, z, op, fork, arg, cutoff)
+
+#define RB_FOREACH(x, name, head)					\
+	for ((x) = RB_MIN(name, head);					\
+	     (x) != NULL;						\
+	     (x) = name##_RB_NEXT(x))
+
+#define RB_FOREACH_FROM(x, name, y)					\
+	for ((x) = (y);							\
+	    ((x) != NULL) && ((y) = name##_RB_NEXT(x), (x) != NULL);	\
+	     (x) = (y))
+
+#define RB_FOREACH_SAFE(x, name, head, y)				\
+	for ((x) = RB_MIN(name, head);					\
+	    ((x) != NULL) && ((y) = name##_RB_NEXT(x), (x) != NULL);	\
+	     (x) = (y))
+
+#define RB_FOREACH_REVERSE(x, name, head)				\
+	for ((x) = RB_MAX(name, head);					\
+	     (x) != NULL;						\
+	     (x) = name##_RB_PREV(x))
+
+#define RB_FOREACH_REVERSE_FROM(x, name, y)				\
+	for ((x) = (y);							\
+	    ((x) != NULL) && ((y) = name##_RB_PREV(x), (x) != NULL);	\
+	     (x) = (y))
+
+#define RB_FOREACH_REVERSE_SAFE(x, name, head, y)			\
+	for ((x) = RB_MAX(name, head);					\
+	    ((x) != NULL) && ((y) = name##_RB_PREV(x), (x) != NULL);	\
+	     (x) = (y))
+
+#define RB_FOREACH_RANGE(x, name, head, lo, hi)				\
+	for (__typeof(x) _rb_stop = name##_RB_RANGE(head, lo, hi, &(x)); \
+	     (x) != _rb_stop;						\
+	     (x) = name##_RB_NEXT(x))
+
+#define RB_FOREACH_REVERSE_RANGE(x, name, head, lo, hi)			\
+	for (__typeof(x) _rb_stop =					\
+	     name##_RB_RANGE_REVERSE(head, lo, hi, &(x));		\
+	     (x) != _rb_stop;						\
+	     (x) = name##_RB_PREV(x))
+
+#define RB_FOREACH_PARTITION(x, name, bounds, i)			\
+	for ((x) = (bounds)[i];						\
+	     (x) != (bounds)[(i) + 1];					\
+	     (x) = name##_RB_NEXT(x))
+
+#define RB_FOREACH_PATH(x, name, head, it)				\
+	for ((x) = name##_RB_ITER_FIRST(head, it);			\
+	     (x) != NULL;						\
+	     (x) = name##_RB_ITER_NEXT(it))
+
+/* Walks copy 0 of a latch tree, for writers only */
+#define RB_FOREACH_LATCH(x, name, head)					\
+	for ((x) = name##_RB_LATCH0_RB_MINMAX(&(head)->rbl_tree0, RB_NEGINF); \
+	     (x) != NULL;						\
+	     (x) = name##_RB_LATCH0_RB_NEXT(x))
+
+#define RB_FOREACH_OVERLAP(x, name, head, lo, hi)			\
+	for ((x) = name##_RB_FIND_OVERLAP(head, lo, hi);		\
+	     (x) != NULL;						\
+	     (x) = name##_RB_NEXT_OVERLAP(x, lo, hi))
+
+#define RB_FOREACH_STAB(x, name, head, pt)				\
+	RB_FOREACH_OVERLAP(x, name, head, pt, pt)
 
 #endif	/* _SYS_TREE_H_ */